@@ -0,0 +1,128 @@
+/*
+ * Scaling of the lookups of a shared tree with the reader threads, for a
+ * tree behind a std::mutex, for concurrent_rb_tree and for epoch_rb_tree,
+ * with or without a writer inserting and erasing in the background.
+ *
+ *   g++ -std=c++11 -O2 -pthread -Iinclude bench/concurrent_bench.cpp
+ *   ./a.out [elements] [milliseconds per run]
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "rb_concurrent_tree.h"
+
+namespace {
+
+typedef rb_tree::rb_tree<unsigned> tree_type;
+
+class mutex_tree {
+ public:
+  explicit mutex_tree(tree_type&& tree) : tree_(std::move(tree)) { }
+
+  bool contains(unsigned val) const {
+    std::lock_guard<std::mutex> g(mutex_);
+    return tree_.find(val) != tree_.end();
+  }
+  bool insert(unsigned val) {
+    std::lock_guard<std::mutex> g(mutex_);
+    return tree_.insert(val).second;
+  }
+  std::size_t erase(unsigned val) {
+    std::lock_guard<std::mutex> g(mutex_);
+    return tree_.erase(val);
+  }
+
+ private:
+  tree_type tree_;
+  mutable std::mutex mutex_;
+};
+
+/* The even numbers below 2 * n, so that half of the lookups miss */
+std::vector<unsigned> make_keys(unsigned n) {
+  std::vector<unsigned> v(n);
+  for (unsigned i = 0; i < n; ++i)
+    v[i] = 2 * i;
+  return v;
+}
+
+tree_type make_tree(unsigned n) {
+  std::vector<unsigned> v = make_keys(n);
+  return tree_type(rb_tree::sorted_unique, v.begin(), v.end());
+}
+
+/* Lookups per second over all the readers */
+template <class Tree>
+double run(Tree& tree, unsigned n, unsigned readers, bool writer,
+           unsigned millis) {
+  std::atomic<bool> stop(false);
+  std::atomic<unsigned long> total(0), hits(0);
+  std::vector<std::thread> threads;
+
+  for (unsigned t = 0; t < readers; ++t) {
+    threads.emplace_back([&, t] {
+      std::mt19937 gen(t + 1);
+      std::uniform_int_distribution<unsigned> dist(0, 2 * n - 1);
+      unsigned long ops = 0, found = 0;
+      while (!stop.load(std::memory_order_relaxed)) {
+        for (int i = 0; i < 64; ++i)
+          found += tree.contains(dist(gen));
+        ops += 64;
+      }
+      total += ops;
+      hits += found;
+    });
+  }
+
+  std::thread w;
+  if (writer) {
+    w = std::thread([&] {
+      std::mt19937 gen(0);
+      std::uniform_int_distribution<unsigned> dist(0, n - 1);
+      while (!stop.load(std::memory_order_relaxed)) {
+        unsigned odd = 2 * dist(gen) + 1;
+        tree.insert(odd);
+        tree.erase(odd);
+        std::this_thread::sleep_for(std::chrono::microseconds(10));
+      }
+    });
+  }
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+  stop = true;
+  for (std::thread& t : threads)
+    t.join();
+  if (writer)
+    w.join();
+  return total.load() * 1000.0 / millis;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  unsigned n = argc > 1 ? std::atoi(argv[1]) : 1000000;
+  unsigned millis = argc > 2 ? std::atoi(argv[2]) : 500;
+
+  mutex_tree locked(make_tree(n));
+  rb_tree::concurrent_rb_tree<unsigned> shared(make_tree(n));
+  std::vector<unsigned> keys = make_keys(n);
+  rb_tree::epoch_rb_tree<unsigned> published(keys.begin(), keys.end());
+
+  std::printf("%8s %8s %16s %16s %16s\n", "readers", "writer", "mutex/s",
+              "concurrent/s", "epoch/s");
+  for (unsigned readers = 1; readers <= 64; readers *= 2) {
+    for (int writer = 0; writer < 2; ++writer) {
+      double a = run(locked, n, readers, writer, millis);
+      double b = run(shared, n, readers, writer, millis);
+      double c = run(published, n, readers, writer, millis);
+      std::printf("%8u %8s %16.0f %16.0f %16.0f\n", readers,
+                  writer ? "yes" : "no", a, b, c);
+    }
+  }
+  return 0;
+}
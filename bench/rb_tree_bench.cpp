@@ -0,0 +1,369 @@
+/*
+ * rb_tree, plain, threaded and with tombstones, and rb_btree against std::set,
+ * absl::btree_set (when it is found) and a sorted std::vector, on the same
+ * keys: inserts in random and sorted order and with an end() hint, find()
+ * hits and misses, lower_bound(), iteration, erase by key and by range,
+ * copy, move and clear().
+ *
+ *   cmake --build build --target rb_tree_bench
+ *   build/rb_tree_bench --benchmark_out=bench.json --benchmark_out_format=json
+ *
+ * The sizes go from 1K to 100M by powers of ten; --max_size=N stops them
+ * earlier, and --benchmark_filter picks the cases, e.g. 'find_hit/rb_tree'.
+ * The updates of the sorted vector are linear, so it only runs them up to
+ * 100K elements.
+ */
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#ifdef RB_TREE_BENCH_ABSL
+#include <absl/container/btree_set.h>
+#endif
+
+#include "rb_btree.h"
+#include "rb_tree.h"
+
+namespace {
+
+/* The set API the benchmarks use, on a sorted std::vector */
+template <class Key>
+class sorted_vector {
+ public:
+  typedef typename std::vector<Key>::const_iterator iterator;
+  typedef iterator const_iterator;
+
+  iterator begin() const { return v_.begin(); }
+  iterator end() const { return v_.end(); }
+  std::size_t size() const { return v_.size(); }
+
+  std::pair<iterator, bool> insert(const Key& val) {
+    typename std::vector<Key>::iterator it =
+      std::lower_bound(v_.begin(), v_.end(), val);
+    if (it != v_.end() && !(val < *it))
+      return std::make_pair(iterator(it), false);
+    return std::make_pair(iterator(v_.insert(it, val)), true);
+  }
+  iterator insert(iterator hint, const Key& val) {
+    if (hint == v_.end() && (v_.empty() || v_.back() < val)) {
+      v_.push_back(val);
+      return v_.end() - 1;
+    }
+    return insert(val).first;
+  }
+
+  iterator lower_bound(const Key& val) const {
+    return std::lower_bound(v_.begin(), v_.end(), val);
+  }
+  iterator find(const Key& val) const {
+    iterator it = lower_bound(val);
+    return it != v_.end() && !(val < *it) ? it : v_.end();
+  }
+
+  std::size_t erase(const Key& val) {
+    iterator it = find(val);
+    if (it == v_.end())
+      return 0;
+    v_.erase(it);
+    return 1;
+  }
+  iterator erase(iterator first, iterator last) {
+    return v_.erase(first, last);
+  }
+
+  void clear() { v_.clear(); }
+
+ private:
+  std::vector<Key> v_;
+};
+
+template <class Set>
+struct set_traits {
+  static constexpr bool linear_updates = false;
+};
+
+template <class Key>
+struct set_traits<sorted_vector<Key> > {
+  static constexpr bool linear_updates = true;
+};
+
+/*
+ * The key of the element i of a set, where the element i of a set of n is
+ * key(2 * i); key(2 * i + 1) is a miss between two elements. The strings
+ * are zero-padded to keep the numeric order.
+ */
+template <class Key>
+Key key_at(std::uint64_t i) {
+  return static_cast<Key>(i);
+}
+
+template <>
+std::string key_at<std::string>(std::uint64_t i) {
+  char buf[24];
+  std::snprintf(buf, sizeof(buf), "%020llu",
+                static_cast<unsigned long long>(i));
+  return buf;
+}
+
+/* The n keys of a set, in order or shuffled, plus one to get the misses */
+template <class Key>
+std::vector<Key> make_keys(std::size_t n, bool shuffled, int offset = 0) {
+  std::vector<std::uint64_t> order(n);
+  for (std::size_t i = 0; i < n; ++i)
+    order[i] = i;
+  if (shuffled)
+    std::shuffle(order.begin(), order.end(), std::mt19937_64(n));
+
+  std::vector<Key> keys;
+  keys.reserve(n);
+  for (std::size_t i = 0; i < n; ++i)
+    keys.push_back(key_at<Key>(2 * order[i] + offset));
+  return keys;
+}
+
+template <class Set, class Key>
+Set make_set(const std::vector<Key>& sorted) {
+  Set s;
+  for (const Key& k : sorted)
+    s.insert(s.end(), k);
+  return s;
+}
+
+/* Free the elements of s outside of the timed region */
+template <class Set>
+void untimed_clear(benchmark::State& state, Set& s) {
+  state.PauseTiming();
+  s.clear();
+  state.ResumeTiming();
+}
+
+template <class Set, class Key>
+void insert_random(benchmark::State& state) {
+  std::vector<Key> keys = make_keys<Key>(state.range(0), true);
+  for (auto _ : state) {
+    Set s;
+    for (const Key& k : keys)
+      s.insert(k);
+    benchmark::DoNotOptimize(s.size());
+    untimed_clear(state, s);
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+template <class Set, class Key>
+void insert_sorted(benchmark::State& state) {
+  std::vector<Key> keys = make_keys<Key>(state.range(0), false);
+  for (auto _ : state) {
+    Set s;
+    for (const Key& k : keys)
+      s.insert(k);
+    benchmark::DoNotOptimize(s.size());
+    untimed_clear(state, s);
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+template <class Set, class Key>
+void insert_hint(benchmark::State& state) {
+  std::vector<Key> keys = make_keys<Key>(state.range(0), false);
+  for (auto _ : state) {
+    Set s;
+    for (const Key& k : keys)
+      s.insert(s.end(), k);
+    benchmark::DoNotOptimize(s.size());
+    untimed_clear(state, s);
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+/* One lookup per iteration, of the shuffled hits or misses in turn */
+template <class Set, class Key, int Offset>
+void find_key(benchmark::State& state) {
+  Set s = make_set<Set>(make_keys<Key>(state.range(0), false));
+  std::vector<Key> queries = make_keys<Key>(state.range(0), true, Offset);
+  std::size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(s.find(queries[i]) != s.end());
+    if (++i == queries.size())
+      i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+template <class Set, class Key>
+void lower_bound_key(benchmark::State& state) {
+  Set s = make_set<Set>(make_keys<Key>(state.range(0), false));
+  std::vector<Key> queries = make_keys<Key>(state.range(0), true, 1);
+  std::size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(s.lower_bound(queries[i]) != s.end());
+    if (++i == queries.size())
+      i = 0;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+template <class Set, class Key>
+void iterate(benchmark::State& state) {
+  Set s = make_set<Set>(make_keys<Key>(state.range(0), false));
+  for (auto _ : state) {
+    std::size_t n = 0;
+    for (typename Set::const_iterator it = s.begin(); it != s.end(); ++it) {
+      benchmark::DoNotOptimize(*it);
+      ++n;
+    }
+    benchmark::DoNotOptimize(n);
+  }
+  state.SetItemsProcessed(state.iterations() * s.size());
+}
+
+template <class Set, class Key>
+void erase_key(benchmark::State& state) {
+  std::vector<Key> sorted = make_keys<Key>(state.range(0), false);
+  std::vector<Key> keys = make_keys<Key>(state.range(0), true);
+  for (auto _ : state) {
+    state.PauseTiming();
+    Set s = make_set<Set>(sorted);
+    state.ResumeTiming();
+    for (const Key& k : keys)
+      s.erase(k);
+    benchmark::DoNotOptimize(s.size());
+  }
+  state.SetItemsProcessed(state.iterations() * keys.size());
+}
+
+/* Erase the middle half */
+template <class Set, class Key>
+void erase_range(benchmark::State& state) {
+  std::vector<Key> sorted = make_keys<Key>(state.range(0), false);
+  for (auto _ : state) {
+    state.PauseTiming();
+    Set s = make_set<Set>(sorted);
+    typename Set::const_iterator first =
+      s.lower_bound(sorted[sorted.size() / 4]);
+    typename Set::const_iterator last =
+      s.lower_bound(sorted[sorted.size() / 4 * 3]);
+    state.ResumeTiming();
+    s.erase(first, last);
+    benchmark::DoNotOptimize(s.size());
+    untimed_clear(state, s);
+  }
+  state.SetItemsProcessed(state.iterations() * (sorted.size() / 2));
+}
+
+template <class Set, class Key>
+void copy_set(benchmark::State& state) {
+  Set s = make_set<Set>(make_keys<Key>(state.range(0), false));
+  for (auto _ : state) {
+    Set c(s);
+    benchmark::DoNotOptimize(c.size());
+    untimed_clear(state, c);
+  }
+  state.SetItemsProcessed(state.iterations() * s.size());
+}
+
+template <class Set, class Key>
+void move_set(benchmark::State& state) {
+  Set s = make_set<Set>(make_keys<Key>(state.range(0), false));
+  for (auto _ : state) {
+    Set m(std::move(s));
+    benchmark::DoNotOptimize(m.size());
+    s = std::move(m);
+  }
+}
+
+template <class Set, class Key>
+void clear_set(benchmark::State& state) {
+  std::vector<Key> sorted = make_keys<Key>(state.range(0), false);
+  for (auto _ : state) {
+    state.PauseTiming();
+    Set s = make_set<Set>(sorted);
+    state.ResumeTiming();
+    s.clear();
+    benchmark::DoNotOptimize(s.size());
+  }
+  state.SetItemsProcessed(state.iterations() * sorted.size());
+}
+
+template <class Set, class Key>
+void register_set(const std::string& set_name, const std::string& key_name,
+                  std::int64_t max_size) {
+  typedef void (*function)(benchmark::State&);
+  struct { const char *name; function f; bool update; } cases[] = {
+    { "insert_random", &insert_random<Set, Key>, true },
+    { "insert_sorted", &insert_sorted<Set, Key>, true },
+    { "insert_hint", &insert_hint<Set, Key>, false },
+    { "find_hit", &find_key<Set, Key, 0>, false },
+    { "find_miss", &find_key<Set, Key, 1>, false },
+    { "lower_bound", &lower_bound_key<Set, Key>, false },
+    { "iterate", &iterate<Set, Key>, false },
+    { "erase_key", &erase_key<Set, Key>, true },
+    { "erase_range", &erase_range<Set, Key>, false },
+    { "copy", &copy_set<Set, Key>, false },
+    { "move", &move_set<Set, Key>, false },
+    { "clear", &clear_set<Set, Key>, false },
+  };
+
+  for (const auto& c : cases) {
+    std::string name = std::string(c.name) + "/" + set_name + "<" +
+                       key_name + ">";
+    benchmark::internal::Benchmark *b =
+      benchmark::RegisterBenchmark(name.c_str(), c.f);
+    for (std::int64_t n = 1000; n <= max_size; n *= 10) {
+      if (c.update && set_traits<Set>::linear_updates && n > 100000)
+        break;
+      b->Arg(n);
+    }
+  }
+}
+
+template <class Key>
+void register_key(const std::string& key_name, std::int64_t max_size) {
+  register_set<rb_tree::rb_tree<Key>, Key>("rb_tree", key_name, max_size);
+  register_set<rb_tree::rb_tree<Key, std::less<Key>, std::allocator<Key>,
+                                rb_tree::threaded_policy>, Key>(
+      "rb_tree_threaded", key_name, max_size);
+  register_set<rb_tree::rb_tree<Key, std::less<Key>, std::allocator<Key>,
+                                rb_tree::tombstone_policy>, Key>(
+      "rb_tree_tombstones", key_name, max_size);
+  register_set<rb_tree::rb_btree<Key>, Key>("rb_btree", key_name, max_size);
+  register_set<std::set<Key>, Key>("std::set", key_name, max_size);
+#ifdef RB_TREE_BENCH_ABSL
+  register_set<absl::btree_set<Key>, Key>("absl::btree_set", key_name,
+                                          max_size);
+#endif
+  register_set<sorted_vector<Key>, Key>("sorted_vector", key_name, max_size);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  benchmark::Initialize(&argc, argv);
+
+  std::int64_t max_size = 100000000;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strncmp(argv[i], "--max_size=", 11) == 0) {
+      max_size = std::atoll(argv[i] + 11);
+    } else {
+      std::fprintf(stderr, "unknown argument %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  register_key<std::uint32_t>("uint32", max_size);
+  register_key<std::uint64_t>("uint64", max_size);
+  register_key<std::string>("string", max_size);
+
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
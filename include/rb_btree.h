@@ -0,0 +1,1359 @@
+#ifndef RB_BTREE_H
+#define RB_BTREE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "rb_tree.h"
+
+namespace rb_tree {
+
+/*
+ * The number of elements or keys of Size bytes in a node of an rb_btree,
+ * filling about Bytes of Header plus slots, but never less than 16 or more
+ * than 64 of them.
+ */
+template <std::size_t Size, std::size_t Header, std::size_t Bytes = 512>
+struct rb_btree_slots
+  : std::integral_constant<unsigned,
+        ((Bytes - Header) / Size < 16 ? 16 :
+         (Bytes - Header) / Size > 64 ? 64 :
+         static_cast<unsigned>((Bytes - Header) / Size))> { };
+
+/*
+ * A B+tree with the interface of rb_tree, to try a wide node layout on a
+ * hot set with a single typedef. The elements are kept in order in leaves
+ * of 16 to 64 of them, chained both ways for the iterators, and the inner
+ * nodes only hold copies of the keys that separate their children, so a
+ * lookup reads a few cache lines per level instead of a node. The nodes
+ * start on a cache line.
+ *
+ * It has the constructors, inserts, erases, lookups and iterators of
+ * rb_tree, with the same semantics, except that an insert or an erase
+ * invalidates all the iterators. The node handles, joins, splits, set
+ * operations, finger searches and the other extensions of rb_tree are not
+ * there, nor the augments and the statistics of the policy; only its
+ * key_of_value is used.
+ *
+ * The elements move between the nodes, so they must be move constructible,
+ * and their moves should not throw. An element is constructed before any
+ * node is changed, so a throwing constructor leaves the tree as it was.
+ */
+template <class T,
+          class Compare = std::less<T>,
+          class Alloc = std::allocator<T>,
+          class Policy = default_policy>
+class rb_btree {
+ public:
+  typedef typename Policy::key_of_value key_of_value;
+  typedef T value_type;
+  typedef typename std::decay<decltype(
+      key_of_value::key(std::declval<const value_type&>()))>::type key_type;
+  typedef Compare key_compare;
+  typedef Alloc allocator_type;
+
+  /* Compare values and keys alike, by their keys */
+  class value_compare {
+   public:
+    explicit value_compare(const key_compare& comp) : comp(comp) { }
+
+    template <class A, class B>
+    bool operator()(const A& a, const B& b) const {
+      return comp(key(a), key(b));
+    }
+
+   protected:
+    key_compare comp;
+
+    static const key_type& key(const value_type& val) {
+      return key_of_value::key(val);
+    }
+    template <class K>
+    static const K& key(const K& val) { return val; }
+
+    friend class rb_btree;
+  }; // value_compare
+
+  typedef value_type& reference;
+  typedef const value_type& const_reference;
+  typedef typename std::allocator_traits<Alloc>::difference_type
+    difference_type;
+  typedef typename std::allocator_traits<Alloc>::size_type size_type;
+  typedef typename std::allocator_traits<Alloc>::pointer pointer;
+  typedef typename std::allocator_traits<Alloc>::const_pointer const_pointer;
+
+  static_assert(std::is_same<typename Policy::augment, no_augment>::value,
+                "rb_btree does not keep the augments of the policy");
+
+ protected:
+  struct leaf_node;
+  template <class Pointer, class Reference> class iterator_base;
+  typedef iterator_base<value_type *, value_type &> iterator_type;
+  typedef iterator_base<const value_type *, const value_type &>
+    const_iterator_type;
+
+ public:
+  /* The elements of a set are constant, only the keys of a map are */
+  typedef typename std::conditional<
+      std::is_same<key_type, value_type>::value,
+      const_iterator_type, iterator_type>::type iterator;
+  typedef const_iterator_type const_iterator;
+  typedef std::reverse_iterator<iterator> reverse_iterator;
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+  /*
+   * constructors
+   */
+
+  // empty
+  rb_btree()
+    : rb_btree(key_compare(), allocator_type()) { }
+
+  explicit rb_btree(const key_compare& comp,
+                    const allocator_type& alloc = allocator_type())
+    : alloc_(alloc), comp_(comp), root_(nullptr), first_(nullptr),
+      last_(nullptr), height_(0), size_(0) { }
+
+  explicit rb_btree(const allocator_type& alloc)
+    : rb_btree(key_compare(), alloc) { }
+
+  // range
+  template <class InputIterator>
+  rb_btree(InputIterator first, InputIterator last,
+           const key_compare& comp = key_compare(),
+           const allocator_type& alloc = allocator_type())
+    : rb_btree(comp, alloc) { insert(first, last); }
+
+  template <class InputIterator>
+  rb_btree(InputIterator first, InputIterator last,
+           const allocator_type& alloc)
+    : rb_btree(key_compare(), alloc) { insert(first, last); }
+
+  // sorted range, no check on the order of the elements
+  template <class InputIterator>
+  rb_btree(sorted_unique_t, InputIterator first, InputIterator last,
+           const key_compare& comp = key_compare(),
+           const allocator_type& alloc = allocator_type())
+    : rb_btree(comp, alloc) { insert(sorted_unique, first, last); }
+
+  rb_btree(std::initializer_list<value_type> il,
+           const key_compare& comp = key_compare(),
+           const allocator_type& alloc = allocator_type())
+    : rb_btree(comp, alloc) { insert(il); }
+
+  // copy, into full leaves
+  rb_btree(const rb_btree& other)
+    : rb_btree(other,
+        alloc_traits::select_on_container_copy_construction(other.alloc_)) { }
+
+  rb_btree(const rb_btree& other, const allocator_type& alloc)
+    : rb_btree(other.comp_, alloc) {
+    if (other.size_ != 0)
+      build_tree(other.begin(), other.size_);
+  }
+
+  // move
+  rb_btree(rb_btree&& other) noexcept
+    : rb_btree(other.comp_, other.alloc_) { steal(other); }
+
+  rb_btree(rb_btree&& other, const allocator_type& alloc)
+    : rb_btree(other.comp_, alloc) {
+    if (alloc_ == other.alloc_) {
+      steal(other);
+    } else if (other.size_ != 0) {
+      build_tree(std::make_move_iterator(other.mutable_begin()), other.size_);
+      other.clear();
+    }
+  }
+
+  /* destructor */
+  ~rb_btree() noexcept { clear(); }
+
+  /* assignments */
+  rb_btree& operator=(const rb_btree& other) {
+    if (this != &other) {
+      clear();
+      if (alloc_traits::propagate_on_container_copy_assignment::value)
+        alloc_ = other.alloc_;
+      comp_ = other.comp_;
+      if (other.size_ != 0)
+        build_tree(other.begin(), other.size_);
+    }
+    return *this;
+  }
+
+  rb_btree& operator=(rb_btree&& other) {
+    if (this != &other) {
+      clear();
+      comp_ = other.comp_;
+      if (alloc_traits::propagate_on_container_move_assignment::value) {
+        alloc_ = other.alloc_;
+        steal(other);
+      } else if (alloc_ == other.alloc_) {
+        steal(other);
+      } else if (other.size_ != 0) {
+        build_tree(std::make_move_iterator(other.mutable_begin()),
+                   other.size_);
+        other.clear();
+      }
+    }
+    return *this;
+  }
+
+  rb_btree& operator=(std::initializer_list<value_type> il) {
+    clear();
+    insert(il);
+    return *this;
+  }
+
+  // end of constructors/destructor/assignments
+
+
+  std::pair<iterator, bool> insert(const value_type& val) {
+    return insert_unique(val);
+  }
+  std::pair<iterator, bool> insert(value_type&& val) {
+    return insert_unique(std::move(val));
+  }
+  iterator insert(const_iterator pos, const value_type& val) {
+    return emplace_hint_unique(pos, val);
+  }
+  iterator insert(const_iterator pos, value_type&& val) {
+    return emplace_hint_unique(pos, std::move(val));
+  }
+  template <class InputIterator>
+  void insert(InputIterator first, InputIterator last) {
+    for (; first != last; ++first)
+      insert_unique(*first);
+  }
+  template <class InputIterator>
+  void insert(sorted_unique_t, InputIterator first, InputIterator last) {
+    insert_sorted_range(first, last,
+        typename std::iterator_traits<InputIterator>::iterator_category());
+  }
+  void insert(std::initializer_list<value_type> il) {
+    insert(il.begin(), il.end());
+  }
+
+  template <class... Args>
+  std::pair<iterator, bool> emplace(Args&&... args) {
+    value_holder v(alloc_, std::forward<Args>(args)...);
+    return insert_value(v);
+  }
+  template <class... Args>
+  iterator emplace_hint(const_iterator pos, Args&&... args) {
+    return emplace_hint_unique(pos, std::forward<Args>(args)...);
+  }
+
+  iterator erase(const_iterator pos) {
+    path p;
+    leaf_node *x = descend(key_of_value::key(*pos), &p);
+    return erase_at(x, pos.pos_, p);
+  }
+  size_type erase(const key_type& val) {
+    return erase_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent,
+            class = typename std::enable_if<
+                !std::is_convertible<K, const_iterator>::value>::type>
+  size_type erase(const K& val) {
+    return erase_unique(val);
+  }
+  iterator erase(const_iterator first, const_iterator last);
+
+  iterator begin() { return first_iter(); }
+  const_iterator begin() const { return first_iter(); }
+  iterator end() { return end_iter(); }
+  const_iterator end() const { return end_iter(); }
+  const_iterator cbegin() const { return first_iter(); }
+  const_iterator cend() const { return end_iter(); }
+
+  reverse_iterator rbegin() { return reverse_iterator(end()); }
+  const_reverse_iterator rbegin() const {return const_reverse_iterator(end());}
+  reverse_iterator rend() { return reverse_iterator(begin()); }
+  const_reverse_iterator rend() const {return const_reverse_iterator(begin());}
+  const_reverse_iterator crbegin() const {return const_reverse_iterator(end());}
+  const_reverse_iterator crend() const {return const_reverse_iterator(begin());}
+
+  iterator lower_bound(const key_type& val) {
+    return bound<false>(val);
+  }
+  const_iterator lower_bound(const key_type& val) const {
+    return bound<false>(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  iterator lower_bound(const K& val) {
+    return bound<false>(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  const_iterator lower_bound(const K& val) const {
+    return bound<false>(val);
+  }
+
+  iterator upper_bound(const key_type& val) {
+    return bound<true>(val);
+  }
+  const_iterator upper_bound(const key_type& val) const {
+    return bound<true>(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  iterator upper_bound(const K& val) {
+    return bound<true>(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  const_iterator upper_bound(const K& val) const {
+    return bound<true>(val);
+  }
+
+  iterator find(const key_type& val) {
+    return find_unique(val);
+  }
+  const_iterator find(const key_type& val) const {
+    return find_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  iterator find(const K& val) {
+    return find_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  const_iterator find(const K& val) const {
+    return find_unique(val);
+  }
+
+  size_type count(const key_type& val) const {
+    return find_unique(val) != end_iter() ? 1 : 0;
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  size_type count(const K& val) const {
+    return find_unique(val) != end_iter() ? 1 : 0;
+  }
+
+  std::pair<iterator, iterator> equal_range(const key_type& val) {
+    return equal_range_unique(val);
+  }
+  std::pair<const_iterator,const_iterator>
+  equal_range(const key_type& val) const {
+    return equal_range_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  std::pair<iterator, iterator> equal_range(const K& val) {
+    return equal_range_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  std::pair<const_iterator,const_iterator> equal_range(const K& val) const {
+    return equal_range_unique(val);
+  }
+
+  allocator_type get_allocator() const { return alloc_; }
+  key_compare key_comp() const { return comp_; }
+  value_compare value_comp() const { return value_compare(comp_); }
+
+  size_type size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  void swap(rb_btree& other) noexcept {
+    using std::swap;
+    if (alloc_traits::propagate_on_container_swap::value)
+      swap(alloc_, other.alloc_);
+    swap(comp_, other.comp_);
+    swap(root_, other.root_);
+    swap(first_, other.first_);
+    swap(last_, other.last_);
+    swap(height_, other.height_);
+    swap(size_, other.size_);
+  }
+
+  void clear() noexcept {
+    if (root_ != nullptr)
+      destroy_sub_tree(root_, height_);
+    root_ = nullptr;
+    first_ = last_ = nullptr;
+    height_ = 0;
+    size_ = 0;
+  }
+
+ protected:
+  template <class Pointer, class Reference>
+  class iterator_base {
+   public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef typename rb_btree::value_type value_type;
+    typedef typename rb_btree::difference_type difference_type;
+    typedef Pointer pointer;
+    typedef Reference reference;
+
+    Reference operator*() const { return node_->value(pos_); }
+    Pointer operator->() const { return &(operator*()); }
+
+    /* The last leaf ends with the end of the tree */
+    iterator_base& operator++() {
+      if (++pos_ == node_->count && node_->next != nullptr) {
+        node_ = node_->next;
+        pos_ = 0;
+      }
+      return *this;
+    }
+
+    iterator_base operator++(int) {
+      iterator_base tmp(*this);
+      ++*this;
+      return tmp;
+    }
+
+    iterator_base& operator--() {
+      if (pos_ == 0) {
+        node_ = node_->prev;
+        pos_ = node_->count;
+      }
+      --pos_;
+      return *this;
+    }
+
+    iterator_base operator--(int) {
+      iterator_base tmp(*this);
+      --*this;
+      return tmp;
+    }
+
+    inline bool operator==(const iterator_base& y) const {
+      return node_ == y.node_ && pos_ == y.pos_;
+    }
+
+    inline bool operator!=(const iterator_base& y) const {
+      return !(*this == y);
+    }
+
+    iterator_base() : node_(nullptr), pos_(0) { }
+
+    /*
+     * Both const_iterator and iterator can be converted from the iterator type
+     */
+    iterator_base(const iterator_base<value_type *, value_type &>& rhs)
+      : node_(rhs.node_), pos_(rhs.pos_) { }
+
+   protected:
+    leaf_node *node_;
+    unsigned pos_;
+    iterator_base(leaf_node *node, unsigned pos) : node_(node), pos_(pos) { }
+    friend class rb_btree;
+  }; // iterator_base
+
+  static constexpr std::size_t line_size = 64;
+
+  static_assert(alignof(value_type) <= line_size &&
+                alignof(key_type) <= line_size,
+                "the elements must fit the alignment of the nodes");
+
+  /* The count of a node, and how far it is from its allocation */
+  struct node_header {
+    unsigned short count;
+    unsigned char shift;
+  };
+
+  typedef typename std::aligned_storage<sizeof(value_type),
+                                        alignof(value_type)>::type value_slot;
+  typedef typename std::aligned_storage<sizeof(key_type),
+                                        alignof(key_type)>::type key_slot;
+
+ public:
+  /*
+   * The capacities of the nodes. Each has room for one more, which an
+   * insert fills before it splits the node.
+   */
+  static constexpr unsigned leaf_slots = rb_btree_slots<sizeof(value_type),
+      sizeof(node_header) + 2 * sizeof(void *)>::value;
+  static constexpr unsigned inner_slots = rb_btree_slots<
+      sizeof(key_type) + sizeof(void *),
+      sizeof(node_header) + 2 * sizeof(void *)>::value;
+
+ protected:
+  struct alignas(line_size) leaf_node : node_header {
+    leaf_node *prev;
+    leaf_node *next;
+    value_slot values[leaf_slots + 1];
+
+    value_type& value(unsigned i) {
+      return *reinterpret_cast<value_type *>(&values[i]);
+    }
+    const value_type& value(unsigned i) const {
+      return *reinterpret_cast<const value_type *>(&values[i]);
+    }
+  }; // leaf_node
+
+  /* children[i] holds the keys from keys[i - 1] up to keys[i] */
+  struct alignas(line_size) inner_node : node_header {
+    key_slot keys[inner_slots + 1];
+    node_header *children[inner_slots + 2];
+
+    key_type& key(unsigned i) {
+      return *reinterpret_cast<key_type *>(&keys[i]);
+    }
+    const key_type& key(unsigned i) const {
+      return *reinterpret_cast<const key_type *>(&keys[i]);
+    }
+  }; // inner_node
+
+  /* The inner nodes from the root down to a leaf, and the children taken */
+  static constexpr unsigned max_height = 32;
+  struct path {
+    inner_node *nodes[max_height];
+    unsigned index[max_height];
+  };
+
+  typedef std::allocator_traits<allocator_type> alloc_traits;
+
+  /* An element or a key built outside of the tree, until it moves in */
+  template <class V>
+  class slot_holder {
+   public:
+    template <class... Args>
+    explicit slot_holder(allocator_type& alloc, Args&&... args)
+      : alloc_(alloc) {
+      alloc_traits::construct(alloc_, &get(), std::forward<Args>(args)...);
+      live_ = true;
+    }
+
+    slot_holder(const slot_holder&) = delete;
+    slot_holder& operator=(const slot_holder&) = delete;
+
+    ~slot_holder() {
+      if (live_)
+        alloc_traits::destroy(alloc_, &get());
+    }
+
+    V& get() { return *reinterpret_cast<V *>(&slot_); }
+
+    /* Move the value to the uninitialized dst */
+    void move_to(V *dst) {
+      alloc_traits::construct(alloc_, dst, std::move(get()));
+      alloc_traits::destroy(alloc_, &get());
+      live_ = false;
+    }
+
+   private:
+    typename std::aligned_storage<sizeof(V), alignof(V)>::type slot_;
+    allocator_type& alloc_;
+    bool live_;
+  }; // slot_holder
+
+  typedef slot_holder<value_type> value_holder;
+  typedef slot_holder<key_type> key_holder;
+
+  allocator_type alloc_;
+  key_compare comp_;
+
+  /* The root is a leaf when the height is 0, and null when empty */
+  node_header *root_;
+  leaf_node *first_;
+  leaf_node *last_;
+  unsigned height_;
+  size_type size_;
+
+  static leaf_node *as_leaf(node_header *x) {
+    return static_cast<leaf_node *>(x);
+  }
+  static inner_node *as_inner(node_header *x) {
+    return static_cast<inner_node *>(x);
+  }
+
+  static const key_type& key_at(const leaf_node *x, unsigned i) {
+    return key_of_value::key(x->value(i));
+  }
+  static const key_type& key_at(const inner_node *x, unsigned i) {
+    return x->key(i);
+  }
+
+  iterator_type first_iter() const {
+    return first_ != nullptr ? iterator_type(first_, 0) : end_iter();
+  }
+  iterator_type end_iter() const {
+    return last_ != nullptr ? iterator_type(last_, last_->count)
+                            : iterator_type(nullptr, 0);
+  }
+  iterator_type mutable_begin() { return first_iter(); }
+
+  /* The position pos of x, which may be just past the end of the leaf */
+  static iterator_type make_iter(leaf_node *x, unsigned pos) {
+    if (pos == x->count && x->next != nullptr)
+      return iterator_type(x->next, 0);
+    return iterator_type(x, pos);
+  }
+
+  /*
+   * The nodes are allocated as themselves with the aligned new of
+   * std::allocator, and otherwise as a block of a line more, where they
+   * start at the first line boundary.
+   */
+  typedef std::integral_constant<bool,
+#if defined(__cpp_aligned_new)
+      std::is_same<allocator_type, std::allocator<value_type> >::value
+#else
+      false
+#endif
+      > aligned_alloc_tag;
+
+  template <class Node>
+  struct node_block {
+    unsigned char bytes[sizeof(Node) + line_size - 1];
+  };
+
+  template <class Node>
+  Node *allocate_node() {
+    return allocate_node<Node>(aligned_alloc_tag());
+  }
+  template <class Node>
+  Node *allocate_node(std::true_type) {
+    typename alloc_traits::template rebind_alloc<Node> a(alloc_);
+    Node *x = ::new (static_cast<void *>(
+        alloc_traits::template rebind_traits<Node>::allocate(a, 1))) Node;
+    x->shift = 0;
+    return x;
+  }
+  template <class Node>
+  Node *allocate_node(std::false_type) {
+    typename alloc_traits::template rebind_alloc<node_block<Node> > a(alloc_);
+    unsigned char *raw = alloc_traits::template
+      rebind_traits<node_block<Node> >::allocate(a, 1)->bytes;
+    std::size_t shift =
+      (line_size - reinterpret_cast<std::uintptr_t>(raw) % line_size) %
+      line_size;
+    Node *x = ::new (static_cast<void *>(raw + shift)) Node;
+    x->shift = static_cast<unsigned char>(shift);
+    return x;
+  }
+
+  template <class Node>
+  void deallocate_node(Node *x) {
+    deallocate_node(x, aligned_alloc_tag());
+  }
+  template <class Node>
+  void deallocate_node(Node *x, std::true_type) {
+    typename alloc_traits::template rebind_alloc<Node> a(alloc_);
+    alloc_traits::template rebind_traits<Node>::deallocate(a, x, 1);
+  }
+  template <class Node>
+  void deallocate_node(Node *x, std::false_type) {
+    typename alloc_traits::template rebind_alloc<node_block<Node> > a(alloc_);
+    unsigned char *raw = reinterpret_cast<unsigned char *>(x) - x->shift;
+    alloc_traits::template rebind_traits<node_block<Node> >::deallocate(
+        a, reinterpret_cast<node_block<Node> *>(raw), 1);
+  }
+
+  leaf_node *create_leaf() {
+    leaf_node *x = allocate_node<leaf_node>();
+    x->count = 0;
+    x->prev = x->next = nullptr;
+    return x;
+  }
+  inner_node *create_inner() {
+    inner_node *x = allocate_node<inner_node>();
+    x->count = 0;
+    return x;
+  }
+
+  /* Move the element or key at src to the uninitialized dst */
+  template <class V>
+  void relocate(V *dst, V *src) {
+    alloc_traits::construct(alloc_, dst, std::move(*src));
+    alloc_traits::destroy(alloc_, src);
+  }
+
+  /* The n slots from src to dst, which may overlap */
+  template <class V>
+  void relocate_n(V *dst, V *src, unsigned n) {
+    if (dst < src) {
+      for (unsigned i = 0; i < n; ++i)
+        relocate(dst + i, src + i);
+    } else {
+      for (unsigned i = n; i-- > 0;)
+        relocate(dst + i, src + i);
+    }
+  }
+
+  /*
+   * The number of the first keys of x that are less than val, or not
+   * greater than it for Upper. The branchless search keeps the same number
+   * of steps for any val.
+   */
+  template <class K>
+  using branchless_tag = std::integral_constant<bool,
+      std::is_same<K, key_type>::value &&
+      rb_tree_branchless_search<key_type, key_compare>::value>;
+
+  template <bool Upper, class K>
+  bool before(const key_type& key, const K& val) const {
+    return Upper ? !comp_(val, key) : comp_(key, val);
+  }
+
+  template <bool Upper, class Node, class K>
+  unsigned rank(const Node *x, const K& val) const {
+    return rank<Upper>(x, val, branchless_tag<K>());
+  }
+  template <bool Upper, class Node, class K>
+  unsigned rank(const Node *x, const K& val, std::false_type) const {
+    unsigned lo = 0;
+    unsigned n = x->count;
+    while (n > 0) {
+      unsigned half = n / 2;
+      if (before<Upper>(key_at(x, lo + half), val)) {
+        lo += half + 1;
+        n -= half + 1;
+      } else {
+        n = half;
+      }
+    }
+    return lo;
+  }
+  template <bool Upper, class Node, class K>
+  unsigned rank(const Node *x, const K& val, std::true_type) const {
+    unsigned lo = 0;
+    unsigned n = x->count;
+    while (n > 1) {
+      unsigned half = n / 2;
+      lo = before<Upper>(key_at(x, lo + half), val) ? lo + half : lo;
+      n -= half;
+    }
+    return lo + (n == 1 && before<Upper>(key_at(x, lo), val));
+  }
+
+  /*
+   * The leaf where val is or would be, along the path p if given. Equal
+   * keys go right of the separators.
+   */
+  template <class K>
+  leaf_node *descend(const K& val, path *p) const {
+    node_header *x = root_;
+    for (unsigned d = 0; d < height_; ++d) {
+      inner_node *y = as_inner(x);
+      unsigned c = rank<true>(y, val);
+      if (p != nullptr) {
+        p->nodes[d] = y;
+        p->index[d] = c;
+      }
+      x = y->children[c];
+    }
+    return as_leaf(x);
+  }
+
+  template <bool Upper, class K>
+  iterator_type bound(const K& val) const {
+    if (root_ == nullptr)
+      return end_iter();
+    leaf_node *x = descend(val, nullptr);
+    return make_iter(x, rank<Upper>(x, val));
+  }
+
+  template <class K>
+  iterator_type find_unique(const K& val) const {
+    if (root_ == nullptr)
+      return end_iter();
+    leaf_node *x = descend(val, nullptr);
+    unsigned i = rank<false>(x, val);
+    if (i < x->count && !comp_(val, key_at(x, i)))
+      return iterator_type(x, i);
+    return end_iter();
+  }
+
+  template <class K>
+  std::pair<iterator_type, iterator_type> equal_range_unique(const K& val) const {
+    if (root_ == nullptr)
+      return std::make_pair(end_iter(), end_iter());
+    leaf_node *x = descend(val, nullptr);
+    unsigned i = rank<false>(x, val);
+    if (i < x->count && !comp_(val, key_at(x, i)))
+      return std::make_pair(iterator_type(x, i), make_iter(x, i + 1));
+    iterator_type it = make_iter(x, i);
+    return std::make_pair(it, it);
+  }
+
+  template <class V>
+  std::pair<iterator_type, bool> insert_unique(V&& val);
+  std::pair<iterator_type, bool> insert_value(value_holder& v);
+  template <class... Args>
+  iterator_type emplace_hint_unique(const_iterator pos, Args&&... args);
+
+  /* Put v at the position i of x, which has room for it */
+  void put_value(leaf_node *x, unsigned i, value_holder& v) {
+    relocate_n(&x->value(i + 1), &x->value(i), x->count - i);
+    v.move_to(&x->value(i));
+    ++x->count;
+  }
+  iterator_type insert_at(leaf_node *x, unsigned i, path& p, value_holder& v);
+  unsigned split_point(const leaf_node *x, unsigned i) const;
+
+  /* Put the key k and the child r after it at the position c of x */
+  void put_child(inner_node *x, unsigned c, key_holder& k, node_header *r) {
+    relocate_n(&x->key(c + 1), &x->key(c), x->count - c);
+    k.move_to(&x->key(c));
+    for (unsigned i = x->count + 1; i > c + 1; --i)
+      x->children[i] = x->children[i - 1];
+    x->children[c + 1] = r;
+    ++x->count;
+  }
+  /* Remove the key c of x, which has been destroyed, and the child after it */
+  void remove_child(inner_node *x, unsigned c) {
+    relocate_n(&x->key(c), &x->key(c + 1), x->count - c - 1);
+    for (unsigned i = c + 1; i < x->count; ++i)
+      x->children[i] = x->children[i + 1];
+    --x->count;
+  }
+
+  template <class K>
+  size_type erase_unique(const K& val);
+  iterator_type erase_at(leaf_node *x, unsigned i, path& p);
+  void rebalance_leaf(leaf_node *x, path& p, leaf_node *& at, unsigned& pos);
+  void rebalance_inner(unsigned d, path& p);
+  void unlink_leaf(leaf_node *x);
+
+  template <class InputIterator>
+  void insert_sorted_range(InputIterator first, InputIterator last,
+                           std::input_iterator_tag);
+  template <class ForwardIterator>
+  void insert_sorted_range(ForwardIterator first, ForwardIterator last,
+                           std::forward_iterator_tag);
+  template <class ForwardIterator>
+  void build_tree(ForwardIterator first, size_type n);
+
+  static const key_type& first_key(node_header *x, unsigned h) {
+    for (; h > 0; --h)
+      x = as_inner(x)->children[0];
+    return key_at(as_leaf(x), 0);
+  }
+
+  void destroy_sub_tree(node_header *x, unsigned h) noexcept;
+
+  void steal(rb_btree& other) noexcept {
+    root_ = other.root_;
+    first_ = other.first_;
+    last_ = other.last_;
+    height_ = other.height_;
+    size_ = other.size_;
+    other.root_ = nullptr;
+    other.first_ = other.last_ = nullptr;
+    other.height_ = 0;
+    other.size_ = 0;
+  }
+}; // rb_btree
+
+template <class T, class C, class A, class P>
+template <class V>
+std::pair<typename rb_btree<T, C, A, P>::iterator_type, bool>
+rb_btree<T, C, A, P>::insert_unique(V&& val) {
+  if (root_ == nullptr) {
+    value_holder v(alloc_, std::forward<V>(val));
+    return insert_value(v);
+  }
+
+  /* An element that is already there is not copied */
+  path p;
+  const key_type& k = key_of_value::key(val);
+  leaf_node *x = descend(k, &p);
+  unsigned i = rank<false>(x, k);
+  if (i < x->count && !comp_(k, key_at(x, i)))
+    return std::make_pair(iterator_type(x, i), false);
+
+  value_holder v(alloc_, std::forward<V>(val));
+  return std::make_pair(insert_at(x, i, p, v), true);
+}
+
+template <class T, class C, class A, class P>
+std::pair<typename rb_btree<T, C, A, P>::iterator_type, bool>
+rb_btree<T, C, A, P>::insert_value(value_holder& v) {
+  if (root_ == nullptr) {
+    leaf_node *x = create_leaf();
+    v.move_to(&x->value(0));
+    x->count = 1;
+    root_ = first_ = last_ = x;
+    size_ = 1;
+    return std::make_pair(iterator_type(x, 0), true);
+  }
+
+  path p;
+  const key_type& k = key_of_value::key(v.get());
+  leaf_node *x = descend(k, &p);
+  unsigned i = rank<false>(x, k);
+  if (i < x->count && !comp_(k, key_at(x, i)))
+    return std::make_pair(iterator_type(x, i), false);
+  return std::make_pair(insert_at(x, i, p, v), true);
+}
+
+/*
+ * Insert right at pos when it is in the order and its leaf has room.
+ * The first position of a leaf is only taken in the first leaf, since the
+ * separator before the others may be greater than the element.
+ */
+template <class T, class C, class A, class P>
+template <class... Args>
+typename rb_btree<T, C, A, P>::iterator_type
+rb_btree<T, C, A, P>::emplace_hint_unique(const_iterator pos,
+                                          Args&&... args) {
+  value_holder v(alloc_, std::forward<Args>(args)...);
+  leaf_node *x = pos.node_;
+  unsigned i = pos.pos_;
+  if (x != nullptr && x->count < leaf_slots) {
+    const key_type& k = key_of_value::key(v.get());
+    if ((i == 0 ? x == first_ : comp_(key_at(x, i - 1), k)) &&
+        (i == x->count ? x == last_ : comp_(k, key_at(x, i)))) {
+      put_value(x, i, v);
+      ++size_;
+      return iterator_type(x, i);
+    }
+  }
+  return insert_value(v).first;
+}
+
+/*
+ * The number of the elements that stay in x when it splits after the
+ * insert at i. An element appended to the last leaf or prepended to the
+ * first one goes alone into the new node, so that sorted inserts fill the
+ * leaves instead of leaving them half empty.
+ */
+template <class T, class C, class A, class P>
+unsigned rb_btree<T, C, A, P>::split_point(const leaf_node *x,
+                                           unsigned i) const {
+  if (x->next == nullptr && i == leaf_slots)
+    return leaf_slots;
+  if (x->prev == nullptr && i == 0)
+    return 1;
+  return (leaf_slots + 1) / 2;
+}
+
+/*
+ * Insert v at the position i of the leaf x found along p, splitting the
+ * full nodes on the way up. The new nodes and the separator of the leaves
+ * are made before anything moves, so that only the constructors of the
+ * element and of that key may throw, and then the tree is unchanged.
+ */
+template <class T, class C, class A, class P>
+typename rb_btree<T, C, A, P>::iterator_type
+rb_btree<T, C, A, P>::insert_at(leaf_node *x, unsigned i, path& p,
+                                value_holder& v) {
+  ++size_;
+  if (x->count < leaf_slots) {
+    put_value(x, i, v);
+    return iterator_type(x, i);
+  }
+
+  unsigned low = height_;
+  while (low > 0 && p.nodes[low - 1]->count == inner_slots)
+    --low;
+  unsigned mid = split_point(x, i);
+  bool append = mid == leaf_slots;
+  bool prepend = mid == 1;
+
+  /* The inner nodes of the levels from low up, and a new root at 0 */
+  inner_node *spare[max_height + 1];
+  unsigned spares = 0;
+  leaf_node *r = nullptr;
+  try {
+    r = create_leaf();
+    for (; spares < height_ - low + (low == 0); ++spares)
+      spare[spares] = create_inner();
+  } catch (...) {
+    --size_;
+    if (r != nullptr)
+      deallocate_node(r);
+    while (spares > 0)
+      deallocate_node(spare[--spares]);
+    throw;
+  }
+
+  /* The key going up to the parent, first the separator of the leaves */
+  typename std::aligned_storage<sizeof(key_holder),
+                                alignof(key_holder)>::type key_slot;
+  key_holder *k;
+  try {
+    k = ::new (static_cast<void *>(&key_slot)) key_holder(alloc_,
+        mid == i ? key_of_value::key(v.get()) :
+                   key_at(x, mid < i ? mid : mid - 1));
+  } catch (...) {
+    --size_;
+    deallocate_node(r);
+    while (spares > 0)
+      deallocate_node(spare[--spares]);
+    throw;
+  }
+
+  put_value(x, i, v);
+  relocate_n(&r->value(0), &x->value(mid), x->count - mid);
+  r->count = static_cast<unsigned short>(x->count - mid);
+  x->count = static_cast<unsigned short>(mid);
+  r->prev = x;
+  r->next = x->next;
+  if (x->next != nullptr)
+    x->next->prev = r;
+  else
+    last_ = r;
+  x->next = r;
+  iterator_type it = i < mid ? iterator_type(x, i)
+                             : iterator_type(r, i - mid);
+
+  node_header *child = r;
+  for (unsigned d = height_; d-- > 0;) {
+    inner_node *y = p.nodes[d];
+    put_child(y, p.index[d], *k, child);
+    k->~key_holder();
+    if (y->count <= inner_slots)
+      return it;
+
+    /*
+     * Split y around the key m, which moves up; at least one key stays on
+     * each side, on the side of the appends or prepends.
+     */
+    unsigned m = append ? inner_slots - 1 : prepend ? 1 : inner_slots / 2;
+    inner_node *z = spare[--spares];
+    relocate_n(&z->key(0), &y->key(m + 1), y->count - m - 1);
+    for (unsigned j = m + 1; j <= y->count; ++j)
+      z->children[j - m - 1] = y->children[j];
+    z->count = static_cast<unsigned short>(y->count - m - 1);
+    y->count = static_cast<unsigned short>(m);
+    k = ::new (static_cast<void *>(&key_slot))
+      key_holder(alloc_, std::move(y->key(m)));
+    alloc_traits::destroy(alloc_, &y->key(m));
+    child = z;
+  }
+
+  inner_node *root = spare[--spares];
+  root->children[0] = root_;
+  root->children[1] = child;
+  k->move_to(&root->key(0));
+  k->~key_holder();
+  root->count = 1;
+  root_ = root;
+  ++height_;
+  return it;
+}
+
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_btree<T, C, A, P>::size_type
+rb_btree<T, C, A, P>::erase_unique(const K& val) {
+  if (root_ == nullptr)
+    return 0;
+  path p;
+  leaf_node *x = descend(val, &p);
+  unsigned i = rank<false>(x, val);
+  if (i == x->count || comp_(val, key_at(x, i)))
+    return 0;
+  erase_at(x, i, p);
+  return 1;
+}
+
+template <class T, class C, class A, class P>
+typename rb_btree<T, C, A, P>::iterator
+rb_btree<T, C, A, P>::erase(const_iterator first, const_iterator last) {
+  if (first == begin() && last == end()) {
+    clear();
+    return end();
+  }
+  size_type n = static_cast<size_type>(std::distance(first, last));
+  const_iterator it = first;
+  for (; n > 0; --n)
+    it = erase(it);
+  return iterator_type(it.node_, it.pos_);
+}
+
+/*
+ * Erase the element i of the leaf x found along p, and refill the nodes
+ * left with less than half of their slots from a sibling or merge them
+ * into it. The separators above stay as they are; they still separate
+ * the leaves.
+ */
+template <class T, class C, class A, class P>
+typename rb_btree<T, C, A, P>::iterator_type
+rb_btree<T, C, A, P>::erase_at(leaf_node *x, unsigned i, path& p) {
+  alloc_traits::destroy(alloc_, &x->value(i));
+  relocate_n(&x->value(i), &x->value(i + 1), x->count - i - 1);
+  --x->count;
+  --size_;
+
+  if (height_ == 0) {
+    if (x->count == 0) {
+      deallocate_node(x);
+      root_ = nullptr;
+      first_ = last_ = nullptr;
+      return end_iter();
+    }
+    return make_iter(x, i);
+  }
+
+  leaf_node *at = x;
+  unsigned pos = i;
+  if (x->count < leaf_slots / 2)
+    rebalance_leaf(x, p, at, pos);
+  return make_iter(at, pos);
+}
+
+/*
+ * Refill or merge the leaf x, keeping at:pos on the same element.
+ * Taking the element of a sibling copies its key into the separator; if
+ * that throws, x stays as it is, which is only less full than it should.
+ * An empty x always merges, since their elements fit in a leaf.
+ */
+template <class T, class C, class A, class P>
+void rb_btree<T, C, A, P>::rebalance_leaf(leaf_node *x, path& p,
+                                          leaf_node *& at, unsigned& pos) {
+  unsigned d = height_ - 1;
+  inner_node *q = p.nodes[d];
+  unsigned c = p.index[d];
+
+  if (c > 0) {
+    leaf_node *l = as_leaf(q->children[c - 1]);
+    if (0u + l->count + x->count <= leaf_slots) {
+      at = l;
+      pos += l->count;
+      relocate_n(&l->value(l->count), &x->value(0), x->count);
+      l->count = static_cast<unsigned short>(l->count + x->count);
+      unlink_leaf(x);
+      deallocate_node(x);
+      alloc_traits::destroy(alloc_, &q->key(c - 1));
+      remove_child(q, c - 1);
+    } else {
+      try {
+        key_holder k(alloc_, key_at(l, l->count - 1));
+        relocate_n(&x->value(1), &x->value(0), x->count);
+        relocate(&x->value(0), &l->value(l->count - 1));
+        --l->count;
+        ++x->count;
+        ++pos;
+        alloc_traits::destroy(alloc_, &q->key(c - 1));
+        k.move_to(&q->key(c - 1));
+      } catch (...) {
+      }
+      return;
+    }
+  } else {
+    leaf_node *r = as_leaf(q->children[1]);
+    if (0u + x->count + r->count <= leaf_slots) {
+      relocate_n(&x->value(x->count), &r->value(0), r->count);
+      x->count = static_cast<unsigned short>(x->count + r->count);
+      unlink_leaf(r);
+      deallocate_node(r);
+      alloc_traits::destroy(alloc_, &q->key(0));
+      remove_child(q, 0);
+    } else {
+      try {
+        key_holder k(alloc_, key_at(r, 1));
+        relocate(&x->value(x->count), &r->value(0));
+        relocate_n(&r->value(0), &r->value(1), r->count - 1);
+        --r->count;
+        ++x->count;
+        alloc_traits::destroy(alloc_, &q->key(0));
+        k.move_to(&q->key(0));
+      } catch (...) {
+      }
+      return;
+    }
+  }
+
+  /* q lost a key */
+  for (;;) {
+    if (d == 0) {
+      if (q->count == 0) {
+        root_ = q->children[0];
+        deallocate_node(q);
+        --height_;
+      }
+      return;
+    }
+    if (q->count >= inner_slots / 2)
+      return;
+    rebalance_inner(d, p);
+    q = p.nodes[--d];
+  }
+}
+
+/*
+ * Refill the inner node p.nodes[d] from a sibling by rotating a key
+ * through their parent, or merge them with the key between them.
+ */
+template <class T, class C, class A, class P>
+void rb_btree<T, C, A, P>::rebalance_inner(unsigned d, path& p) {
+  inner_node *y = p.nodes[d];
+  inner_node *q = p.nodes[d - 1];
+  unsigned c = p.index[d - 1];
+
+  if (c > 0) {
+    inner_node *l = as_inner(q->children[c - 1]);
+    if (1u + l->count + y->count <= inner_slots) {
+      relocate(&l->key(l->count), &q->key(c - 1));
+      relocate_n(&l->key(l->count + 1), &y->key(0), y->count);
+      for (unsigned j = 0; j <= y->count; ++j)
+        l->children[l->count + 1 + j] = y->children[j];
+      l->count = static_cast<unsigned short>(l->count + 1 + y->count);
+      deallocate_node(y);
+      remove_child(q, c - 1);
+    } else {
+      relocate_n(&y->key(1), &y->key(0), y->count);
+      for (unsigned j = y->count + 1; j > 0; --j)
+        y->children[j] = y->children[j - 1];
+      relocate(&y->key(0), &q->key(c - 1));
+      y->children[0] = l->children[l->count];
+      relocate(&q->key(c - 1), &l->key(l->count - 1));
+      --l->count;
+      ++y->count;
+    }
+  } else {
+    inner_node *r = as_inner(q->children[1]);
+    if (1u + y->count + r->count <= inner_slots) {
+      relocate(&y->key(y->count), &q->key(0));
+      relocate_n(&y->key(y->count + 1), &r->key(0), r->count);
+      for (unsigned j = 0; j <= r->count; ++j)
+        y->children[y->count + 1 + j] = r->children[j];
+      y->count = static_cast<unsigned short>(y->count + 1 + r->count);
+      deallocate_node(r);
+      remove_child(q, 0);
+    } else {
+      relocate(&y->key(y->count), &q->key(0));
+      y->children[y->count + 1] = r->children[0];
+      relocate(&q->key(0), &r->key(0));
+      relocate_n(&r->key(0), &r->key(1), r->count - 1);
+      for (unsigned j = 0; j < r->count; ++j)
+        r->children[j] = r->children[j + 1];
+      --r->count;
+      ++y->count;
+    }
+  }
+}
+
+template <class T, class C, class A, class P>
+void rb_btree<T, C, A, P>::unlink_leaf(leaf_node *x) {
+  if (x->prev != nullptr)
+    x->prev->next = x->next;
+  else
+    first_ = x->next;
+  if (x->next != nullptr)
+    x->next->prev = x->prev;
+  else
+    last_ = x->prev;
+}
+
+template <class T, class C, class A, class P>
+template <class InputIterator>
+void rb_btree<T, C, A, P>::insert_sorted_range(InputIterator first,
+                                               InputIterator last,
+                                               std::input_iterator_tag) {
+  for (; first != last; ++first)
+    emplace_hint_unique(end_iter(), *first);
+}
+
+template <class T, class C, class A, class P>
+template <class ForwardIterator>
+void rb_btree<T, C, A, P>::insert_sorted_range(ForwardIterator first,
+                                               ForwardIterator last,
+                                               std::forward_iterator_tag) {
+  if (size_ != 0) {
+    insert_sorted_range(first, last, std::input_iterator_tag());
+    return;
+  }
+
+  size_type n = static_cast<size_type>(std::distance(first, last));
+  if (n != 0)
+    build_tree(first, n);
+}
+
+/*
+ * Build the tree from n sorted elements, assuming the tree is empty.
+ * The elements are spread evenly over the fewest leaves that hold them,
+ * and each level over the fewest inner nodes, so that all the nodes are
+ * at least half full.
+ */
+template <class T, class C, class A, class P>
+template <class ForwardIterator>
+void rb_btree<T, C, A, P>::build_tree(ForwardIterator first, size_type n) {
+  size_type leaves = (n + leaf_slots - 1) / leaf_slots;
+  std::vector<node_header *> level;
+  std::vector<inner_node *> inner;
+  level.reserve(leaves);
+  inner.reserve(leaves);
+
+  try {
+    for (size_type j = 0; j < leaves; ++j) {
+      leaf_node *x = create_leaf();
+      x->prev = last_;
+      if (last_ != nullptr)
+        last_->next = x;
+      else
+        first_ = x;
+      last_ = x;
+      level.push_back(x);
+
+      size_type m = n / leaves + (j < n % leaves);
+      for (; x->count < m; ++x->count, ++first)
+        alloc_traits::construct(alloc_, &x->value(x->count), *first);
+    }
+
+    unsigned h = 0;
+    while (level.size() > 1) {
+      size_type k = (level.size() + inner_slots) / (inner_slots + 1);
+      std::vector<node_header *> parents;
+      parents.reserve(k);
+      size_type c = 0;
+      for (size_type j = 0; j < k; ++j) {
+        inner_node *y = create_inner();
+        inner.push_back(y);
+        parents.push_back(y);
+
+        size_type m = level.size() / k + (j < level.size() % k);
+        y->children[0] = level[c++];
+        for (; y->count + 1u < m; ++y->count, ++c) {
+          alloc_traits::construct(alloc_, &y->key(y->count),
+                                  first_key(level[c], h));
+          y->children[y->count + 1] = level[c];
+        }
+      }
+      level.swap(parents);
+      ++h;
+    }
+
+    root_ = level[0];
+    height_ = h;
+    size_ = n;
+  } catch (...) {
+    for (inner_node *y : inner) {
+      for (unsigned j = 0; j < y->count; ++j)
+        alloc_traits::destroy(alloc_, &y->key(j));
+      deallocate_node(y);
+    }
+    while (first_ != nullptr) {
+      leaf_node *x = first_;
+      first_ = x->next;
+      for (unsigned j = 0; j < x->count; ++j)
+        alloc_traits::destroy(alloc_, &x->value(j));
+      deallocate_node(x);
+    }
+    last_ = nullptr;
+    throw;
+  }
+}
+
+template <class T, class C, class A, class P>
+void rb_btree<T, C, A, P>::destroy_sub_tree(node_header *x,
+                                            unsigned h) noexcept {
+  if (h == 0) {
+    leaf_node *y = as_leaf(x);
+    for (unsigned j = 0; j < y->count; ++j)
+      alloc_traits::destroy(alloc_, &y->value(j));
+    deallocate_node(y);
+    return;
+  }
+
+  inner_node *y = as_inner(x);
+  for (unsigned j = 0; j <= y->count; ++j)
+    destroy_sub_tree(y->children[j], h - 1);
+  for (unsigned j = 0; j < y->count; ++j)
+    alloc_traits::destroy(alloc_, &y->key(j));
+  deallocate_node(y);
+}
+
+} // namespace rb_tree
+
+#endif // RB_BTREE_H
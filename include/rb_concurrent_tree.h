@@ -0,0 +1,531 @@
+#ifndef RB_CONCURRENT_TREE_H
+#define RB_CONCURRENT_TREE_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "rb_persistent_tree.h"
+#include "rb_tree.h"
+
+namespace rb_tree {
+
+/*
+ * A reader-writer lock whose readers only write to a counter of their own.
+ * The reader counters are spread over cache lines (stripes), so that threads
+ * taking the shared lock on different stripes never touch the same line,
+ * and the lookups of a read-mostly tree scale with the threads.
+ * A writer blocks the new readers, then waits for every stripe to drain, so
+ * the exclusive lock costs O(stripes).
+ */
+class striped_rw_lock {
+ public:
+  static constexpr std::size_t stripes = 64;
+
+  striped_rw_lock() : writer_(false) {
+    for (std::size_t i = 0; i < stripes; ++i)
+      readers_[i].count.store(0, std::memory_order_relaxed);
+  }
+
+  striped_rw_lock(const striped_rw_lock&) = delete;
+  striped_rw_lock& operator=(const striped_rw_lock&) = delete;
+
+  /* Returns the stripe to give back to unlock_shared() */
+  std::size_t lock_shared() noexcept {
+    std::size_t i = stripe();
+    for (;;) {
+      readers_[i].count.fetch_add(1);
+      if (!writer_.load())
+        return i;
+
+      readers_[i].count.fetch_sub(1, std::memory_order_release);
+      while (writer_.load(std::memory_order_relaxed))
+        std::this_thread::yield();
+    }
+  }
+
+  void unlock_shared(std::size_t i) noexcept {
+    readers_[i].count.fetch_sub(1, std::memory_order_release);
+  }
+
+  void lock() noexcept {
+    while (writer_.exchange(true)) {
+      while (writer_.load(std::memory_order_relaxed))
+        std::this_thread::yield();
+    }
+
+    for (std::size_t i = 0; i < stripes; ++i) {
+      while (readers_[i].count.load() != 0)
+        std::this_thread::yield();
+    }
+  }
+
+  void unlock() noexcept { writer_.store(false, std::memory_order_release); }
+
+ private:
+  struct alignas(64) stripe_counter {
+    std::atomic<std::size_t> count;
+  };
+
+  stripe_counter readers_[stripes];
+  alignas(64) std::atomic<bool> writer_;
+
+  /* The threads take the stripes in turn, the first time they read */
+  static std::size_t stripe() noexcept {
+    static std::atomic<std::size_t> next(0);
+    static thread_local std::size_t i =
+      next.fetch_add(1, std::memory_order_relaxed) % stripes;
+    return i;
+  }
+}; // striped_rw_lock
+
+/*
+ * An rb_tree shared by reader threads and writer threads, e.g.
+ *   concurrent_rb_tree<int> index;
+ *   index.insert(42);                      // in the writer
+ *   bool found = index.contains(42);       // in any reader
+ * The lookups take the lock of a striped_rw_lock in shared mode, and run in
+ * parallel with each other; inserts and erases take it exclusively.
+ * The elements are passed to callbacks instead of being returned through
+ * iterators, which would outlive the lock:
+ *   index.find(42, [](const int& x) { ... });
+ * read() and write() run a function on the whole tree under a single lock,
+ * for consistent multi-step reads and for batches of writes, which only pay
+ * for one exclusive lock:
+ *   index.write([&](rb_tree<int>& t) { t.insert(v.begin(), v.end()); });
+ */
+template <class T,
+          class Compare = std::less<T>,
+          class Alloc = std::allocator<T>,
+          class Policy = default_policy>
+class concurrent_rb_tree {
+ public:
+  typedef rb_tree<T, Compare, Alloc, Policy> tree_type;
+  typedef typename tree_type::key_type key_type;
+  typedef typename tree_type::value_type value_type;
+  typedef typename tree_type::key_compare key_compare;
+  typedef typename tree_type::allocator_type allocator_type;
+  typedef typename tree_type::size_type size_type;
+
+  concurrent_rb_tree() : tree_() { }
+
+  explicit concurrent_rb_tree(const key_compare& comp,
+                              const allocator_type& alloc = allocator_type())
+    : tree_(comp, alloc) { }
+
+  template <class InputIterator>
+  concurrent_rb_tree(InputIterator first, InputIterator last,
+                     const key_compare& comp = key_compare(),
+                     const allocator_type& alloc = allocator_type())
+    : tree_(first, last, comp, alloc) { }
+
+  explicit concurrent_rb_tree(tree_type&& tree) : tree_(std::move(tree)) { }
+
+  concurrent_rb_tree(const concurrent_rb_tree&) = delete;
+  concurrent_rb_tree& operator=(const concurrent_rb_tree&) = delete;
+
+  /* Lookups, in parallel with each other */
+  bool contains(const key_type& val) const {
+    shared_guard g(lock_);
+    return tree_.find(val) != tree_.end();
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  bool contains(const K& val) const {
+    shared_guard g(lock_);
+    return tree_.find(val) != tree_.end();
+  }
+
+  /* Call f on the element equivalent to val, if any */
+  template <class K, class F>
+  bool find(const K& val, F f) const {
+    shared_guard g(lock_);
+    typename tree_type::const_iterator it = tree_.find(val);
+    if (it == tree_.end())
+      return false;
+    f(*it);
+    return true;
+  }
+
+  /* Call f on the first element not less than val, if any */
+  template <class K, class F>
+  bool lower_bound(const K& val, F f) const {
+    shared_guard g(lock_);
+    typename tree_type::const_iterator it = tree_.lower_bound(val);
+    if (it == tree_.end())
+      return false;
+    f(*it);
+    return true;
+  }
+
+  size_type size() const {
+    shared_guard g(lock_);
+    return tree_.size();
+  }
+  bool empty() const {
+    shared_guard g(lock_);
+    return tree_.empty();
+  }
+
+  /* Run f(const tree_type&) with the tree locked for reading */
+  template <class F>
+  auto read(F f) const -> decltype(f(std::declval<const tree_type&>())) {
+    shared_guard g(lock_);
+    return f(tree_);
+  }
+
+  /* Mutations, one writer at a time */
+  bool insert(const value_type& val) {
+    unique_guard g(lock_);
+    return tree_.insert(val).second;
+  }
+  bool insert(value_type&& val) {
+    unique_guard g(lock_);
+    return tree_.insert(std::move(val)).second;
+  }
+  template <class... Args>
+  bool emplace(Args&&... args) {
+    unique_guard g(lock_);
+    return tree_.emplace(std::forward<Args>(args)...).second;
+  }
+
+  size_type erase(const key_type& val) {
+    unique_guard g(lock_);
+    return tree_.erase(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  size_type erase(const K& val) {
+    unique_guard g(lock_);
+    return tree_.erase(val);
+  }
+
+  void clear() {
+    unique_guard g(lock_);
+    tree_.clear();
+  }
+
+  /* Run f(tree_type&) with the tree locked for writing */
+  template <class F>
+  auto write(F f) -> decltype(f(std::declval<tree_type&>())) {
+    unique_guard g(lock_);
+    return f(tree_);
+  }
+
+ private:
+  class shared_guard {
+   public:
+    explicit shared_guard(striped_rw_lock& lock)
+      : lock_(lock), stripe_(lock.lock_shared()) { }
+    ~shared_guard() { lock_.unlock_shared(stripe_); }
+
+    shared_guard(const shared_guard&) = delete;
+    shared_guard& operator=(const shared_guard&) = delete;
+
+   private:
+    striped_rw_lock& lock_;
+    std::size_t stripe_;
+  };
+
+  class unique_guard {
+   public:
+    explicit unique_guard(striped_rw_lock& lock) : lock_(lock) { lock.lock(); }
+    ~unique_guard() { lock_.unlock(); }
+
+    unique_guard(const unique_guard&) = delete;
+    unique_guard& operator=(const unique_guard&) = delete;
+
+   private:
+    striped_rw_lock& lock_;
+  };
+
+  tree_type tree_;
+  mutable striped_rw_lock lock_;
+}; // concurrent_rb_tree
+
+/*
+ * Grace periods for readers that never wait, e.g.
+ *   std::size_t token = domain.enter();
+ *   ...                                    // read the published data
+ *   domain.leave(token);
+ * A writer that unpublished some data calls synchronize(), which returns
+ * once every reader that entered before the call has left, and then frees
+ * the data. The readers count themselves on their stripe, for the current
+ * one of two epochs, so enter() and leave() are one atomic add each.
+ * synchronize() flips the epoch and waits for the readers of the old one,
+ * twice, so that it also waits for those that entered while it ran the first
+ * time with an epoch loaded before the flip. It costs O(stripes) plus the
+ * longest read in flight, and must be called by one thread at a time.
+ */
+class epoch_domain {
+ public:
+  static constexpr std::size_t stripes = 64;
+
+  epoch_domain() : epoch_(0) {
+    for (std::size_t i = 0; i < stripes; ++i) {
+      readers_[i].count[0].store(0, std::memory_order_relaxed);
+      readers_[i].count[1].store(0, std::memory_order_relaxed);
+    }
+  }
+
+  epoch_domain(const epoch_domain&) = delete;
+  epoch_domain& operator=(const epoch_domain&) = delete;
+
+  /* Returns the token to give back to leave() */
+  std::size_t enter() noexcept {
+    std::size_t e = epoch_.load();
+    std::size_t i = stripe();
+    readers_[i].count[e].fetch_add(1);
+    return 2 * i + e;
+  }
+
+  void leave(std::size_t token) noexcept {
+    readers_[token / 2].count[token % 2].fetch_sub(
+        1, std::memory_order_release);
+  }
+
+  void synchronize() noexcept {
+    for (int round = 0; round < 2; ++round) {
+      std::size_t e = epoch_.load(std::memory_order_relaxed);
+      epoch_.store(e ^ 1);
+      for (std::size_t i = 0; i < stripes; ++i) {
+        while (readers_[i].count[e].load() != 0)
+          std::this_thread::yield();
+      }
+    }
+  }
+
+ private:
+  struct alignas(64) stripe_counters {
+    std::atomic<std::size_t> count[2];
+  };
+
+  stripe_counters readers_[stripes];
+  alignas(64) std::atomic<std::size_t> epoch_;
+
+  /* The threads take the stripes in turn, the first time they read */
+  static std::size_t stripe() noexcept {
+    static std::atomic<std::size_t> next(0);
+    static thread_local std::size_t i =
+      next.fetch_add(1, std::memory_order_relaxed) % stripes;
+    return i;
+  }
+}; // epoch_domain
+
+/*
+ * A tree whose readers never block, not even on its writers, e.g.
+ *   epoch_rb_tree<int> index;
+ *   index.insert(42);                      // in a writer
+ *   bool found = index.contains(42);       // in any reader, wait-free
+ * The readers look up the version that was published last, a
+ * persistent_rb_tree whose nodes never change. A writer changes its own
+ * copy, which shares all the nodes but those on the O(log n) paths that it
+ * writes, and publishes a snapshot of it with a single atomic store. The
+ * previous version, and the nodes that only it holds, is destroyed once the
+ * Reclaimer has granted a grace period for the readers that may still be on
+ * it. The lookups take no lock, and only write to the Reclaimer.
+ *
+ * The writers take a mutex, and each change waits for the grace period, so
+ * write() applies a batch of changes under a single publication:
+ *   index.write([&](persistent_rb_tree<int>& t) { t.insert(v.begin(),
+ *                                                          v.end()); });
+ * A Reclaimer has the enter(), leave() and synchronize() of epoch_domain,
+ * e.g. it can forward them to the RCU of the process.
+ */
+template <class T,
+          class Compare = std::less<T>,
+          class Alloc = std::allocator<T>,
+          class Reclaimer = epoch_domain>
+class epoch_rb_tree {
+ public:
+  typedef persistent_rb_tree<T, Compare, Alloc> tree_type;
+  typedef typename tree_type::key_type key_type;
+  typedef typename tree_type::value_type value_type;
+  typedef typename tree_type::key_compare key_compare;
+  typedef typename tree_type::allocator_type allocator_type;
+  typedef typename tree_type::size_type size_type;
+
+  epoch_rb_tree() : epoch_rb_tree(tree_type()) { }
+
+  explicit epoch_rb_tree(const key_compare& comp,
+                         const allocator_type& alloc = allocator_type())
+    : epoch_rb_tree(tree_type(comp, alloc)) { }
+
+  template <class InputIterator>
+  epoch_rb_tree(InputIterator first, InputIterator last,
+                const key_compare& comp = key_compare(),
+                const allocator_type& alloc = allocator_type())
+    : epoch_rb_tree(tree_type(first, last, comp, alloc)) { }
+
+  explicit epoch_rb_tree(tree_type&& tree)
+    : tree_(std::move(tree)), current_(new tree_type(tree_)) { }
+
+  epoch_rb_tree(const epoch_rb_tree&) = delete;
+  epoch_rb_tree& operator=(const epoch_rb_tree&) = delete;
+
+  ~epoch_rb_tree() { delete current_.load(std::memory_order_relaxed); }
+
+  /* Lookups, in parallel with each other and with the writers */
+  bool contains(const key_type& val) const {
+    read_guard g(*this);
+    return g.tree().contains(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  bool contains(const K& val) const {
+    read_guard g(*this);
+    return g.tree().contains(val);
+  }
+
+  /* Call f on the element equivalent to val, if any */
+  template <class K, class F>
+  bool find(const K& val, F f) const {
+    read_guard g(*this);
+    typename tree_type::const_iterator it = g.tree().find(val);
+    if (it == g.tree().end())
+      return false;
+    f(*it);
+    return true;
+  }
+
+  /* Call f on the first element not less than val, if any */
+  template <class K, class F>
+  bool lower_bound(const K& val, F f) const {
+    read_guard g(*this);
+    typename tree_type::const_iterator it = g.tree().lower_bound(val);
+    if (it == g.tree().end())
+      return false;
+    f(*it);
+    return true;
+  }
+
+  size_type size() const {
+    read_guard g(*this);
+    return g.tree().size();
+  }
+  bool empty() const {
+    read_guard g(*this);
+    return g.tree().empty();
+  }
+
+  /* Run f(const tree_type&) on the published version */
+  template <class F>
+  auto read(F f) const -> decltype(f(std::declval<const tree_type&>())) {
+    read_guard g(*this);
+    return f(g.tree());
+  }
+
+  /*
+   * A copy of the published version, which stays readable without any
+   * guard, since it holds its nodes
+   */
+  tree_type snapshot() const {
+    read_guard g(*this);
+    return g.tree();
+  }
+
+  /* Mutations, one writer at a time */
+  bool insert(const value_type& val) {
+    write_guard g(*this);
+    return g.changed(tree_.insert(val));
+  }
+  bool insert(value_type&& val) {
+    write_guard g(*this);
+    return g.changed(tree_.insert(std::move(val)));
+  }
+  template <class... Args>
+  bool emplace(Args&&... args) {
+    write_guard g(*this);
+    return g.changed(tree_.emplace(std::forward<Args>(args)...));
+  }
+
+  size_type erase(const key_type& val) {
+    write_guard g(*this);
+    size_type n = tree_.erase(val);
+    g.changed(n != 0);
+    return n;
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  size_type erase(const K& val) {
+    write_guard g(*this);
+    size_type n = tree_.erase(val);
+    g.changed(n != 0);
+    return n;
+  }
+
+  void clear() {
+    write_guard g(*this);
+    tree_.clear();
+  }
+
+  /* Run f(tree_type&) on the copy of the writers, and publish it */
+  template <class F>
+  auto write(F f) -> decltype(f(std::declval<tree_type&>())) {
+    write_guard g(*this);
+    return f(tree_);
+  }
+
+ private:
+  class read_guard {
+   public:
+    explicit read_guard(const epoch_rb_tree& t)
+      : reclaim_(t.reclaim_), token_(t.reclaim_.enter()),
+        tree_(*t.current_.load()) { }
+    ~read_guard() { reclaim_.leave(token_); }
+
+    read_guard(const read_guard&) = delete;
+    read_guard& operator=(const read_guard&) = delete;
+
+    const tree_type& tree() const { return tree_; }
+
+   private:
+    Reclaimer& reclaim_;
+    std::size_t token_;
+    const tree_type& tree_;
+  };
+
+  /*
+   * Takes the mutex, and publishes tree_ on the way out unless nothing
+   * changed. The version is allocated first, so that a change that throws
+   * is still published: the copy may have been changed before the throw.
+   */
+  class write_guard {
+   public:
+    explicit write_guard(epoch_rb_tree& t)
+      : t_(t), lock_(t.writer_),
+        next_(new tree_type(t.tree_.key_comp(), t.tree_.get_allocator())),
+        changed_(true) { }
+    ~write_guard() {
+      if (changed_)
+        t_.publish(std::move(next_));
+    }
+
+    write_guard(const write_guard&) = delete;
+    write_guard& operator=(const write_guard&) = delete;
+
+    bool changed(bool changed) { return changed_ = changed; }
+
+   private:
+    epoch_rb_tree& t_;
+    std::lock_guard<std::mutex> lock_;
+    std::unique_ptr<tree_type> next_;
+    bool changed_;
+  };
+
+  /* Replace the published version, and destroy the old one when unread */
+  void publish(std::unique_ptr<tree_type> next) noexcept {
+    *next = tree_;
+    const tree_type *old = current_.exchange(next.release());
+    reclaim_.synchronize();
+    delete old;
+  }
+
+  tree_type tree_;
+  std::atomic<const tree_type *> current_;
+  std::mutex writer_;
+  mutable Reclaimer reclaim_;
+}; // epoch_rb_tree
+
+} // namespace rb_tree
+
+#endif // RB_CONCURRENT_TREE_H
@@ -0,0 +1,595 @@
+#ifndef RB_FROZEN_TREE_H
+#define RB_FROZEN_TREE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include "rb_tree.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define RB_TREE_SIMD_AVX2
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define RB_TREE_SIMD_NEON
+#endif
+
+namespace rb_tree {
+
+/*
+ * The SIMD search of the top levels of a frozen_rb_tree, which are packed
+ * at the start of its array. The elements there form a complete tree, and
+ * after descending it a lookup is at index 2^levels + the number of them
+ * that are less than the key, so the vector comparisons count them at once
+ * instead of taking levels dependent steps. It reads the elements 1 to
+ * 2^levels, and is only defined for the 4 and 8 byte integers when built
+ * with AVX2 or NEON; levels is 0 otherwise.
+ */
+template <class Key,
+          std::size_t Size = std::is_integral<Key>::value ? sizeof(Key) : 0>
+struct frozen_rb_tree_top {
+  static constexpr unsigned levels = 0;
+};
+
+#if defined(RB_TREE_SIMD_AVX2) || defined(RB_TREE_SIMD_NEON)
+inline unsigned frozen_rb_tree_bit_count(std::uint32_t m) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcount(m);
+#else
+  unsigned n = 0;
+  for (; m != 0; m &= m - 1)
+    ++n;
+  return n;
+#endif
+}
+
+template <class Key>
+struct frozen_rb_tree_top<Key, 4> {
+  static constexpr unsigned levels = 5;
+
+  static unsigned count_less(const Key *top, Key val) {
+    return count<false>(top, val);
+  }
+  static unsigned count_greater(const Key *top, Key val) {
+    return count<true>(top, val);
+  }
+
+ private:
+  /* The elements of top[0, 31) less than val, or greater than val */
+  template <bool Greater>
+  static unsigned count(const Key *top, Key val) {
+#if defined(RB_TREE_SIMD_AVX2)
+    /* flip the sign bits, so that the signed comparisons order unsigned keys */
+    const __m256i bias = _mm256_set1_epi32(
+        std::is_signed<Key>::value ? 0 : INT32_MIN);
+    const __m256i v = _mm256_xor_si256(
+        _mm256_set1_epi32(static_cast<std::int32_t>(val)), bias);
+    std::uint32_t m = 0;
+    for (int i = 0; i < 4; ++i) {
+      __m256i e = _mm256_xor_si256(_mm256_loadu_si256(
+          reinterpret_cast<const __m256i *>(top + 8 * i)), bias);
+      __m256i c = Greater ? _mm256_cmpgt_epi32(e, v) : _mm256_cmpgt_epi32(v, e);
+      m |= static_cast<std::uint32_t>(
+          _mm256_movemask_ps(_mm256_castsi256_ps(c))) << (8 * i);
+    }
+    return frozen_rb_tree_bit_count(m & 0x7fffffff);
+#else
+    uint32x4_t n = vdupq_n_u32(0);
+    for (int i = 0; i < 8; ++i) {
+      uint32x4_t c;
+      if (std::is_signed<Key>::value) {
+        int32x4_t e =
+          vld1q_s32(reinterpret_cast<const std::int32_t *>(top) + 4 * i);
+        int32x4_t v = vdupq_n_s32(static_cast<std::int32_t>(val));
+        c = Greater ? vcgtq_s32(e, v) : vcltq_s32(e, v);
+      } else {
+        uint32x4_t e =
+          vld1q_u32(reinterpret_cast<const std::uint32_t *>(top) + 4 * i);
+        uint32x4_t v = vdupq_n_u32(static_cast<std::uint32_t>(val));
+        c = Greater ? vcgtq_u32(e, v) : vcltq_u32(e, v);
+      }
+      n = vsubq_u32(n, c);   /* a match is all ones, -1 */
+    }
+    /* the last lane read is the element 32, which is below the top */
+    bool last = Greater ? val < top[31] : top[31] < val;
+    return vaddvq_u32(n) - (last ? 1 : 0);
+#endif
+  }
+};
+
+template <class Key>
+struct frozen_rb_tree_top<Key, 8> {
+  static constexpr unsigned levels = 4;
+
+  static unsigned count_less(const Key *top, Key val) {
+    return count<false>(top, val);
+  }
+  static unsigned count_greater(const Key *top, Key val) {
+    return count<true>(top, val);
+  }
+
+ private:
+  /* The elements of top[0, 15) less than val, or greater than val */
+  template <bool Greater>
+  static unsigned count(const Key *top, Key val) {
+#if defined(RB_TREE_SIMD_AVX2)
+    const __m256i bias = _mm256_set1_epi64x(
+        std::is_signed<Key>::value ? 0 : INT64_MIN);
+    const __m256i v = _mm256_xor_si256(
+        _mm256_set1_epi64x(static_cast<long long>(val)), bias);
+    std::uint32_t m = 0;
+    for (int i = 0; i < 4; ++i) {
+      __m256i e = _mm256_xor_si256(_mm256_loadu_si256(
+          reinterpret_cast<const __m256i *>(top + 4 * i)), bias);
+      __m256i c = Greater ? _mm256_cmpgt_epi64(e, v) : _mm256_cmpgt_epi64(v, e);
+      m |= static_cast<std::uint32_t>(
+          _mm256_movemask_pd(_mm256_castsi256_pd(c))) << (4 * i);
+    }
+    return frozen_rb_tree_bit_count(m & 0x7fff);
+#else
+    uint64x2_t n = vdupq_n_u64(0);
+    for (int i = 0; i < 8; ++i) {
+      uint64x2_t c;
+      if (std::is_signed<Key>::value) {
+        int64x2_t e =
+          vld1q_s64(reinterpret_cast<const std::int64_t *>(top) + 2 * i);
+        int64x2_t v = vdupq_n_s64(static_cast<std::int64_t>(val));
+        c = Greater ? vcgtq_s64(e, v) : vcltq_s64(e, v);
+      } else {
+        uint64x2_t e =
+          vld1q_u64(reinterpret_cast<const std::uint64_t *>(top) + 2 * i);
+        uint64x2_t v = vdupq_n_u64(static_cast<std::uint64_t>(val));
+        c = Greater ? vcgtq_u64(e, v) : vcltq_u64(e, v);
+      }
+      n = vsubq_u64(n, c);
+    }
+    bool last = Greater ? val < top[15] : top[15] < val;
+    return static_cast<unsigned>(vaddvq_u64(n)) - (last ? 1 : 0);
+#endif
+  }
+};
+#endif
+
+/*
+ * An immutable copy of an rb_tree for trees that are built once and then
+ * only queried, e.g.
+ *   rb_tree<int> t;
+ *   ...
+ *   frozen_rb_tree<int> f = freeze(t);
+ *   frozen_rb_tree<int>::const_iterator it = f.lower_bound(42);
+ * The elements are laid out in a single array in Eytzinger (BFS) order:
+ * the children of the element at index k, counting from 1, are at 2k and
+ * 2k + 1, so there are no links to load at all. A lookup takes a branch
+ * free descent, and the elements four levels below are in one or two cache
+ * lines, which the descent prefetches while it compares.
+ * The iterators walk the implicit tree with the same indexes.
+ */
+template <class T,
+          class Compare = std::less<T>,
+          class Alloc = std::allocator<T>,
+          class Policy = default_policy>
+class frozen_rb_tree {
+ public:
+  typedef typename Policy::key_of_value key_of_value;
+  typedef T value_type;
+  typedef typename std::decay<decltype(
+      key_of_value::key(std::declval<const value_type&>()))>::type key_type;
+  typedef Compare key_compare;
+  typedef Alloc allocator_type;
+  typedef const value_type& reference;
+  typedef const value_type& const_reference;
+  typedef typename std::allocator_traits<Alloc>::difference_type
+    difference_type;
+  typedef typename std::allocator_traits<Alloc>::size_type size_type;
+  typedef typename std::allocator_traits<Alloc>::pointer pointer;
+  typedef typename std::allocator_traits<Alloc>::const_pointer const_pointer;
+
+  class const_iterator {
+   public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef typename frozen_rb_tree::value_type value_type;
+    typedef typename frozen_rb_tree::difference_type difference_type;
+    typedef const value_type* pointer;
+    typedef const value_type& reference;
+
+    const_iterator() : base_(nullptr), size_(0), k_(0) { }
+
+    const value_type& operator*() const { return base_[k_]; }
+    const value_type* operator->() const { return base_ + k_; }
+
+    const_iterator& operator++() {
+      k_ = next_index(k_, size_);
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator tmp(*this);
+      ++*this;
+      return tmp;
+    }
+
+    const_iterator& operator--() {
+      k_ = prev_index(k_, size_);
+      return *this;
+    }
+    const_iterator operator--(int) {
+      const_iterator tmp(*this);
+      --*this;
+      return tmp;
+    }
+
+    bool operator==(const const_iterator& other) const {
+      return k_ == other.k_;
+    }
+    bool operator!=(const const_iterator& other) const {
+      return k_ != other.k_;
+    }
+
+   private:
+    /* base_[k] is the element at index k, and index 0 is the end */
+    const value_type *base_;
+    size_type size_;
+    size_type k_;
+
+    const_iterator(const value_type *base, size_type size, size_type k)
+      : base_(base), size_(size), k_(k) { }
+
+    friend class frozen_rb_tree;
+  }; // const_iterator
+
+  typedef const_iterator iterator;
+  typedef std::reverse_iterator<const_iterator> reverse_iterator;
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+  frozen_rb_tree() : comp_(), data_(nullptr), size_(0) { }
+
+  /* Copy the elements of tree, which may have any allocator and layout */
+  template <class A, class P>
+  explicit frozen_rb_tree(const rb_tree<T, Compare, A, P>& tree,
+                          const allocator_type& alloc = allocator_type())
+    : alloc_(alloc), comp_(tree.key_comp()), data_(nullptr), size_(0) {
+    static_assert(std::is_same<typename P::key_of_value,
+                               key_of_value>::value,
+                  "the trees must take the same keys out of the elements");
+    build(tree.begin(), tree.size());
+  }
+
+  /* Copy a strictly increasing range */
+  template <class ForwardIterator>
+  frozen_rb_tree(sorted_unique_t, ForwardIterator first, ForwardIterator last,
+                 const key_compare& comp = key_compare(),
+                 const allocator_type& alloc = allocator_type())
+    : alloc_(alloc), comp_(comp), data_(nullptr), size_(0) {
+    build(first, static_cast<size_type>(std::distance(first, last)));
+  }
+
+  frozen_rb_tree(const frozen_rb_tree& other)
+    : alloc_(std::allocator_traits<Alloc>::
+               select_on_container_copy_construction(other.alloc_)),
+      comp_(other.comp_), data_(nullptr), size_(0) {
+    build(other.begin(), other.size_);
+  }
+
+  frozen_rb_tree(frozen_rb_tree&& other) noexcept
+    : alloc_(std::move(other.alloc_)), comp_(std::move(other.comp_)),
+      data_(other.data_), size_(other.size_) {
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+
+  ~frozen_rb_tree() { destroy(); }
+
+  frozen_rb_tree& operator=(const frozen_rb_tree& other) {
+    if (this != &other) {
+      frozen_rb_tree tmp(other);
+      swap(tmp);
+    }
+    return *this;
+  }
+
+  frozen_rb_tree& operator=(frozen_rb_tree&& other) noexcept {
+    swap(other);
+    return *this;
+  }
+
+  const_iterator begin() const { return iterator_at(first_index(size_)); }
+  const_iterator end() const { return iterator_at(0); }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+  const_reverse_iterator rbegin() const {
+    return const_reverse_iterator(end());
+  }
+  const_reverse_iterator rend() const {
+    return const_reverse_iterator(begin());
+  }
+  const_reverse_iterator crbegin() const { return rbegin(); }
+  const_reverse_iterator crend() const { return rend(); }
+
+  const_iterator lower_bound(const key_type& val) const {
+    return iterator_at(lower_bound_index(val));
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  const_iterator lower_bound(const K& val) const {
+    return iterator_at(lower_bound_index(val));
+  }
+
+  const_iterator upper_bound(const key_type& val) const {
+    return iterator_at(upper_bound_index(val));
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  const_iterator upper_bound(const K& val) const {
+    return iterator_at(upper_bound_index(val));
+  }
+
+  const_iterator find(const key_type& val) const {
+    return iterator_at(find_index(val));
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  const_iterator find(const K& val) const {
+    return iterator_at(find_index(val));
+  }
+
+  size_type count(const key_type& val) const {
+    return find_index(val) != 0 ? 1 : 0;
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  size_type count(const K& val) const {
+    return find_index(val) != 0 ? 1 : 0;
+  }
+
+  bool contains(const key_type& val) const { return find_index(val) != 0; }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  bool contains(const K& val) const {
+    return find_index(val) != 0;
+  }
+
+  std::pair<const_iterator, const_iterator>
+  equal_range(const key_type& val) const {
+    return equal_range_index(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  std::pair<const_iterator, const_iterator> equal_range(const K& val) const {
+    return equal_range_index(val);
+  }
+
+  void swap(frozen_rb_tree& other) noexcept {
+    using std::swap;
+    swap(alloc_, other.alloc_);
+    swap(comp_, other.comp_);
+    swap(data_, other.data_);
+    swap(size_, other.size_);
+  }
+
+  allocator_type get_allocator() const { return alloc_; }
+  key_compare key_comp() const { return comp_; }
+
+  size_type size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  /*
+   * The elements by index, from data()[1] to data()[size()]; the children
+   * of the index k are 2k and 2k + 1, and data()[0] is not an element
+   */
+  const value_type *data() const { return data_; }
+
+ protected:
+  typedef std::allocator_traits<allocator_type> alloc_traits;
+
+  allocator_type alloc_;
+  key_compare comp_;
+
+  /*
+   * size_ + 1 slots, where data_[k] is the element at index k. Slot 0 is
+   * left unconstructed, so that the siblings of each level start at a power
+   * of two.
+   */
+  value_type *data_;
+  size_type size_;
+
+  /* The elements of a cache line, as a power of two */
+  static constexpr size_type line_elements =
+    sizeof(value_type) > 32 ? 1 :
+    sizeof(value_type) > 16 ? 2 :
+    sizeof(value_type) > 8 ? 4 :
+    sizeof(value_type) > 4 ? 8 : 16;
+
+  const_iterator iterator_at(size_type k) const {
+    return const_iterator(data_, size_, k);
+  }
+
+  static const key_type& key(const value_type& val) {
+    return key_of_value::key(val);
+  }
+
+  /* The index of the first element, or 0 if there is none */
+  static size_type first_index(size_type n) {
+    if (n == 0)
+      return 0;
+    size_type k = 1;
+    while (2 * k <= n)
+      k = 2 * k;
+    return k;
+  }
+
+  static size_type next_index(size_type k, size_type n) {
+    if (2 * k + 1 <= n) {
+      k = 2 * k + 1;
+      while (2 * k <= n)
+        k = 2 * k;
+    } else {
+      /* climb while k is a right child */
+      while (k & 1)
+        k >>= 1;
+      k >>= 1;
+    }
+    return k;
+  }
+
+  static size_type prev_index(size_type k, size_type n) {
+    if (k == 0) {
+      k = 1;
+      while (2 * k + 1 <= n)
+        k = 2 * k + 1;
+    } else if (2 * k <= n) {
+      k = 2 * k;
+      while (2 * k + 1 <= n)
+        k = 2 * k + 1;
+    } else {
+      /* climb while k is a left child */
+      while (!(k & 1))
+        k >>= 1;
+      k >>= 1;
+    }
+    return k;
+  }
+
+  /*
+   * After a descent that went right at every element less than the bound,
+   * the bound is where the descent last went left: drop the trailing right
+   * turns, which are one bits, and the left turn before them
+   */
+  static size_type last_left_turn(size_type k) {
+#if defined(__GNUC__) || defined(__clang__)
+    return k >> (__builtin_ctzll(~static_cast<unsigned long long>(k)) + 1);
+#else
+    while (k & 1)
+      k >>= 1;
+    return k >> 1;
+#endif
+  }
+
+  /*
+   * The lookups of the integer keys themselves, with std::less, start
+   * below the top levels when the tree fills them, at the index given by
+   * the SIMD count
+   */
+  typedef frozen_rb_tree_top<key_type> top_search;
+  template <class K>
+  struct top_searchable
+    : std::integral_constant<bool, top_search::levels != 0 &&
+          std::is_same<value_type, key_type>::value &&
+          std::is_same<K, key_type>::value &&
+          (std::is_same<Compare, std::less<key_type> >::value ||
+           std::is_same<Compare, std::less<void> >::value)> { };
+
+  template <class K>
+  size_type lower_bound_start(const K&, std::false_type) const { return 1; }
+  size_type lower_bound_start(const key_type& val, std::true_type) const {
+    const size_type top = size_type(1) << top_search::levels;
+    if (size_ < top)
+      return 1;
+    return top + top_search::count_less(data_ + 1, val);
+  }
+
+  /* upper_bound goes right at the elements not greater than val */
+  template <class K>
+  size_type upper_bound_start(const K&, std::false_type) const { return 1; }
+  size_type upper_bound_start(const key_type& val, std::true_type) const {
+    const size_type top = size_type(1) << top_search::levels;
+    if (size_ < top)
+      return 1;
+    return 2 * top - 1 - top_search::count_greater(data_ + 1, val);
+  }
+
+  template <class K>
+  size_type lower_bound_index(const K& val) const {
+    size_type k = lower_bound_start(val, top_searchable<K>());
+    while (k <= size_) {
+      if (k * line_elements <= size_)
+        RB_TREE_PREFETCH(data_ + k * line_elements);
+      k = 2 * k + (comp_(key(data_[k]), val) ? 1 : 0);
+    }
+    return last_left_turn(k);
+  }
+
+  template <class K>
+  size_type upper_bound_index(const K& val) const {
+    size_type k = upper_bound_start(val, top_searchable<K>());
+    while (k <= size_) {
+      if (k * line_elements <= size_)
+        RB_TREE_PREFETCH(data_ + k * line_elements);
+      k = 2 * k + (comp_(val, key(data_[k])) ? 0 : 1);
+    }
+    return last_left_turn(k);
+  }
+
+  template <class K>
+  size_type find_index(const K& val) const {
+    size_type k = lower_bound_index(val);
+    return k != 0 && !comp_(val, key(data_[k])) ? k : 0;
+  }
+
+  template <class K>
+  std::pair<const_iterator, const_iterator>
+  equal_range_index(const K& val) const {
+    size_type k = lower_bound_index(val);
+    if (k == 0 || comp_(val, key(data_[k])))
+      return std::make_pair(iterator_at(k), iterator_at(k));
+    return std::make_pair(iterator_at(k), iterator_at(next_index(k, size_)));
+  }
+
+  /* Construct the n elements from first, visiting the indexes in order */
+  template <class InputIterator>
+  void build(InputIterator first, size_type n) {
+    if (n == 0)
+      return;
+
+    data_ = alloc_traits::allocate(alloc_, n + 1);
+    size_type k = first_index(n);
+    try {
+      for (; k != 0; k = next_index(k, n), ++first)
+        alloc_traits::construct(alloc_, data_ + k, *first);
+    } catch (...) {
+      for (size_type i = first_index(n); i != k; i = next_index(i, n))
+        alloc_traits::destroy(alloc_, data_ + i);
+      alloc_traits::deallocate(alloc_, data_, n + 1);
+      data_ = nullptr;
+      throw;
+    }
+    size_ = n;
+  }
+
+  void destroy() noexcept {
+    if (data_ == nullptr)
+      return;
+    for (size_type k = 1; k <= size_; ++k)
+      alloc_traits::destroy(alloc_, data_ + k);
+    alloc_traits::deallocate(alloc_, data_, size_ + 1);
+    data_ = nullptr;
+    size_ = 0;
+  }
+}; // frozen_rb_tree
+
+/* A frozen copy of the tree */
+template <class T, class C, class A, class P>
+frozen_rb_tree<T, C, A, P> freeze(const rb_tree<T, C, A, P>& tree) {
+  return frozen_rb_tree<T, C, A, P>(tree, tree.get_allocator());
+}
+
+template <class T, class C, class A, class P>
+bool operator==(const frozen_rb_tree<T, C, A, P>& lhs,
+                const frozen_rb_tree<T, C, A, P>& rhs) {
+  return lhs.size() == rhs.size() &&
+         std::equal(lhs.begin(), lhs.end(), rhs.begin());
+}
+
+template <class T, class C, class A, class P>
+bool operator!=(const frozen_rb_tree<T, C, A, P>& lhs,
+                const frozen_rb_tree<T, C, A, P>& rhs) {
+  return !(lhs == rhs);
+}
+
+template <class T, class C, class A, class P>
+void swap(frozen_rb_tree<T, C, A, P>& lhs,
+          frozen_rb_tree<T, C, A, P>& rhs) noexcept {
+  lhs.swap(rhs);
+}
+
+} // namespace rb_tree
+
+#endif // RB_FROZEN_TREE_H
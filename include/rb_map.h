@@ -0,0 +1,236 @@
+#ifndef RB_MAP_H
+#define RB_MAP_H
+
+#include <stdexcept>
+#include <tuple>
+
+#include "rb_tree.h"
+#include "rb_multiset.h"
+
+namespace rb_tree {
+
+/* The policy of the maps: Policy with the keys taken out of the pairs */
+template <class Policy>
+struct map_policy : Policy {
+  typedef pair_first_key key_of_value;
+};
+
+/*
+ * A map on the same tree as rb_tree, whose value_type is
+ * std::pair<const Key, T> compared by the keys only.
+ * The mapped values can be changed through the iterators.
+ * try_emplace(), insert_or_assign() and operator[] find either the element
+ * or the position to insert it with a single descent, and only create a
+ * node when the key is new.
+ */
+template <class Key, class T, class Compare = std::less<Key>,
+          class Alloc = std::allocator<std::pair<const Key, T> >,
+          class Policy = default_policy>
+class rb_map
+  : public rb_tree<std::pair<const Key, T>, Compare, Alloc,
+                   map_policy<Policy> > {
+  typedef rb_tree<std::pair<const Key, T>, Compare, Alloc,
+                  map_policy<Policy> > base;
+
+ public:
+  typedef Key key_type;
+  typedef T mapped_type;
+  typedef typename base::value_type value_type;
+  typedef typename base::key_compare key_compare;
+  typedef typename base::allocator_type allocator_type;
+  typedef typename base::size_type size_type;
+  typedef typename base::iterator iterator;
+  typedef typename base::const_iterator const_iterator;
+
+  rb_map() : base() { }
+
+  explicit rb_map(const key_compare& comp,
+                  const allocator_type& alloc = allocator_type())
+    : base(comp, alloc) { }
+
+  explicit rb_map(const allocator_type& alloc) : base(alloc) { }
+
+  template <class InputIterator>
+  rb_map(InputIterator first, InputIterator last,
+         const key_compare& comp = key_compare(),
+         const allocator_type& alloc = allocator_type())
+    : base(first, last, comp, alloc) { }
+
+  template <class InputIterator>
+  rb_map(InputIterator first, InputIterator last,
+         const allocator_type& alloc)
+    : base(first, last, alloc) { }
+
+  rb_map(const rb_map& other, const allocator_type& alloc)
+    : base(other, alloc) { }
+
+  rb_map(rb_map&& other, const allocator_type& alloc)
+    : base(std::move(other), alloc) { }
+
+  rb_map(const rb_map&) = default;
+  rb_map(rb_map&&) = default;
+  rb_map& operator=(const rb_map&) = default;
+  rb_map& operator=(rb_map&&) = default;
+
+  /* Construct the mapped value from args only if k is not in the map */
+  template <class... Args>
+  std::pair<iterator, bool> try_emplace(const key_type& k, Args&&... args) {
+    return try_emplace_unique(this->get_insert_unique_pos(k), k,
+                              std::forward<Args>(args)...);
+  }
+  template <class... Args>
+  std::pair<iterator, bool> try_emplace(key_type&& k, Args&&... args) {
+    return try_emplace_unique(this->get_insert_unique_pos(k), std::move(k),
+                              std::forward<Args>(args)...);
+  }
+  template <class... Args>
+  iterator try_emplace(const_iterator hint, const key_type& k,
+                       Args&&... args) {
+    return try_emplace_unique(
+        this->get_insert_hint_unique_pos(base::node_of(hint), k), k,
+        std::forward<Args>(args)...).first;
+  }
+  template <class... Args>
+  iterator try_emplace(const_iterator hint, key_type&& k, Args&&... args) {
+    return try_emplace_unique(
+        this->get_insert_hint_unique_pos(base::node_of(hint), k),
+        std::move(k), std::forward<Args>(args)...).first;
+  }
+
+  /* Assign obj to the mapped value of k, or insert it if k is new */
+  template <class M>
+  std::pair<iterator, bool> insert_or_assign(const key_type& k, M&& obj) {
+    return assign_unique(this->get_insert_unique_pos(k), k,
+                         std::forward<M>(obj));
+  }
+  template <class M>
+  std::pair<iterator, bool> insert_or_assign(key_type&& k, M&& obj) {
+    return assign_unique(this->get_insert_unique_pos(k), std::move(k),
+                         std::forward<M>(obj));
+  }
+  template <class M>
+  iterator insert_or_assign(const_iterator hint, const key_type& k,
+                            M&& obj) {
+    return assign_unique(
+        this->get_insert_hint_unique_pos(base::node_of(hint), k), k,
+        std::forward<M>(obj)).first;
+  }
+  template <class M>
+  iterator insert_or_assign(const_iterator hint, key_type&& k, M&& obj) {
+    return assign_unique(
+        this->get_insert_hint_unique_pos(base::node_of(hint), k),
+        std::move(k), std::forward<M>(obj)).first;
+  }
+
+  rb_map split(const key_type& k) { return rb_map(base::split(k)); }
+
+  mapped_type& operator[](const key_type& k) {
+    return try_emplace(k).first->second;
+  }
+  mapped_type& operator[](key_type&& k) {
+    return try_emplace(std::move(k)).first->second;
+  }
+
+  mapped_type& at(const key_type& k) {
+    iterator it = this->find(k);
+    if (it == this->end())
+      throw std::out_of_range("rb_map::at");
+    return it->second;
+  }
+  const mapped_type& at(const key_type& k) const {
+    const_iterator it = this->find(k);
+    if (it == this->end())
+      throw std::out_of_range("rb_map::at");
+    return it->second;
+  }
+
+ protected:
+  typedef typename base::insert_pos insert_pos;
+
+  explicit rb_map(base&& other) : base(std::move(other)) { }
+
+  template <class K, class... Args>
+  std::pair<iterator, bool> try_emplace_unique(insert_pos pos, K&& k,
+                                               Args&&... args) {
+    if (base::is_duplicate(pos))
+      return std::pair<iterator, bool>(base::iterator_of(pos.node), false);
+
+    return std::pair<iterator, bool>(
+        base::iterator_of(this->emplace_at(pos, std::piecewise_construct,
+            std::forward_as_tuple(std::forward<K>(k)),
+            std::forward_as_tuple(std::forward<Args>(args)...))), true);
+  }
+
+  template <class K, class M>
+  std::pair<iterator, bool> assign_unique(insert_pos pos, K&& k, M&& obj) {
+    if (base::is_duplicate(pos)) {
+      base::value_of(pos.node).second = std::forward<M>(obj);
+      return std::pair<iterator, bool>(base::iterator_of(pos.node), false);
+    }
+
+    return std::pair<iterator, bool>(
+        base::iterator_of(this->emplace_at(pos, std::forward<K>(k),
+                                           std::forward<M>(obj))), true);
+  }
+}; // rb_map
+
+/*
+ * A map with equivalent keys, on the same tree as rb_multiset
+ */
+template <class Key, class T, class Compare = std::less<Key>,
+          class Alloc = std::allocator<std::pair<const Key, T> >,
+          class Policy = default_policy>
+class rb_multimap
+  : public rb_multiset<std::pair<const Key, T>, Compare, Alloc,
+                       map_policy<Policy> > {
+  typedef rb_multiset<std::pair<const Key, T>, Compare, Alloc,
+                      map_policy<Policy> > base;
+
+ public:
+  typedef Key key_type;
+  typedef T mapped_type;
+  typedef typename base::value_type value_type;
+  typedef typename base::key_compare key_compare;
+  typedef typename base::allocator_type allocator_type;
+
+  rb_multimap() : base() { }
+
+  explicit rb_multimap(const key_compare& comp,
+                       const allocator_type& alloc = allocator_type())
+    : base(comp, alloc) { }
+
+  explicit rb_multimap(const allocator_type& alloc) : base(alloc) { }
+
+  template <class InputIterator>
+  rb_multimap(InputIterator first, InputIterator last,
+              const key_compare& comp = key_compare(),
+              const allocator_type& alloc = allocator_type())
+    : base(first, last, comp, alloc) { }
+
+  template <class InputIterator>
+  rb_multimap(InputIterator first, InputIterator last,
+              const allocator_type& alloc)
+    : base(first, last, alloc) { }
+
+  rb_multimap(const rb_multimap& other, const allocator_type& alloc)
+    : base(other, alloc) { }
+
+  rb_multimap(rb_multimap&& other, const allocator_type& alloc)
+    : base(std::move(other), alloc) { }
+
+  rb_multimap(const rb_multimap&) = default;
+  rb_multimap(rb_multimap&&) = default;
+  rb_multimap& operator=(const rb_multimap&) = default;
+  rb_multimap& operator=(rb_multimap&&) = default;
+
+  rb_multimap split(const key_type& k) {
+    return rb_multimap(base::split(k));
+  }
+
+ protected:
+  explicit rb_multimap(base&& other) : base(std::move(other)) { }
+}; // rb_multimap
+
+} // namespace rb_tree
+
+#endif // RB_MAP_H
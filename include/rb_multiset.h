@@ -0,0 +1,158 @@
+#ifndef RB_MULTISET_H
+#define RB_MULTISET_H
+
+#include "rb_tree.h"
+
+namespace rb_tree {
+
+/*
+ * A tree with equivalent elements, e.g. duplicate timestamps.
+ * It is an rb_tree with the same nodes, rebalancing and lookups; only the
+ * inserts, the erase by value, count() and equal_range() take the equal
+ * paths. Equivalent elements stay in the order they were inserted.
+ * find() and lower_bound() give the first of the equivalent elements, and
+ * split() moves all of them into the returned tree.
+ */
+template <class T, class Compare = std::less<T>,
+          class Alloc = std::allocator<T>, class Policy = default_policy>
+class rb_multiset : public rb_tree<T, Compare, Alloc, Policy> {
+  typedef rb_tree<T, Compare, Alloc, Policy> base;
+
+  static_assert(!Policy::tombstones,
+                "a tombstone revives its key, so the elements must be unique");
+
+ public:
+  typedef typename base::key_type key_type;
+  typedef typename base::value_type value_type;
+  typedef typename base::key_compare key_compare;
+  typedef typename base::allocator_type allocator_type;
+  typedef typename base::size_type size_type;
+  typedef typename base::iterator iterator;
+  typedef typename base::const_iterator const_iterator;
+  typedef typename base::node_type node_type;
+
+  rb_multiset() : base() { }
+
+  explicit rb_multiset(const key_compare& comp,
+                       const allocator_type& alloc = allocator_type())
+    : base(comp, alloc) { }
+
+  explicit rb_multiset(const allocator_type& alloc) : base(alloc) { }
+
+  template <class InputIterator>
+  rb_multiset(InputIterator first, InputIterator last,
+              const key_compare& comp = key_compare(),
+              const allocator_type& alloc = allocator_type())
+    : base(comp, alloc) { insert(first, last); }
+
+  template <class InputIterator>
+  rb_multiset(InputIterator first, InputIterator last,
+              const allocator_type& alloc)
+    : base(key_compare(), alloc) { insert(first, last); }
+
+  rb_multiset(const rb_multiset& other, const allocator_type& alloc)
+    : base(other, alloc) { }
+
+  rb_multiset(rb_multiset&& other, const allocator_type& alloc)
+    : base(std::move(other), alloc) { }
+
+  rb_multiset(const rb_multiset&) = default;
+  rb_multiset(rb_multiset&&) = default;
+  rb_multiset& operator=(const rb_multiset&) = default;
+  rb_multiset& operator=(rb_multiset&&) = default;
+
+  iterator insert(const value_type& val) { return this->insert_equal(val); }
+  iterator insert(value_type&& val) {
+    return this->insert_equal(std::move(val));
+  }
+  iterator insert(const_iterator pos, const value_type& val) {
+    return this->insert_equal(base::node_of(pos), val);
+  }
+  iterator insert(const_iterator pos, value_type&& val) {
+    return this->insert_equal(base::node_of(pos), std::move(val));
+  }
+  template <class InputIterator>
+  void insert(InputIterator first, InputIterator last) {
+    this->insert_range_equal(first, last,
+        typename std::iterator_traits<InputIterator>::iterator_category());
+  }
+  void insert(std::initializer_list<value_type> il) {
+    insert(il.begin(), il.end());
+  }
+  iterator insert(node_type&& nh) {
+    return this->insert_node_equal(std::move(nh));
+  }
+  iterator insert(const_iterator pos, node_type&& nh) {
+    return this->insert_node_equal(base::node_of(pos), std::move(nh));
+  }
+
+  template <class... Args>
+  iterator emplace(Args&&... args) {
+    return this->emplace_equal(std::forward<Args>(args)...);
+  }
+  template <class... Args>
+  iterator emplace_hint(const_iterator pos, Args&&... args) {
+    return this->emplace_hint_equal(base::node_of(pos),
+                                    std::forward<Args>(args)...);
+  }
+
+  /* Move all the nodes of source, including the equivalent ones */
+  void merge(base& source) { this->merge_equal(source); }
+  void merge(base&& source) { this->merge_equal(source); }
+
+  rb_multiset split(const key_type& val) {
+    return rb_multiset(base::split(val));
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  rb_multiset split(const K& val) {
+    return rb_multiset(base::split(val));
+  }
+
+  using base::erase;
+  size_type erase(const key_type& val) { return this->erase_equal(val); }
+  template <class K, class C = key_compare, class = typename C::is_transparent,
+            class = typename std::enable_if<
+                !std::is_convertible<K, const_iterator>::value>::type>
+  size_type erase(const K& val) {
+    return this->erase_equal(val);
+  }
+
+  size_type count(const key_type& val) const { return this->count_equal(val); }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  size_type count(const K& val) const {
+    return this->count_equal(val);
+  }
+
+  std::pair<iterator, iterator> equal_range(const key_type& val) {
+    return this->equal_range_equal(val);
+  }
+  std::pair<const_iterator, const_iterator>
+  equal_range(const key_type& val) const {
+    return this->equal_range_equal(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  std::pair<iterator, iterator> equal_range(const K& val) {
+    return this->equal_range_equal(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  std::pair<const_iterator, const_iterator> equal_range(const K& val) const {
+    return this->equal_range_equal(val);
+  }
+
+ private:
+  explicit rb_multiset(base&& other) : base(std::move(other)) { }
+
+  /*
+   * The finger inserts, batches and set operations only know about unique
+   * elements
+   */
+  using base::finger_insert;
+  using base::apply_batch;
+  using base::set_union;
+  using base::set_intersection;
+  using base::set_difference;
+}; // rb_multiset
+
+} // namespace rb_tree
+
+#endif // RB_MULTISET_H
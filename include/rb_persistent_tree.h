@@ -0,0 +1,790 @@
+#ifndef RB_PERSISTENT_TREE_H
+#define RB_PERSISTENT_TREE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
+#include <utility>
+
+namespace rb_tree {
+
+/*
+ * A red-black tree with O(1) snapshots, e.g.
+ *   persistent_rb_tree<int> index;
+ *   ...
+ *   persistent_rb_tree<int> snap = index.snapshot();
+ *   index.insert(42);                      // snap does not change
+ * The nodes are reference counted and shared between a tree and its
+ * snapshots. A write copies the nodes on its path that are shared, and the
+ * few siblings that the rebalancing recolors or rotates, so each write costs
+ * O(log n) nodes while a snapshot is alive, and none when the nodes are not
+ * shared. The nodes have no parent links, which a shared node could not
+ * have, and the iterators keep the path from the root instead.
+ *
+ * A snapshot can be read and destroyed in a thread of its own while the
+ * tree it was taken from is written in another one, since the writes never
+ * change a shared node. A single tree object still needs to be locked like
+ * any container if it is shared between threads.
+ * The elements are constant and must be copy constructible.
+ */
+template <class T,
+          class Compare = std::less<T>,
+          class Alloc = std::allocator<T> >
+class persistent_rb_tree {
+ public:
+  typedef T value_type;
+  typedef T key_type;
+  typedef Compare key_compare;
+  typedef Compare value_compare;
+  typedef Alloc allocator_type;
+  typedef const value_type& reference;
+  typedef const value_type& const_reference;
+  typedef typename std::allocator_traits<Alloc>::difference_type
+    difference_type;
+  typedef typename std::allocator_traits<Alloc>::size_type size_type;
+  typedef typename std::allocator_traits<Alloc>::pointer pointer;
+  typedef typename std::allocator_traits<Alloc>::const_pointer const_pointer;
+
+ protected:
+  struct rb_tree_node;
+  typedef rb_tree_node* node_ptr;
+
+  static constexpr node_ptr nil_ = 0;
+
+  /* The height of a red-black tree is at most 2 log2(n + 1) */
+  static constexpr int max_height = 2 * std::numeric_limits<size_type>::digits;
+
+ public:
+  /*
+   * An iterator holds the path from the root to its element, so it is larger
+   * than a pointer. It stays valid as long as the tree or snapshot it came
+   * from lives and is not modified.
+   */
+  class const_iterator {
+   public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef typename persistent_rb_tree::value_type value_type;
+    typedef typename persistent_rb_tree::difference_type difference_type;
+    typedef const value_type* pointer;
+    typedef const value_type& reference;
+
+    const_iterator() : root_(nil_), depth_(0) { }
+
+    const value_type& operator*() const { return path_[depth_ - 1]->value; }
+    const value_type* operator->() const {
+      return &path_[depth_ - 1]->value;
+    }
+
+    const_iterator& operator++() {
+      node_ptr x = path_[depth_ - 1];
+      if (x->right != nil_) {
+        push_min(x->right);
+      } else {
+        do {
+          x = path_[--depth_];
+        } while (depth_ > 0 && path_[depth_ - 1]->right == x);
+      }
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator tmp(*this);
+      ++*this;
+      return tmp;
+    }
+
+    const_iterator& operator--() {
+      if (depth_ == 0) {
+        push_max(root_);
+        return *this;
+      }
+      node_ptr x = path_[depth_ - 1];
+      if (x->left != nil_) {
+        push_max(x->left);
+      } else {
+        do {
+          x = path_[--depth_];
+        } while (depth_ > 0 && path_[depth_ - 1]->left == x);
+      }
+      return *this;
+    }
+    const_iterator operator--(int) {
+      const_iterator tmp(*this);
+      --*this;
+      return tmp;
+    }
+
+    bool operator==(const const_iterator& other) const {
+      return node() == other.node();
+    }
+    bool operator!=(const const_iterator& other) const {
+      return node() != other.node();
+    }
+
+   private:
+    node_ptr root_;
+    node_ptr path_[max_height];
+    int depth_;
+
+    explicit const_iterator(node_ptr root) : root_(root), depth_(0) { }
+
+    node_ptr node() const { return depth_ == 0 ? nil_ : path_[depth_ - 1]; }
+
+    void push(node_ptr x) { path_[depth_++] = x; }
+    void push_min(node_ptr x) {
+      for (; x != nil_; x = x->left)
+        push(x);
+    }
+    void push_max(node_ptr x) {
+      for (; x != nil_; x = x->right)
+        push(x);
+    }
+
+    friend class persistent_rb_tree;
+  }; // const_iterator
+
+  typedef const_iterator iterator;
+  typedef std::reverse_iterator<const_iterator> reverse_iterator;
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+  persistent_rb_tree() : comp_(), root_(nil_), size_(0) { }
+
+  explicit persistent_rb_tree(const key_compare& comp,
+                              const allocator_type& alloc = allocator_type())
+    : alloc_(alloc), node_alloc_(alloc), comp_(comp), root_(nil_), size_(0) { }
+
+  template <class InputIterator>
+  persistent_rb_tree(InputIterator first, InputIterator last,
+                     const key_compare& comp = key_compare(),
+                     const allocator_type& alloc = allocator_type())
+    : persistent_rb_tree(comp, alloc) {
+    insert(first, last);
+  }
+
+  persistent_rb_tree(std::initializer_list<value_type> il,
+                     const key_compare& comp = key_compare(),
+                     const allocator_type& alloc = allocator_type())
+    : persistent_rb_tree(il.begin(), il.end(), comp, alloc) { }
+
+  /* Copies share all the nodes, in O(1) */
+  persistent_rb_tree(const persistent_rb_tree& other)
+    : alloc_(other.alloc_), node_alloc_(other.node_alloc_),
+      comp_(other.comp_), root_(acquire(other.root_)), size_(other.size_) { }
+
+  persistent_rb_tree(persistent_rb_tree&& other) noexcept
+    : alloc_(std::move(other.alloc_)), node_alloc_(std::move(other.node_alloc_)),
+      comp_(std::move(other.comp_)), root_(other.root_), size_(other.size_) {
+    other.root_ = nil_;
+    other.size_ = 0;
+  }
+
+  ~persistent_rb_tree() { release(root_); }
+
+  persistent_rb_tree& operator=(const persistent_rb_tree& other) {
+    /* The old nodes are released with the allocator that owns them */
+    persistent_rb_tree tmp(other);
+    swap(tmp);
+    return *this;
+  }
+
+  persistent_rb_tree& operator=(persistent_rb_tree&& other) noexcept {
+    swap(other);
+    return *this;
+  }
+
+  /* A copy of the current version, sharing all the nodes */
+  persistent_rb_tree snapshot() const { return *this; }
+
+  const_iterator begin() const {
+    const_iterator it(root_);
+    it.push_min(root_);
+    return it;
+  }
+  const_iterator end() const { return const_iterator(root_); }
+  const_iterator cbegin() const { return begin(); }
+  const_iterator cend() const { return end(); }
+  const_reverse_iterator rbegin() const {
+    return const_reverse_iterator(end());
+  }
+  const_reverse_iterator rend() const {
+    return const_reverse_iterator(begin());
+  }
+  const_reverse_iterator crbegin() const { return rbegin(); }
+  const_reverse_iterator crend() const { return rend(); }
+
+  /* Insert the element if it is not in the tree yet. */
+  bool insert(const value_type& val) { return insert_unique(val); }
+  bool insert(value_type&& val) { return insert_unique(std::move(val)); }
+  template <class InputIterator>
+  void insert(InputIterator first, InputIterator last) {
+    for (; first != last; ++first)
+      insert_unique(*first);
+  }
+  void insert(std::initializer_list<value_type> il) {
+    insert(il.begin(), il.end());
+  }
+  template <class... Args>
+  bool emplace(Args&&... args) {
+    return insert_unique(value_type(std::forward<Args>(args)...));
+  }
+
+  size_type erase(const key_type& val) { return erase_unique(val); }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  size_type erase(const K& val) {
+    return erase_unique(val);
+  }
+
+  const_iterator find(const key_type& val) const { return find_unique(val); }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  const_iterator find(const K& val) const {
+    return find_unique(val);
+  }
+
+  const_iterator lower_bound(const key_type& val) const {
+    return lower_bound_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  const_iterator lower_bound(const K& val) const {
+    return lower_bound_unique(val);
+  }
+
+  const_iterator upper_bound(const key_type& val) const {
+    return upper_bound_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  const_iterator upper_bound(const K& val) const {
+    return upper_bound_unique(val);
+  }
+
+  size_type count(const key_type& val) const {
+    return find_node(val) != nil_ ? 1 : 0;
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  size_type count(const K& val) const {
+    return find_node(val) != nil_ ? 1 : 0;
+  }
+
+  bool contains(const key_type& val) const { return find_node(val) != nil_; }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  bool contains(const K& val) const {
+    return find_node(val) != nil_;
+  }
+
+  void swap(persistent_rb_tree& other) noexcept {
+    using std::swap;
+    swap(alloc_, other.alloc_);
+    swap(node_alloc_, other.node_alloc_);
+    swap(comp_, other.comp_);
+    swap(root_, other.root_);
+    swap(size_, other.size_);
+  }
+
+  allocator_type get_allocator() const { return alloc_; }
+  key_compare key_comp() const { return comp_; }
+  value_compare value_comp() const { return comp_; }
+
+  size_type size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  void clear() noexcept {
+    release(root_);
+    root_ = nil_;
+    size_ = 0;
+  }
+
+ protected:
+  struct rb_tree_node {
+    node_ptr left;
+    node_ptr right;
+    std::atomic<size_type> refs;
+    bool red;
+    value_type value;
+  };
+
+  typedef std::allocator_traits<allocator_type> alloc_traits;
+  typedef typename alloc_traits::template rebind_traits<rb_tree_node>
+    node_alloc_traits;
+  typedef typename node_alloc_traits::allocator_type node_allocator_type;
+  allocator_type alloc_;
+  node_allocator_type node_alloc_;
+
+  key_compare comp_;
+
+  node_ptr root_;
+  size_type size_;
+
+  /* A node with a single reference, from the caller, and no children */
+  template <class... Args>
+  node_ptr create_node(Args&&... args) {
+    node_ptr z = node_alloc_traits::allocate(node_alloc_, 1);
+    try {
+      alloc_traits::construct(alloc_, &z->value, std::forward<Args>(args)...);
+    } catch (...) {
+      node_alloc_traits::deallocate(node_alloc_, z, 1);
+      throw;
+    }
+    ::new (static_cast<void *>(&z->refs)) std::atomic<size_type>(1);
+    z->left = nil_;
+    z->right = nil_;
+    z->red = true;
+    return z;
+  }
+
+  void destroy_node(node_ptr x) {
+    alloc_traits::destroy(alloc_, &x->value);
+    node_alloc_traits::deallocate(node_alloc_, x, 1);
+  }
+
+  static node_ptr acquire(node_ptr x) {
+    if (x != nil_)
+      x->refs.fetch_add(1, std::memory_order_relaxed);
+    return x;
+  }
+
+  /* Drop a reference to x, and destroy the nodes that are not shared */
+  void release(node_ptr x) {
+    while (x != nil_ &&
+           x->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      release(x->left);
+      node_ptr r = x->right;
+      destroy_node(x);
+      x = r;
+    }
+  }
+
+  /*
+   * Make the node that slot points to unshared, copying it if a snapshot
+   * holds it too. The slot is the root or a child link of an unshared node.
+   */
+  node_ptr unshare(node_ptr& slot) {
+    node_ptr x = slot;
+    if (x->refs.load(std::memory_order_acquire) == 1)
+      return x;
+
+    node_ptr z = create_node(x->value);
+    z->left = acquire(x->left);
+    z->right = acquire(x->right);
+    z->red = x->red;
+    slot = z;
+    release(x);
+    return z;
+  }
+
+  static node_ptr& child(node_ptr x, bool right) {
+    return right ? x->right : x->left;
+  }
+
+  static bool is_red(node_ptr x) { return x != nil_ && x->red; }
+
+  /*
+   * Rotate x down in the direction, e.g. to the left if right is false, and
+   * return the child that takes its place
+   */
+  static node_ptr rotate(node_ptr x, bool right) {
+    node_ptr y = child(x, !right);
+    child(x, !right) = child(y, right);
+    child(y, right) = x;
+    return y;
+  }
+
+  /*
+   * A path from the root: nodes[i + 1] is the child of nodes[i] in the
+   * direction dirs[i], true for the right child
+   */
+  struct path {
+    node_ptr nodes[max_height + 1];
+    bool dirs[max_height + 1];
+    int depth;
+  };
+
+  node_ptr& slot_of(path& p, int i) {
+    return i == 0 ? root_ : child(p.nodes[i - 1], p.dirs[i - 1]);
+  }
+
+  /* Copy the shared nodes of the first depth nodes of the path */
+  void unshare_path(path& p) {
+    for (int i = 0; i < p.depth; ++i)
+      p.nodes[i] = unshare(slot_of(p, i));
+  }
+
+  template <class K>
+  node_ptr find_node(const K& val) const;
+  template <class K>
+  const_iterator find_unique(const K& val) const;
+  template <class K>
+  const_iterator lower_bound_unique(const K& val) const;
+  template <class K>
+  const_iterator upper_bound_unique(const K& val) const;
+
+  template <class V>
+  bool insert_unique(V&& val);
+  void unshare_insert_fixup(path& p);
+  void insert_fixup(path& p);
+
+  template <class K>
+  size_type erase_unique(const K& val);
+  void unshare_erase_fixup(path& p, int i);
+  void erase_fixup(path& p, int i);
+}; // persistent_rb_tree
+
+template <class T, class C, class A>
+template <class K>
+typename persistent_rb_tree<T, C, A>::node_ptr
+persistent_rb_tree<T, C, A>::find_node(const K& val) const {
+  node_ptr x = root_;
+  while (x != nil_) {
+    if (comp_(val, x->value))
+      x = x->left;
+    else if (comp_(x->value, val))
+      x = x->right;
+    else
+      return x;
+  }
+  return nil_;
+}
+
+template <class T, class C, class A>
+template <class K>
+typename persistent_rb_tree<T, C, A>::const_iterator
+persistent_rb_tree<T, C, A>::find_unique(const K& val) const {
+  const_iterator it(root_);
+  for (node_ptr x = root_; x != nil_; ) {
+    it.push(x);
+    if (comp_(val, x->value)) {
+      x = x->left;
+    } else if (comp_(x->value, val)) {
+      x = x->right;
+    } else {
+      return it;
+    }
+  }
+  return end();
+}
+
+/*
+ * The path to the bound ends at the last node where the descent went left,
+ * so the nodes after it are dropped
+ */
+template <class T, class C, class A>
+template <class K>
+typename persistent_rb_tree<T, C, A>::const_iterator
+persistent_rb_tree<T, C, A>::lower_bound_unique(const K& val) const {
+  const_iterator it(root_);
+  int bound = 0;
+  for (node_ptr x = root_; x != nil_; ) {
+    it.push(x);
+    if (!comp_(x->value, val)) {
+      bound = it.depth_;
+      x = x->left;
+    } else {
+      x = x->right;
+    }
+  }
+  it.depth_ = bound;
+  return it;
+}
+
+template <class T, class C, class A>
+template <class K>
+typename persistent_rb_tree<T, C, A>::const_iterator
+persistent_rb_tree<T, C, A>::upper_bound_unique(const K& val) const {
+  const_iterator it(root_);
+  int bound = 0;
+  for (node_ptr x = root_; x != nil_; ) {
+    it.push(x);
+    if (comp_(val, x->value)) {
+      bound = it.depth_;
+      x = x->left;
+    } else {
+      x = x->right;
+    }
+  }
+  it.depth_ = bound;
+  return it;
+}
+
+/*
+ * Find the path to the new element without copying anything, so that
+ * inserting an element that is already there leaves the snapshots alone.
+ * Then copy the path and rebalance it.
+ */
+template <class T, class C, class A>
+template <class V>
+bool persistent_rb_tree<T, C, A>::insert_unique(V&& val) {
+  path p;
+  p.depth = 0;
+  for (node_ptr x = root_; x != nil_; ) {
+    p.nodes[p.depth] = x;
+    if (comp_(val, x->value)) {
+      p.dirs[p.depth] = false;
+    } else if (comp_(x->value, val)) {
+      p.dirs[p.depth] = true;
+    } else {
+      return false;
+    }
+    x = child(x, p.dirs[p.depth++]);
+  }
+
+  node_ptr z = create_node(std::forward<V>(val));
+  p.nodes[p.depth] = z;
+  try {
+    unshare_path(p);
+    unshare_insert_fixup(p);
+  } catch (...) {
+    destroy_node(z);
+    throw;
+  }
+  slot_of(p, p.depth++) = z;
+  ++size_;
+  insert_fixup(p);
+  return true;
+}
+
+/*
+ * Copy the uncles that insert_fixup() will recolor, before the new node is
+ * linked, so that the rebalancing itself cannot throw. The loop takes the
+ * same steps as the one of insert_fixup(), which only recolors nodes that it
+ * does not look at again.
+ */
+template <class T, class C, class A>
+void persistent_rb_tree<T, C, A>::unshare_insert_fixup(path& p) {
+  int i = p.depth;
+  while (i >= 2 && p.nodes[i - 1]->red) {
+    node_ptr& uncle = child(p.nodes[i - 2], !p.dirs[i - 2]);
+    if (!is_red(uncle))
+      break;
+    unshare(uncle);
+    i -= 2;
+  }
+}
+
+/*
+ * The usual insert fixup, climbing the path instead of the parent links.
+ * Only the uncles that get recolored have to be copied.
+ */
+template <class T, class C, class A>
+void persistent_rb_tree<T, C, A>::insert_fixup(path& p) {
+  int i = p.depth - 1;
+  while (i >= 2 && p.nodes[i - 1]->red) {
+    node_ptr g = p.nodes[i - 2];
+    bool pdir = p.dirs[i - 2];
+    node_ptr& uncle = child(g, !pdir);
+
+    if (is_red(uncle)) {
+      node_ptr u = unshare(uncle);
+      u->red = false;
+      p.nodes[i - 1]->red = false;
+      g->red = true;
+      i -= 2;
+      continue;
+    }
+
+    node_ptr parent = p.nodes[i - 1];
+    if (p.dirs[i - 1] != pdir)
+      parent = child(g, pdir) = rotate(parent, pdir);
+    node_ptr& top = slot_of(p, i - 2);
+    top = rotate(g, !pdir);
+    parent->red = false;
+    g->red = true;
+    break;
+  }
+  root_->red = false;
+}
+
+/*
+ * Find the path to the element without copying anything, then copy it and
+ * the path to the successor, along with the nodes that the rebalancing
+ * will change. A node with two children swaps its place with the successor,
+ * which keeps the values where they are.
+ */
+template <class T, class C, class A>
+template <class K>
+typename persistent_rb_tree<T, C, A>::size_type
+persistent_rb_tree<T, C, A>::erase_unique(const K& val) {
+  path p;
+  p.depth = 0;
+  for (node_ptr x = root_; ; ) {
+    if (x == nil_)
+      return 0;
+    p.nodes[p.depth] = x;
+    if (comp_(val, x->value)) {
+      p.dirs[p.depth] = false;
+    } else if (comp_(x->value, val)) {
+      p.dirs[p.depth] = true;
+    } else {
+      break;
+    }
+    x = child(x, p.dirs[p.depth++]);
+  }
+
+  int k = p.depth++;
+  unshare_path(p);
+  node_ptr z = p.nodes[k];
+  if (z->left != nil_ && z->right != nil_) {
+    p.dirs[k] = true;
+    for (;;) {
+      node_ptr x = unshare(slot_of(p, p.depth));
+      p.nodes[p.depth] = x;
+      if (x->left == nil_)
+        break;
+      p.dirs[p.depth++] = false;
+    }
+    ++p.depth;
+  }
+
+  /* The node that comes out of the tree, z or its successor */
+  int m = p.depth - 1;
+  node_ptr y = p.nodes[m];
+  bool black = !y->red;
+  if (black) {
+    if (is_red(y->left))
+      unshare(y->left);
+    else if (is_red(y->right))
+      unshare(y->right);
+    else
+      unshare_erase_fixup(p, m);
+  }
+
+  if (m != k) {
+    node_ptr s = y;
+    slot_of(p, k) = s;
+    if (m == k + 1) {
+      s->left = z->left;
+      z->left = nil_;
+      z->right = s->right;
+      s->right = z;
+    } else {
+      slot_of(p, m) = z;
+      std::swap(z->left, s->left);
+      std::swap(z->right, s->right);
+    }
+    std::swap(z->red, s->red);
+    p.nodes[k] = s;
+    p.nodes[m] = z;
+  }
+
+  node_ptr c = z->left != nil_ ? z->left : z->right;
+  slot_of(p, m) = c;
+  z->left = nil_;
+  z->right = nil_;
+  release(z);
+  --size_;
+
+  if (black) {
+    if (is_red(c))
+      c->red = false;
+    else
+      erase_fixup(p, m);
+  }
+  return 1;
+}
+
+/*
+ * Copy the nodes that erase_fixup() will recolor or rotate, before anything
+ * changes, so that the rebalancing itself cannot throw: the siblings on the
+ * way up, and below the sibling where the loop stops, its children, or the
+ * children of its near child if it is red and gets rotated up first.
+ * Swapping the erased node with its successor keeps the siblings and the
+ * colors on the path, so this can run before the swap.
+ */
+template <class T, class C, class A>
+void persistent_rb_tree<T, C, A>::unshare_erase_fixup(path& p, int i) {
+  for (; i > 0; --i) {
+    node_ptr parent = p.nodes[i - 1];
+    bool dir = p.dirs[i - 1];
+    node_ptr w = unshare(child(parent, !dir));
+
+    if (w->red) {
+      w = unshare(child(w, dir));
+    } else if (!is_red(w->left) && !is_red(w->right)) {
+      if (parent->red)
+        return;
+      continue;
+    }
+    if (w->left != nil_)
+      unshare(w->left);
+    if (w->right != nil_)
+      unshare(w->right);
+    return;
+  }
+}
+
+/*
+ * The usual erase fixup for the missing black at depth i of the path,
+ * climbing the path instead of the parent links. The siblings and the
+ * children of the siblings get copied before they are recolored or rotated.
+ */
+template <class T, class C, class A>
+void persistent_rb_tree<T, C, A>::erase_fixup(path& p, int i) {
+  while (i > 0) {
+    node_ptr parent = p.nodes[i - 1];
+    bool dir = p.dirs[i - 1];
+    node_ptr& sibling = child(parent, !dir);
+    node_ptr w = unshare(sibling);
+
+    if (w->red) {
+      w->red = false;
+      parent->red = true;
+      slot_of(p, i - 1) = rotate(parent, dir);
+      p.nodes[i - 1] = w;
+      p.dirs[i - 1] = dir;
+      p.nodes[i] = parent;
+      p.dirs[i] = dir;
+      ++i;
+      continue;
+    }
+
+    if (!is_red(w->left) && !is_red(w->right)) {
+      w->red = true;
+      if (parent->red) {
+        parent->red = false;
+        return;
+      }
+      --i;
+      continue;
+    }
+
+    if (!is_red(child(w, !dir))) {
+      node_ptr near = unshare(child(w, dir));
+      near->red = false;
+      w->red = true;
+      w = sibling = rotate(w, !dir);
+    }
+    node_ptr far = unshare(child(w, !dir));
+    far->red = false;
+    w->red = parent->red;
+    parent->red = false;
+    slot_of(p, i - 1) = rotate(parent, dir);
+    return;
+  }
+
+  if (root_ != nil_)
+    root_->red = false;
+}
+
+template <class T, class C, class A>
+bool operator==(const persistent_rb_tree<T, C, A>& lhs,
+                const persistent_rb_tree<T, C, A>& rhs) {
+  return lhs.size() == rhs.size() &&
+         std::equal(lhs.begin(), lhs.end(), rhs.begin());
+}
+
+template <class T, class C, class A>
+bool operator!=(const persistent_rb_tree<T, C, A>& lhs,
+                const persistent_rb_tree<T, C, A>& rhs) {
+  return !(lhs == rhs);
+}
+
+template <class T, class C, class A>
+void swap(persistent_rb_tree<T, C, A>& lhs,
+          persistent_rb_tree<T, C, A>& rhs) noexcept {
+  lhs.swap(rhs);
+}
+
+} // namespace rb_tree
+
+#endif // RB_PERSISTENT_TREE_H
@@ -0,0 +1,255 @@
+#ifndef RB_POOL_ALLOCATOR_H
+#define RB_POOL_ALLOCATOR_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+namespace rb_tree {
+
+/*
+ * An arena handing out fixed size blocks from large chunks.
+ * Every block size has its own pool with an intrusive free list of the
+ * recycled blocks, and the chunks are only returned to the system all at
+ * once, in O(chunks), by release() or the destructor.
+ * The arena is not thread safe.
+ */
+class pool_arena {
+ public:
+  explicit pool_arena(std::size_t chunk_bytes)
+    : chunk_bytes_(chunk_bytes), chunks_(nullptr), pools_(nullptr),
+      allocated_(0) { }
+
+  pool_arena(const pool_arena&) = delete;
+  pool_arena& operator=(const pool_arena&) = delete;
+
+  ~pool_arena() {
+    release();
+    while (pools_ != nullptr) {
+      pool *next = pools_->next;
+      delete pools_;
+      pools_ = next;
+    }
+  }
+
+  void *allocate(std::size_t block_size) {
+    pool *p = find_pool(block_size);
+
+    if (p->free != nullptr) {
+      block *b = p->free;
+      p->free = b->next;
+      ++allocated_;
+      return b;
+    }
+
+    if (p->cur == p->end)
+      grow(p, chunk_bytes_ / block_size);
+
+    void *b = p->cur;
+    p->cur += block_size;
+    ++allocated_;
+    return b;
+  }
+
+  void deallocate(void *ptr, std::size_t block_size) noexcept {
+    pool *p = find_pool(block_size);
+    block *b = static_cast<block *>(ptr);
+    b->next = p->free;
+    p->free = b;
+    --allocated_;
+  }
+
+  /*
+   * Make room for n more blocks of the size, in a single chunk when they do
+   * not fit in the current one. What is left of the current chunk goes to the
+   * free list.
+   */
+  void reserve(std::size_t block_size, std::size_t n) {
+    pool *p = find_pool(block_size);
+    std::size_t room = (p->end - p->cur) / block_size;
+    if (room >= n)
+      return;
+
+    while (p->cur != p->end) {
+      block *b = reinterpret_cast<block *>(p->cur);
+      b->next = p->free;
+      p->free = b;
+      p->cur += block_size;
+    }
+    n -= room;
+    grow(p, n > chunk_bytes_ / block_size ? n : chunk_bytes_ / block_size);
+  }
+
+  /* The number of blocks in use */
+  std::size_t allocated() const noexcept { return allocated_; }
+
+  /* Free every chunk at once, invalidating all the blocks */
+  void release() noexcept {
+    while (chunks_ != nullptr) {
+      chunk *next = chunks_->next;
+      ::operator delete(chunks_);
+      chunks_ = next;
+    }
+
+    for (pool *p = pools_; p != nullptr; p = p->next) {
+      p->free = nullptr;
+      p->cur = nullptr;
+      p->end = nullptr;
+    }
+    allocated_ = 0;
+  }
+
+ private:
+  struct block {
+    block *next;
+  };
+
+  struct chunk {
+    chunk *next;
+  };
+
+  struct pool {
+    std::size_t block_size;
+    block *free;
+    char *cur;
+    char *end;
+    pool *next;
+  };
+
+  /* The blocks of a chunk start after its header, at the maximal alignment */
+  static constexpr std::size_t header_size =
+    (sizeof(chunk) + alignof(std::max_align_t) - 1) &
+    ~(alignof(std::max_align_t) - 1);
+
+  std::size_t chunk_bytes_;
+  chunk *chunks_;
+  pool *pools_;
+  std::size_t allocated_;
+
+  /* There are only a few block sizes, usually a single one */
+  pool *find_pool(std::size_t block_size) {
+    for (pool *p = pools_; p != nullptr; p = p->next) {
+      if (p->block_size == block_size)
+        return p;
+    }
+
+    pool *p = new pool;
+    p->block_size = block_size;
+    p->free = nullptr;
+    p->cur = nullptr;
+    p->end = nullptr;
+    p->next = pools_;
+    pools_ = p;
+    return p;
+  }
+
+  /* Start a new chunk of n blocks */
+  void grow(pool *p, std::size_t n) {
+    if (n == 0)
+      n = 1;
+
+    char *mem = static_cast<char *>(
+        ::operator new(header_size + n * p->block_size));
+    chunk *c = reinterpret_cast<chunk *>(mem);
+    c->next = chunks_;
+    chunks_ = c;
+
+    p->cur = mem + header_size;
+    p->end = p->cur + n * p->block_size;
+  }
+}; // pool_arena
+
+/*
+ * An allocator for the nodes of rb_tree, e.g.
+ *   rb_tree<int, std::less<int>, pool_allocator<int> >
+ * Single objects come from a pool_arena shared by all the copies of the
+ * allocator, including the rebound ones, while arrays go to the global
+ * operator new.
+ * The tree frees all its nodes with a single release() when it is cleared or
+ * destroyed, as long as its nodes are the only blocks in use in the arena.
+ * A copied tree gets an arena of its own, with room for all its nodes made
+ * up front.
+ */
+template <class T, std::size_t ChunkBytes = 64 * 1024>
+class pool_allocator {
+ public:
+  typedef T value_type;
+  typedef T *pointer;
+  typedef const T *const_pointer;
+  typedef T& reference;
+  typedef const T& const_reference;
+  typedef std::size_t size_type;
+  typedef std::ptrdiff_t difference_type;
+
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  template <class U>
+  struct rebind {
+    typedef pool_allocator<U, ChunkBytes> other;
+  };
+
+  static_assert(alignof(T) <= alignof(std::max_align_t),
+                "over-aligned types are not supported");
+
+  pool_allocator() : arena_(std::make_shared<pool_arena>(ChunkBytes)) { }
+
+  template <class U>
+  pool_allocator(const pool_allocator<U, ChunkBytes>& other) noexcept
+    : arena_(other.arena_) { }
+
+  T *allocate(size_type n) {
+    if (n == 1)
+      return static_cast<T *>(arena_->allocate(block_size()));
+    return static_cast<T *>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, size_type n) noexcept {
+    if (n == 1)
+      arena_->deallocate(p, block_size());
+    else
+      ::operator delete(p);
+  }
+
+  /* The number of blocks in use in the arena */
+  size_type allocated() const noexcept { return arena_->allocated(); }
+
+  /* Make room for n more single objects in the arena */
+  void reserve(size_type n) { arena_->reserve(block_size(), n); }
+
+  /* Free all the blocks of the arena at once */
+  void release() noexcept { arena_->release(); }
+
+  pool_allocator select_on_container_copy_construction() const {
+    return pool_allocator();
+  }
+
+  template <class U>
+  bool operator==(const pool_allocator<U, ChunkBytes>& other) const noexcept {
+    return arena_ == other.arena_;
+  }
+
+  template <class U>
+  bool operator!=(const pool_allocator<U, ChunkBytes>& other) const noexcept {
+    return arena_ != other.arena_;
+  }
+
+ private:
+  std::shared_ptr<pool_arena> arena_;
+
+  /* A block holds either a T or a free list link, aligned for both */
+  static constexpr size_type block_align() {
+    return alignof(T) > alignof(void *) ? alignof(T) : alignof(void *);
+  }
+  static constexpr size_type block_size() {
+    return ((sizeof(T) > sizeof(void *) ? sizeof(T) : sizeof(void *)) +
+            block_align() - 1) / block_align() * block_align();
+  }
+
+  template <class U, std::size_t N> friend class pool_allocator;
+}; // pool_allocator
+
+} // namespace rb_tree
+
+#endif // RB_POOL_ALLOCATOR_H
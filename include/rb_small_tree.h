@@ -0,0 +1,705 @@
+#ifndef RB_SMALL_TREE_H
+#define RB_SMALL_TREE_H
+
+#include <cstddef>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include "rb_tree.h"
+
+namespace rb_tree {
+
+/*
+ * An rb_tree for the sets that nearly always stay tiny, e.g. one per tenant.
+ * Up to N elements are kept in order in an array inside the object, without
+ * any allocation, and looked up with a linear scan, which is branchless for
+ * the keys of rb_tree_branchless_search and then compiles to vector
+ * compares. The insert of one more element moves them all into an rb_tree
+ * built in the same storage, which holds the elements from then on, until
+ * clear(). The object is about as large as the larger of the two.
+ *
+ * It has the constructors, inserts, erases, lookups and iterators of
+ * rb_tree, with the same semantics and the same iterator type in both
+ * modes. In the array, an insert or an erase invalidates the iterators from
+ * its position on, and the move into the tree all of them. The other
+ * extensions of rb_tree are not there.
+ *
+ * The elements move within the array, so their moves must not throw. A
+ * failed insert, even one that moved them into the tree, leaves the elements
+ * as they were.
+ */
+template <class T, std::size_t N = 8,
+          class Compare = std::less<T>,
+          class Alloc = std::allocator<T>,
+          class Policy = default_policy>
+class small_rb_tree {
+ public:
+  typedef rb_tree<T, Compare, Alloc, Policy> tree_type;
+  typedef typename tree_type::key_type key_type;
+  typedef T value_type;
+  typedef Compare key_compare;
+  typedef typename tree_type::value_compare value_compare;
+  typedef Alloc allocator_type;
+
+  typedef value_type& reference;
+  typedef const value_type& const_reference;
+  typedef typename tree_type::difference_type difference_type;
+  typedef typename tree_type::size_type size_type;
+  typedef typename tree_type::pointer pointer;
+  typedef typename tree_type::const_pointer const_pointer;
+
+  static_assert(N > 0, "the array of a small_rb_tree holds at least one "
+                       "element");
+  static_assert(std::is_nothrow_move_constructible<value_type>::value,
+                "the elements of a small_rb_tree move within its array");
+
+ protected:
+  template <class Pointer, class Reference> class iterator_base;
+  typedef iterator_base<value_type *, value_type &> iterator_type;
+  typedef iterator_base<const value_type *, const value_type &>
+    const_iterator_type;
+
+ public:
+  /* The elements of a set are constant, only the keys of a map are */
+  typedef typename std::conditional<
+      std::is_same<key_type, value_type>::value,
+      const_iterator_type, iterator_type>::type iterator;
+  typedef const_iterator_type const_iterator;
+  typedef std::reverse_iterator<iterator> reverse_iterator;
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+  /*
+   * constructors
+   */
+
+  // empty
+  small_rb_tree()
+    : small_rb_tree(key_compare(), allocator_type()) { }
+
+  explicit small_rb_tree(const key_compare& comp,
+                         const allocator_type& alloc = allocator_type())
+    : size_(0), comp_(comp), alloc_(alloc) { }
+
+  explicit small_rb_tree(const allocator_type& alloc)
+    : small_rb_tree(key_compare(), alloc) { }
+
+  // range
+  template <class InputIterator>
+  small_rb_tree(InputIterator first, InputIterator last,
+                const key_compare& comp = key_compare(),
+                const allocator_type& alloc = allocator_type())
+    : small_rb_tree(comp, alloc) { insert(first, last); }
+
+  template <class InputIterator>
+  small_rb_tree(InputIterator first, InputIterator last,
+                const allocator_type& alloc)
+    : small_rb_tree(key_compare(), alloc) { insert(first, last); }
+
+  small_rb_tree(std::initializer_list<value_type> il,
+                const key_compare& comp = key_compare(),
+                const allocator_type& alloc = allocator_type())
+    : small_rb_tree(comp, alloc) { insert(il); }
+
+  // copy
+  small_rb_tree(const small_rb_tree& other)
+    : size_(0), comp_(other.comp_),
+      alloc_(alloc_traits::select_on_container_copy_construction(
+          other.alloc_)) { copy_from(other); }
+
+  // move
+  small_rb_tree(small_rb_tree&& other) noexcept
+    : size_(0), comp_(other.comp_), alloc_(other.alloc_) {
+    move_from(other);
+  }
+
+  /* destructor */
+  ~small_rb_tree() { reset(); }
+
+  /* assignments */
+  small_rb_tree& operator=(const small_rb_tree& other) {
+    if (this != &other) {
+      small_rb_tree tmp(other);
+      *this = std::move(tmp);
+    }
+    return *this;
+  }
+
+  small_rb_tree& operator=(small_rb_tree&& other) noexcept {
+    if (this != &other) {
+      reset();
+      comp_ = other.comp_;
+      alloc_ = other.alloc_;
+      move_from(other);
+    }
+    return *this;
+  }
+
+  // end of constructors/destructor/assignments
+
+
+  std::pair<iterator, bool> insert(const value_type& val) {
+    return insert_unique(val);
+  }
+  std::pair<iterator, bool> insert(value_type&& val) {
+    return insert_unique(std::move(val));
+  }
+  iterator insert(const_iterator pos, const value_type& val) {
+    return insert_hint_unique(pos, val);
+  }
+  iterator insert(const_iterator pos, value_type&& val) {
+    return insert_hint_unique(pos, std::move(val));
+  }
+  template <class InputIterator>
+  void insert(InputIterator first, InputIterator last) {
+    for (; first != last; ++first)
+      insert_unique(*first);
+  }
+  void insert(std::initializer_list<value_type> il) {
+    insert(il.begin(), il.end());
+  }
+
+  /* In the array, the element is made before its place is looked up */
+  template <class... Args>
+  std::pair<iterator, bool> emplace(Args&&... args) {
+    if (!is_inline()) {
+      auto r = data_.tree.emplace(std::forward<Args>(args)...);
+      return std::pair<iterator, bool>(iterator_type(r.first), r.second);
+    }
+    return insert_unique(value_type(std::forward<Args>(args)...));
+  }
+  template <class... Args>
+  iterator emplace_hint(const_iterator pos, Args&&... args) {
+    if (!is_inline())
+      return iterator_type(data_.tree.emplace_hint(
+          pos.node_, std::forward<Args>(args)...));
+    return insert_unique(value_type(std::forward<Args>(args)...)).first;
+  }
+
+  iterator erase(const_iterator pos);
+  size_type erase(const key_type& val) { return erase_unique(val); }
+  template <class K, class C = key_compare, class = typename C::is_transparent,
+            class = typename std::enable_if<
+                !std::is_convertible<K, const_iterator>::value>::type>
+  size_type erase(const K& val) {
+    return erase_unique(val);
+  }
+  iterator erase(const_iterator first, const_iterator last);
+
+  iterator begin() { return begin_unique(); }
+  const_iterator begin() const { return begin_unique(); }
+  iterator end() { return end_unique(); }
+  const_iterator end() const { return end_unique(); }
+  const_iterator cbegin() const { return begin_unique(); }
+  const_iterator cend() const { return end_unique(); }
+
+  reverse_iterator rbegin() { return reverse_iterator(end()); }
+  const_reverse_iterator rbegin() const {return const_reverse_iterator(end());}
+  reverse_iterator rend() { return reverse_iterator(begin()); }
+  const_reverse_iterator rend() const {return const_reverse_iterator(begin());}
+  const_reverse_iterator crbegin() const {return const_reverse_iterator(end());}
+  const_reverse_iterator crend() const {return const_reverse_iterator(begin());}
+
+  iterator lower_bound(const key_type& val) {
+    return lower_bound_unique(val);
+  }
+  const_iterator lower_bound(const key_type& val) const {
+    return lower_bound_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  iterator lower_bound(const K& val) {
+    return lower_bound_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  const_iterator lower_bound(const K& val) const {
+    return lower_bound_unique(val);
+  }
+
+  iterator upper_bound(const key_type& val) {
+    return upper_bound_unique(val);
+  }
+  const_iterator upper_bound(const key_type& val) const {
+    return upper_bound_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  iterator upper_bound(const K& val) {
+    return upper_bound_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  const_iterator upper_bound(const K& val) const {
+    return upper_bound_unique(val);
+  }
+
+  iterator find(const key_type& val) {
+    return find_unique(val);
+  }
+  const_iterator find(const key_type& val) const {
+    return find_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  iterator find(const K& val) {
+    return find_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  const_iterator find(const K& val) const {
+    return find_unique(val);
+  }
+
+  size_type count(const key_type& val) const {
+    return find_unique(val) != end_unique() ? 1 : 0;
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  size_type count(const K& val) const {
+    return find_unique(val) != end_unique() ? 1 : 0;
+  }
+
+  std::pair<iterator, iterator> equal_range(const key_type& val) {
+    return equal_range_unique(val);
+  }
+  std::pair<const_iterator, const_iterator>
+  equal_range(const key_type& val) const {
+    return equal_range_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  std::pair<iterator, iterator> equal_range(const K& val) {
+    return equal_range_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  std::pair<const_iterator, const_iterator> equal_range(const K& val) const {
+    return equal_range_unique(val);
+  }
+
+  allocator_type get_allocator() const { return alloc_; }
+  key_compare key_comp() const { return comp_; }
+  value_compare value_comp() const { return value_compare(comp_); }
+
+  size_type size() const { return is_inline() ? size_ : data_.tree.size(); }
+  bool empty() const { return size() == 0; }
+
+  /* Whether the elements are still in the array */
+  bool is_inline() const { return size_ != in_tree; }
+
+  void swap(small_rb_tree& other) noexcept {
+    small_rb_tree tmp(std::move(other));
+    other = std::move(*this);
+    *this = std::move(tmp);
+  }
+
+  /* Destroy the elements, and go back to the array */
+  void clear() noexcept { reset(); }
+
+ protected:
+  template <class Pointer, class Reference>
+  class iterator_base {
+   public:
+    typedef std::bidirectional_iterator_tag iterator_category;
+    typedef typename small_rb_tree::value_type value_type;
+    typedef typename small_rb_tree::difference_type difference_type;
+    typedef Pointer pointer;
+    typedef Reference reference;
+
+    /* The value of a tree iterator is only constant for the sets */
+    Reference operator*() const {
+      return slot_ != nullptr ? *slot_ : const_cast<Reference>(*node_);
+    }
+    Pointer operator->() const { return &(operator*()); }
+
+    iterator_base& operator++() {
+      if (slot_ != nullptr)
+        ++slot_;
+      else
+        ++node_;
+      return *this;
+    }
+
+    iterator_base operator++(int) {
+      iterator_base tmp(*this);
+      ++*this;
+      return tmp;
+    }
+
+    iterator_base& operator--() {
+      if (slot_ != nullptr)
+        --slot_;
+      else
+        --node_;
+      return *this;
+    }
+
+    iterator_base operator--(int) {
+      iterator_base tmp(*this);
+      --*this;
+      return tmp;
+    }
+
+    inline bool operator==(const iterator_base& y) const {
+      return slot_ == y.slot_ && (slot_ != nullptr || node_ == y.node_);
+    }
+
+    inline bool operator!=(const iterator_base& y) const {
+      return !(*this == y);
+    }
+
+    iterator_base() : slot_(nullptr) { }
+
+    /*
+     * Both const_iterator and iterator can be converted from the iterator type
+     */
+    iterator_base(const iterator_base<value_type *, value_type &>& rhs)
+      : slot_(rhs.slot_), node_(rhs.node_) { }
+
+   protected:
+    /* The element in the array, or nullptr when node_ is in the tree */
+    value_type *slot_;
+    typename tree_type::const_iterator node_;
+
+    explicit iterator_base(const value_type *slot)
+      : slot_(const_cast<value_type *>(slot)) { }
+    explicit iterator_base(typename tree_type::const_iterator node)
+      : slot_(nullptr), node_(node) { }
+    template <class, class> friend class iterator_base;
+    friend class small_rb_tree;
+  }; // iterator_base
+
+  typedef std::allocator_traits<allocator_type> alloc_traits;
+
+  /* The array until it is full, and then the tree, in the same place */
+  union storage {
+    storage() { }
+    ~storage() { }
+
+    value_type values[N];
+    tree_type tree;
+  };
+
+  /*
+   * The number of elements in the array, or in_tree. It comes first, so that
+   * the empty comp_ and alloc_ can share its address, which they cannot with
+   * those of the same types in the tree.
+   */
+  size_type size_;
+  static constexpr size_type in_tree = ~size_type(0);
+
+  RB_TREE_NO_UNIQUE_ADDRESS key_compare comp_;
+  RB_TREE_NO_UNIQUE_ADDRESS allocator_type alloc_;
+  storage data_;
+
+  typedef rb_tree_branchless_search<key_type, key_compare> branchless_tag;
+
+  value_type *slot(size_type i) const {
+    return const_cast<value_type *>(data_.values) + i;
+  }
+
+  template <class... Args>
+  void construct(size_type i, Args&&... args) {
+    alloc_traits::construct(alloc_, slot(i), std::forward<Args>(args)...);
+  }
+  void destroy(size_type i) noexcept { alloc_traits::destroy(alloc_, slot(i)); }
+
+  /* Move the elements [first, last) of the array up or down a slot */
+  void move_up(size_type first, size_type last) noexcept {
+    for (size_type i = last; i != first; --i) {
+      construct(i, std::move(*slot(i - 1)));
+      destroy(i - 1);
+    }
+  }
+  void move_down(size_type first, size_type last) noexcept {
+    for (size_type i = first; i != last; ++i) {
+      construct(i - 1, std::move(*slot(i)));
+      destroy(i);
+    }
+  }
+
+  /*
+   * The number of elements of the array less than val, or not greater than
+   * val. The branchless scans compare all of them.
+   */
+  template <class K>
+  size_type lower_rank(const K& val) const {
+    return lower_rank(val, branchless_tag());
+  }
+  template <class K>
+  size_type lower_rank(const K& val, std::true_type) const {
+    value_compare comp(comp_);
+    size_type k = 0;
+    for (size_type i = 0; i < size_; ++i)
+      k += comp(*slot(i), val) ? 1 : 0;
+    return k;
+  }
+  template <class K>
+  size_type lower_rank(const K& val, std::false_type) const {
+    value_compare comp(comp_);
+    size_type i = 0;
+    while (i < size_ && comp(*slot(i), val))
+      ++i;
+    return i;
+  }
+
+  template <class K>
+  size_type upper_rank(const K& val) const {
+    return upper_rank(val, branchless_tag());
+  }
+  template <class K>
+  size_type upper_rank(const K& val, std::true_type) const {
+    value_compare comp(comp_);
+    size_type k = 0;
+    for (size_type i = 0; i < size_; ++i)
+      k += comp(val, *slot(i)) ? 0 : 1;
+    return k;
+  }
+  template <class K>
+  size_type upper_rank(const K& val, std::false_type) const {
+    value_compare comp(comp_);
+    size_type i = 0;
+    while (i < size_ && !comp(val, *slot(i)))
+      ++i;
+    return i;
+  }
+
+  iterator_type begin_unique() const {
+    if (!is_inline())
+      return iterator_type(data_.tree.cbegin());
+    return iterator_type(slot(0));
+  }
+  iterator_type end_unique() const {
+    if (!is_inline())
+      return iterator_type(data_.tree.cend());
+    return iterator_type(slot(size_));
+  }
+
+  template <class V>
+  std::pair<iterator_type, bool> insert_unique(V&& val);
+  template <class V>
+  iterator_type insert_hint_unique(const_iterator pos, V&& val);
+  template <class K>
+  size_type erase_unique(const K& val);
+
+  template <class K>
+  iterator_type lower_bound_unique(const K& val) const;
+  template <class K>
+  iterator_type upper_bound_unique(const K& val) const;
+  template <class K>
+  iterator_type find_unique(const K& val) const;
+  template <class K>
+  std::pair<iterator_type, iterator_type>
+  equal_range_unique(const K& val) const;
+
+  void move_to_tree();
+  void copy_from(const small_rb_tree& other);
+  void move_from(small_rb_tree& other) noexcept;
+  void reset() noexcept;
+};
+
+/*
+ * An element new to a full array moves the others into the tree first
+ */
+template <class T, std::size_t N, class C, class A, class P>
+template <class V>
+std::pair<typename small_rb_tree<T, N, C, A, P>::iterator_type, bool>
+small_rb_tree<T, N, C, A, P>::insert_unique(V&& val) {
+  if (!is_inline()) {
+    auto r = data_.tree.insert(std::forward<V>(val));
+    return std::pair<iterator_type, bool>(iterator_type(r.first), r.second);
+  }
+
+  size_type i = lower_rank(val);
+  if (i < size_ && !value_compare(comp_)(val, *slot(i)))
+    return std::pair<iterator_type, bool>(iterator_type(slot(i)), false);
+
+  if (size_ == N) {
+    move_to_tree();
+    return insert_unique(std::forward<V>(val));
+  }
+
+  move_up(i, size_);
+  try {
+    construct(i, std::forward<V>(val));
+  } catch (...) {
+    move_down(i + 1, size_ + 1);
+    throw;
+  }
+  ++size_;
+  return std::pair<iterator_type, bool>(iterator_type(slot(i)), true);
+}
+
+/* The hint is only of use to the tree */
+template <class T, std::size_t N, class C, class A, class P>
+template <class V>
+typename small_rb_tree<T, N, C, A, P>::iterator_type
+small_rb_tree<T, N, C, A, P>::insert_hint_unique(const_iterator pos,
+                                                 V&& val) {
+  if (!is_inline())
+    return iterator_type(data_.tree.insert(pos.node_, std::forward<V>(val)));
+  return insert_unique(std::forward<V>(val)).first;
+}
+
+template <class T, std::size_t N, class C, class A, class P>
+typename small_rb_tree<T, N, C, A, P>::iterator
+small_rb_tree<T, N, C, A, P>::erase(const_iterator pos) {
+  if (!is_inline())
+    return iterator_type(data_.tree.erase(pos.node_));
+
+  size_type i = static_cast<size_type>(pos.slot_ - slot(0));
+  destroy(i);
+  move_down(i + 1, size_);
+  --size_;
+  return iterator_type(slot(i));
+}
+
+template <class T, std::size_t N, class C, class A, class P>
+typename small_rb_tree<T, N, C, A, P>::iterator
+small_rb_tree<T, N, C, A, P>::erase(const_iterator first,
+                                    const_iterator last) {
+  if (!is_inline())
+    return iterator_type(data_.tree.erase(first.node_, last.node_));
+
+  size_type i = static_cast<size_type>(first.slot_ - slot(0));
+  size_type j = static_cast<size_type>(last.slot_ - slot(0));
+  if (i == j)
+    return iterator_type(slot(i));
+
+  for (size_type k = i; k != j; ++k)
+    destroy(k);
+  for (size_type k = j; k != size_; ++k) {
+    construct(k - (j - i), std::move(*slot(k)));
+    destroy(k);
+  }
+  size_ -= j - i;
+  return iterator_type(slot(i));
+}
+
+template <class T, std::size_t N, class C, class A, class P>
+template <class K>
+typename small_rb_tree<T, N, C, A, P>::size_type
+small_rb_tree<T, N, C, A, P>::erase_unique(const K& val) {
+  iterator_type j = find_unique(val);
+  if (j == end_unique())
+    return 0;
+  erase(j);
+  return 1;
+}
+
+template <class T, std::size_t N, class C, class A, class P>
+template <class K>
+typename small_rb_tree<T, N, C, A, P>::iterator_type
+small_rb_tree<T, N, C, A, P>::lower_bound_unique(const K& val) const {
+  if (!is_inline())
+    return iterator_type(data_.tree.lower_bound(val));
+  return iterator_type(slot(lower_rank(val)));
+}
+
+template <class T, std::size_t N, class C, class A, class P>
+template <class K>
+typename small_rb_tree<T, N, C, A, P>::iterator_type
+small_rb_tree<T, N, C, A, P>::upper_bound_unique(const K& val) const {
+  if (!is_inline())
+    return iterator_type(data_.tree.upper_bound(val));
+  return iterator_type(slot(upper_rank(val)));
+}
+
+template <class T, std::size_t N, class C, class A, class P>
+template <class K>
+typename small_rb_tree<T, N, C, A, P>::iterator_type
+small_rb_tree<T, N, C, A, P>::find_unique(const K& val) const {
+  if (!is_inline())
+    return iterator_type(data_.tree.find(val));
+
+  size_type i = lower_rank(val);
+  if (i == size_ || value_compare(comp_)(val, *slot(i)))
+    return iterator_type(slot(size_));
+  return iterator_type(slot(i));
+}
+
+template <class T, std::size_t N, class C, class A, class P>
+template <class K>
+std::pair<typename small_rb_tree<T, N, C, A, P>::iterator_type,
+          typename small_rb_tree<T, N, C, A, P>::iterator_type>
+small_rb_tree<T, N, C, A, P>::equal_range_unique(const K& val) const {
+  iterator_type j = lower_bound_unique(val);
+
+  if (j == end_unique() || value_compare(comp_)(val, *j))
+    return std::pair<iterator_type, iterator_type>(j, j);
+  else
+    return std::pair<iterator_type, iterator_type>(j, std::next(j));
+}
+
+/*
+ * Move the elements of the array into a tree, and build the tree in its
+ * place. They are appended with the end hint, in O(N). Only the allocation
+ * of a node can fail, and then the elements already in the tree are moved
+ * back.
+ */
+template <class T, std::size_t N, class C, class A, class P>
+void small_rb_tree<T, N, C, A, P>::move_to_tree() {
+  tree_type t(comp_, alloc_);
+
+  try {
+    for (size_type i = 0; i < size_; ++i)
+      t.insert(t.cend(), std::move(*slot(i)));
+  } catch (...) {
+    size_type i = 0;
+    for (typename tree_type::const_iterator it = t.cbegin(); it != t.cend();
+         ++it, ++i) {
+      destroy(i);
+      construct(i, std::move(const_cast<value_type&>(*it)));
+    }
+    throw;
+  }
+
+  for (size_type i = 0; i < size_; ++i)
+    destroy(i);
+  ::new (static_cast<void *>(&data_.tree)) tree_type(std::move(t));
+  size_ = in_tree;
+}
+
+/* Copy the elements of other into this empty array */
+template <class T, std::size_t N, class C, class A, class P>
+void small_rb_tree<T, N, C, A, P>::copy_from(const small_rb_tree& other) {
+  if (!other.is_inline()) {
+    ::new (static_cast<void *>(&data_.tree)) tree_type(other.data_.tree);
+    size_ = in_tree;
+    return;
+  }
+
+  try {
+    for (; size_ < other.size_; ++size_)
+      construct(size_, *other.slot(size_));
+  } catch (...) {
+    reset();
+    throw;
+  }
+}
+
+/* Take the elements of other into this empty array, leaving other empty */
+template <class T, std::size_t N, class C, class A, class P>
+void small_rb_tree<T, N, C, A, P>::move_from(small_rb_tree& other) noexcept {
+  if (!other.is_inline()) {
+    ::new (static_cast<void *>(&data_.tree))
+      tree_type(std::move(other.data_.tree));
+    size_ = in_tree;
+  } else {
+    for (size_type i = 0; i < other.size_; ++i)
+      construct(i, std::move(*other.slot(i)));
+    size_ = other.size_;
+  }
+  other.reset();
+}
+
+template <class T, std::size_t N, class C, class A, class P>
+void small_rb_tree<T, N, C, A, P>::reset() noexcept {
+  if (is_inline()) {
+    for (size_type i = 0; i < size_; ++i)
+      destroy(i);
+  } else {
+    data_.tree.~tree_type();
+  }
+  size_ = 0;
+}
+
+} // namespace rb_tree
+
+#endif // RB_SMALL_TREE_H
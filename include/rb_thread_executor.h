@@ -0,0 +1,76 @@
+#ifndef RB_THREAD_EXECUTOR_H
+#define RB_THREAD_EXECUTOR_H
+
+#include <atomic>
+#include <exception>
+#include <system_error>
+#include <thread>
+
+namespace rb_tree {
+
+/*
+ * An executor for the parallel algorithms of rb_tree that runs the second
+ * task of a fork on a new thread while the calling thread runs the first,
+ * as long as fewer than threads - 1 extra threads are running. Otherwise,
+ * or if no thread can be started, both tasks run in the calling thread.
+ *   rb_tree<int> a, b;
+ *   ...
+ *   a.set_union(std::move(b), thread_executor(32));
+ * The algorithms only fork large subtrees, so the threads are few and long
+ * lived enough that a pool would save little.
+ */
+class thread_executor {
+ public:
+  explicit thread_executor(
+      unsigned threads = std::thread::hardware_concurrency())
+    : spare_(threads > 1 ? int(threads) - 1 : 0) { }
+
+  thread_executor(const thread_executor&) = delete;
+  thread_executor& operator=(const thread_executor&) = delete;
+
+  template <class F, class G>
+  void operator()(F&& f, G&& g) const {
+    if (spare_.fetch_sub(1, std::memory_order_acquire) <= 0) {
+      spare_.fetch_add(1, std::memory_order_release);
+      f();
+      g();
+      return;
+    }
+
+    std::exception_ptr error;
+    std::thread thread;
+    try {
+      thread = std::thread([&] {
+        try {
+          g();
+        } catch (...) {
+          error = std::current_exception();
+        }
+      });
+    } catch (const std::system_error&) {
+      spare_.fetch_add(1, std::memory_order_release);
+      f();
+      g();
+      return;
+    }
+
+    try {
+      f();
+    } catch (...) {
+      thread.join();
+      spare_.fetch_add(1, std::memory_order_release);
+      throw;
+    }
+    thread.join();
+    spare_.fetch_add(1, std::memory_order_release);
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+ private:
+  mutable std::atomic<int> spare_;
+}; // thread_executor
+
+} // namespace rb_tree
+
+#endif // RB_THREAD_EXECUTOR_H
@@ -2,26 +2,547 @@
 #define RB_TREE_H
 
 #include <utility>
+#include <atomic>
 #include <memory>
+#include <functional>
+#include <iterator>
+#include <initializer_list>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <algorithm>
+#include <vector>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define RB_TREE_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define RB_TREE_PREFETCH(addr) ((void)0)
+#endif
+
+/* Let the empty comparators and allocators of a tree take no space */
+#if defined(_MSC_VER) && _MSC_VER >= 1929
+#define RB_TREE_NO_UNIQUE_ADDRESS [[msvc::no_unique_address]]
+#elif defined(__has_cpp_attribute)
+#if __has_cpp_attribute(no_unique_address)
+#define RB_TREE_NO_UNIQUE_ADDRESS [[no_unique_address]]
+#endif
+#endif
+#ifndef RB_TREE_NO_UNIQUE_ADDRESS
+#define RB_TREE_NO_UNIQUE_ADDRESS
+#endif
 
 namespace rb_tree {
 
+/*
+ * Tag type for the range constructor and range insert.
+ * The caller guarantees that the range is strictly increasing in the order
+ * given by the comparator, so the tree can skip the sortedness check.
+ */
+struct sorted_unique_t { explicit sorted_unique_t() = default; };
+constexpr sorted_unique_t sorted_unique = sorted_unique_t();
+
+/*
+ * An operation of apply_batch(): erase the element equivalent to value if
+ * erase is true, otherwise insert value. An erase only uses the key of its
+ * value.
+ */
+template <class Value>
+struct batch_op {
+  bool erase;
+  Value value;
+};
+
+/*
+ * Executors for the parallel algorithms of the tree.
+ * An executor is called as ex(f, g) with two tasks, which it may run in
+ * parallel, and returns once both are done, passing on their exceptions.
+ * It can wrap a thread pool, e.g. tbb::parallel_invoke, or be the
+ * thread_executor of rb_thread_executor.h. The sequential_executor runs the
+ * tasks one after the other.
+ */
+struct sequential_executor {
+  template <class F, class G>
+  void operator()(F&& f, G&& g) const {
+    f();
+    g();
+  }
+};
+
+/*
+ * Augmentations attach metadata to every node, which summarizes the subtree
+ * rooted at the node.
+ * An augmentation defines the metadata_type, and a static function
+ *
+ *   template <class Node> static void update(Node *x);
+ *
+ * that recalculates x->metadata from x->value and the metadata of x->left and
+ * x->right, which are null pointers for missing children. The tree calls it
+ * bottom-up whenever the subtree of a node changes.
+ */
+struct no_augment { };
+
+/* The size of the subtree, for order statistics */
+struct order_statistics_augment {
+  typedef std::size_t metadata_type;
+
+  template <class Node>
+  static void update(Node *x) {
+    x->metadata = 1 + (x->left ? x->left->metadata : 0) +
+                  (x->right ? x->right->metadata : 0);
+  }
+};
+
+/*
+ * Statistics of the hot paths of a tree, for finding out why a tree behaves
+ * badly. A statistics type defines
+ *
+ *   void lookup(std::size_t depth, std::size_t comparisons);
+ *   void rotation();
+ *   void insert_fixup(std::size_t iterations, std::size_t recolorings);
+ *   void erase_fixup(std::size_t iterations, std::size_t recolorings);
+ *   void hint(bool hit);
+ *   void reset();
+ *
+ * which the tree calls after each descent, rotation, fixup loop and hinted
+ * insert. no_stats does nothing and costs nothing; tree_stats keeps the
+ * counts and histograms. The policy picks one, and defining RB_TREE_STATS
+ * makes tree_stats the default.
+ */
+struct no_stats {
+  void lookup(std::size_t, std::size_t) { }
+  void rotation() { }
+  void insert_fixup(std::size_t, std::size_t) { }
+  void erase_fixup(std::size_t, std::size_t) { }
+  void hint(bool) { }
+  void reset() { }
+};
+
+/*
+ * A counter that the const lookups can bump from concurrent readers.
+ * It is a relaxed load and store rather than a locked increment, so racing
+ * readers may lose counts, but never tear them.
+ */
+class stats_counter {
+ public:
+  stats_counter() : n_(0) { }
+  stats_counter(const stats_counter&) = delete;
+  stats_counter& operator=(const stats_counter&) = delete;
+
+  void add(std::uint64_t k) {
+    n_.store(n_.load(std::memory_order_relaxed) + k,
+             std::memory_order_relaxed);
+  }
+  std::uint64_t value() const { return n_.load(std::memory_order_relaxed); }
+  void reset() { n_.store(0, std::memory_order_relaxed); }
+
+ private:
+  std::atomic<std::uint64_t> n_;
+};
+
+/* Counts of small values; the last bucket takes the larger ones too */
+class stats_histogram {
+ public:
+  static constexpr std::size_t buckets = 64;
+
+  void add(std::size_t v) {
+    counts_[v < buckets ? v : buckets - 1].add(1);
+    sum_.add(v);
+  }
+
+  std::uint64_t count(std::size_t bucket) const {
+    return counts_[bucket].value();
+  }
+  std::uint64_t total() const {
+    std::uint64_t n = 0;
+    for (std::size_t i = 0; i < buckets; ++i)
+      n += counts_[i].value();
+    return n;
+  }
+  std::uint64_t sum() const { return sum_.value(); }
+  double mean() const {
+    std::uint64_t n = total();
+    return n == 0 ? 0.0 : static_cast<double>(sum()) / n;
+  }
+
+  void reset() {
+    for (std::size_t i = 0; i < buckets; ++i)
+      counts_[i].reset();
+    sum_.reset();
+  }
+
+ private:
+  stats_counter counts_[buckets];
+  stats_counter sum_;
+};
+
+/*
+ * The statistics of a tree, read through rb_tree::stats(), e.g.
+ *   t.stats().depth.mean()
+ *   t.stats().for_each_counter([](const char *name, std::uint64_t n) { });
+ * The histograms are of the nodes visited by each descent of a lookup or an
+ * insert, and of the loop iterations of each insert and erase fixup.
+ */
+struct tree_stats {
+  stats_counter lookups;
+  stats_counter comparisons;
+  stats_counter rotations;
+  stats_counter recolorings;
+  stats_counter hint_hits;
+  stats_counter hint_misses;
+  stats_histogram depth;
+  stats_histogram insert_fixup_iterations;
+  stats_histogram erase_fixup_iterations;
+
+  void lookup(std::size_t d, std::size_t comps) {
+    lookups.add(1);
+    comparisons.add(comps);
+    depth.add(d);
+  }
+  void rotation() { rotations.add(1); }
+  void insert_fixup(std::size_t iterations, std::size_t recolors) {
+    insert_fixup_iterations.add(iterations);
+    recolorings.add(recolors);
+  }
+  void erase_fixup(std::size_t iterations, std::size_t recolors) {
+    erase_fixup_iterations.add(iterations);
+    recolorings.add(recolors);
+  }
+  void hint(bool hit) { (hit ? hint_hits : hint_misses).add(1); }
+
+  /* Call f(const char *name, std::uint64_t value) on each counter */
+  template <class F>
+  void for_each_counter(F f) const {
+    f("lookups", lookups.value());
+    f("comparisons", comparisons.value());
+    f("rotations", rotations.value());
+    f("recolorings", recolorings.value());
+    f("hint_hits", hint_hits.value());
+    f("hint_misses", hint_misses.value());
+  }
+
+  /* Call f(const char *name, const stats_histogram&) on each histogram */
+  template <class F>
+  void for_each_histogram(F f) const {
+    f("depth", depth);
+    f("insert_fixup_iterations", insert_fixup_iterations);
+    f("erase_fixup_iterations", erase_fixup_iterations);
+  }
+
+  void reset() {
+    lookups.reset();
+    comparisons.reset();
+    rotations.reset();
+    recolorings.reset();
+    hint_hits.reset();
+    hint_misses.reset();
+    depth.reset();
+    insert_fixup_iterations.reset();
+    erase_fixup_iterations.reset();
+  }
+};
+
+/*
+ * Key extractors, giving the key of a value that the tree compares
+ */
+struct identity_key {
+  template <class T>
+  static const T& key(const T& val) { return val; }
+};
+
+/* The first member of a pair, for maps */
+struct pair_first_key {
+  template <class Pair>
+  static const typename Pair::first_type& key(const Pair& val) {
+    return val.first;
+  }
+};
+
+/*
+ * Policies for the layout of the tree nodes.
+ * Derive from one of them and override the members to customize the tree.
+ *
+ * packed_color: store the color in the lowest bit of the parent pointer
+ *               instead of a separate field, which saves a word per node.
+ * augment: the augmentation of the nodes. order_statistics_augment enables
+ *          rank(), select(), index_of() and count_range().
+ * key_of_value: the key extractor. The elements are constant unless the
+ *               key is only a part of them, like in rb_map.
+ * stats: the statistics of the hot paths, no_stats or tree_stats.
+ * threaded: keep the successor and predecessor of each node in two more
+ *           links, which makes the iterator steps a single load. The set
+ *           operations, copies and sorted builds thread the result in one
+ *           more linear pass.
+ * tombstones: erase() only marks the element dead, and an insert of its key
+ *             revives the node in place. The lookups and iterators skip the
+ *             dead nodes, which compact() purges; see compact().
+ */
+struct default_policy {
+  static constexpr bool packed_color = false;
+  static constexpr bool threaded = false;
+  static constexpr bool tombstones = false;
+  typedef no_augment augment;
+  typedef identity_key key_of_value;
+#ifdef RB_TREE_STATS
+  typedef tree_stats stats;
+#else
+  typedef no_stats stats;
+#endif
+};
+
+struct packed_policy : default_policy {
+  static constexpr bool packed_color = true;
+};
+
+struct order_statistics_policy : default_policy {
+  typedef order_statistics_augment augment;
+};
+
+struct stats_policy : default_policy {
+  typedef tree_stats stats;
+};
+
+struct threaded_policy : default_policy {
+  static constexpr bool threaded = true;
+};
+
+struct tombstone_policy : default_policy {
+  static constexpr bool tombstones = true;
+};
+
+/*
+ * The links of a node and its color.
+ * They come before the value in the node, so that the descent loops only
+ * touch the beginning of each node.
+ */
+template <class Node, class Color, bool Packed>
+struct rb_tree_node_links {
+  Node *parent_;
+  Node *left;
+  Node *right;
+  Color color_;
+
+  Node *parent() const { return parent_; }
+  void set_parent(Node *p) { parent_ = p; }
+  /* The right child if right is true, else the left one, without a branch */
+  Node *child(bool right) const {
+    return *reinterpret_cast<Node *const *>(
+        reinterpret_cast<const char *>(this) +
+        (right ? offsetof(rb_tree_node_links, right)
+               : offsetof(rb_tree_node_links, left)));
+  }
+  Color color() const { return color_; }
+  void set_color(Color c) { color_ = c; }
+  void set_parent_and_color(Node *p, Color c) {
+    parent_ = p;
+    color_ = c;
+  }
+};
+
+template <class Node, class Color>
+struct rb_tree_node_links<Node, Color, true> {
+  std::uintptr_t parent_color_;
+  Node *left;
+  Node *right;
+
+  Node *parent() const {
+    return reinterpret_cast<Node *>(parent_color_ & ~std::uintptr_t(1));
+  }
+  Node *child(bool right) const {
+    return *reinterpret_cast<Node *const *>(
+        reinterpret_cast<const char *>(this) +
+        (right ? offsetof(rb_tree_node_links, right)
+               : offsetof(rb_tree_node_links, left)));
+  }
+  void set_parent(Node *p) {
+    parent_color_ = reinterpret_cast<std::uintptr_t>(p) | (parent_color_ & 1);
+  }
+  Color color() const { return Color(parent_color_ & 1); }
+  void set_color(Color c) {
+    parent_color_ = (parent_color_ & ~std::uintptr_t(1)) | std::uintptr_t(c);
+  }
+  void set_parent_and_color(Node *p, Color c) {
+    parent_color_ = reinterpret_cast<std::uintptr_t>(p) | std::uintptr_t(c);
+  }
+};
+
+/*
+ * The metadata of the augmentation, if any
+ */
+template <class Augment>
+struct rb_tree_node_metadata {
+  typename Augment::metadata_type metadata;
+};
+
+template <>
+struct rb_tree_node_metadata<no_augment> { };
+
+/*
+ * The in-order neighbours of a node, if the tree is threaded. The nodes and
+ * the end node are in a circular list, so the last node is followed by the
+ * end node, which is followed by the first node.
+ */
+template <class Node, bool Threaded>
+struct rb_tree_node_threads {
+  Node *next;
+  Node *prev;
+};
+
+template <class Node>
+struct rb_tree_node_threads<Node, false> { };
+
+/*
+ * Whether an erased node is still in the tree as a tombstone, if the tree
+ * keeps them. The end node is never dead.
+ */
+template <bool Tombstones>
+struct rb_tree_node_tombstone {
+  bool dead = false;
+};
+
+template <>
+struct rb_tree_node_tombstone<false> { };
+
+/*
+ * Allocators that can free all their blocks at once, like pool_allocator,
+ * provide
+ *   size_type allocated() const;  the number of blocks in use
+ *   void release();               free all the blocks
+ * A tree owning all the blocks of such an allocator drops its nodes with a
+ * single release() instead of deallocating them one by one.
+ */
+template <class Alloc>
+struct rb_tree_releasable_allocator {
+  template <class A>
+  static auto test(int)
+    -> decltype(std::declval<const A&>().allocated(),
+                std::declval<A&>().release(), std::true_type());
+  template <class A>
+  static std::false_type test(...);
+
+  typedef decltype(test<Alloc>(0)) type;
+};
+
+/*
+ * Allocators that can make room for many blocks at once, like
+ * pool_allocator, provide
+ *   void reserve(size_type n);
+ * It is called before copying a whole tree.
+ */
+template <class Alloc>
+struct rb_tree_reservable_allocator {
+  template <class A>
+  static auto test(int)
+    -> decltype(std::declval<A&>().reserve(std::size_t()), std::true_type());
+  template <class A>
+  static std::false_type test(...);
+
+  typedef decltype(test<Alloc>(0)) type;
+};
+
+/*
+ * Keys whose comparison is a single cheap instruction without side effects,
+ * like the arithmetic types of at most 4 bytes with std::less or
+ * std::greater. The descents over them compare and pick the child without
+ * a branch, which is faster than mispredicting half of the branches. The
+ * wider keys are left out: on large trees their descents wait on the memory,
+ * and the predicted branches win by loading the next node early. Specialize
+ * it for other such keys.
+ */
+template <class Key, class Compare>
+struct rb_tree_branchless_search
+  : std::integral_constant<bool, std::is_arithmetic<Key>::value &&
+        sizeof(Key) <= 4 &&
+        (std::is_same<Compare, std::less<Key> >::value ||
+         std::is_same<Compare, std::greater<Key> >::value ||
+         std::is_same<Compare, std::less<void> >::value ||
+         std::is_same<Compare, std::greater<void> >::value)> { };
+
+/* The number of tombstones of a tree, only counted if it keeps them */
+template <bool Tombstones>
+class rb_tree_tombstone_count {
+ protected:
+  std::size_t dead_count() const { return dead_; }
+  void set_dead_count(std::size_t n) { dead_ = n; }
+
+ private:
+  std::size_t dead_ = 0;
+};
+
+template <>
+class rb_tree_tombstone_count<false> {
+ protected:
+  static constexpr std::size_t dead_count() { return 0; }
+  static void set_dead_count(std::size_t) { }
+};
+
+/*
+ * The statistics of a tree, as a base so that no_stats takes no space.
+ * The const lookups update them too.
+ */
+template <class Stats, bool = std::is_empty<Stats>::value>
+class rb_tree_stats_holder {
+ protected:
+  Stats& counters() const { return stats_; }
+
+ private:
+  mutable Stats stats_;
+};
+
+template <class Stats>
+class rb_tree_stats_holder<Stats, true> : private Stats {
+ protected:
+  Stats& counters() const {
+    return const_cast<rb_tree_stats_holder&>(*this);
+  }
+};
+
 template <class T,
           class Compare = std::less<T>,
-          class Alloc = std::allocator<T> >
-class rb_tree {
+          class Alloc = std::allocator<T>,
+          class Policy = default_policy>
+class rb_tree : private rb_tree_stats_holder<typename Policy::stats>,
+                private rb_tree_tombstone_count<Policy::tombstones> {
  public:
-  typedef T key_type;
+  typedef typename Policy::key_of_value key_of_value;
   typedef T value_type;
+  typedef typename std::decay<decltype(
+      key_of_value::key(std::declval<const value_type&>()))>::type key_type;
   typedef Compare key_compare;
-  typedef Compare value_compare;
   typedef Alloc allocator_type;
-  typedef typename allocator_type::reference reference;
-  typedef typename allocator_type::const_reference const_reference;
-  typedef typename allocator_type::difference_type difference_type;
-  typedef typename allocator_type::size_type size_type;
-  typedef typename allocator_type::pointer pointer;
-  typedef typename allocator_type::const_pointer const_pointer;
+
+  /*
+   * Compare values and keys alike, by their keys, so that the tree can look
+   * up a value or a key with the same code
+   */
+  class value_compare {
+   public:
+    explicit value_compare(const key_compare& comp) : comp(comp) { }
+
+    template <class A, class B>
+    bool operator()(const A& a, const B& b) const {
+      return comp(key(a), key(b));
+    }
+
+   protected:
+    RB_TREE_NO_UNIQUE_ADDRESS key_compare comp;
+
+    static const key_type& key(const value_type& val) {
+      return key_of_value::key(val);
+    }
+    template <class K>
+    static const K& key(const K& val) { return val; }
+
+    friend class rb_tree;
+  }; // value_compare
+
+  typedef value_type& reference;
+  typedef const value_type& const_reference;
+  typedef typename std::allocator_traits<Alloc>::difference_type
+    difference_type;
+  typedef typename std::allocator_traits<Alloc>::size_type size_type;
+  typedef typename std::allocator_traits<Alloc>::pointer pointer;
+  typedef typename std::allocator_traits<Alloc>::const_pointer const_pointer;
 
  protected:
   template <class Pointer, class Reference> class iterator_base;
@@ -31,18 +552,94 @@ class rb_tree {
     const_iterator_type;
 
  public:
-  typedef const_iterator_type iterator;
+  /* The elements of a set are constant, only the keys of a map are */
+  typedef typename std::conditional<
+      std::is_same<key_type, value_type>::value,
+      const_iterator_type, iterator_type>::type iterator;
   typedef const_iterator_type const_iterator;
   typedef std::reverse_iterator<iterator> reverse_iterator;
-  typedef reverse_iterator const_reverse_iterator;
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
 
  protected:
+  struct rb_tree_node_base;
   struct rb_tree_node;
-  typedef rb_tree_node* node_ptr;
+  typedef rb_tree_node_base* node_ptr;
 
   static constexpr node_ptr nil_ = 0;
 
  public:
+  /*
+   * A node extracted from the tree, which owns the node and its value until
+   * it is inserted into a tree again.
+   */
+  class node_handle {
+   public:
+    typedef T value_type;
+    typedef Alloc allocator_type;
+
+    node_handle() noexcept : ptr_(nil_) { }
+
+    node_handle(node_handle&& other) noexcept
+      : ptr_(other.ptr_), alloc_(std::move(other.alloc_)) {
+      other.ptr_ = nil_;
+    }
+
+    node_handle& operator=(node_handle&& other) noexcept {
+      if (this != &other) {
+        reset();
+        ptr_ = other.ptr_;
+        alloc_ = std::move(other.alloc_);
+        other.ptr_ = nil_;
+      }
+      return *this;
+    }
+
+    ~node_handle() { reset(); }
+
+    bool empty() const noexcept { return ptr_ == nil_; }
+    explicit operator bool() const noexcept { return ptr_ != nil_; }
+
+    value_type& value() const { return value_of(ptr_); }
+    allocator_type get_allocator() const { return alloc_; }
+
+    void swap(node_handle& other) noexcept {
+      std::swap(ptr_, other.ptr_);
+      std::swap(alloc_, other.alloc_);
+    }
+
+   protected:
+    node_ptr ptr_;
+    allocator_type alloc_;
+
+    node_handle(node_ptr ptr, const allocator_type& alloc)
+      : ptr_(ptr), alloc_(alloc) { }
+
+    node_ptr release() noexcept {
+      node_ptr ptr = ptr_;
+      ptr_ = nil_;
+      return ptr;
+    }
+
+    void reset() noexcept {
+      if (ptr_ != nil_) {
+        node_allocator_type node_alloc(alloc_);
+        alloc_traits::destroy(alloc_, &value_of(ptr_));
+        node_alloc_traits::deallocate(node_alloc, full_node(ptr_), 1);
+        ptr_ = nil_;
+      }
+    }
+
+    friend class rb_tree;
+  }; // node_handle
+
+  typedef node_handle node_type;
+
+  struct insert_return_type {
+    iterator position;
+    bool inserted;
+    node_type node;
+  };
+
   /*
    * constructors
    */
@@ -58,11 +655,11 @@ class rb_tree {
       alloc_(alloc),
       node_alloc_(node_allocator_type(alloc)) {
     end_ = &end_node_;
-    end_->parent = end_;
+    end_->set_parent_and_color(end_, black_);
     end_->left = nil_;
     end_->right = nil_;
-    end_->color = black_;
     begin_ = end_;
+    finger_ = nil_;
   }
 
   explicit rb_tree(const allocator_type& alloc)
@@ -78,16 +675,35 @@ class rb_tree {
   template <class InputIterator>
   rb_tree(InputIterator first, InputIterator last,
           const allocator_type& alloc)
-    : rb_tree(key_compare(), alloc) { }
+    : rb_tree(key_compare(), alloc) { insert(first, last); }
+
+  // sorted range, no check on the order of the elements
+  template <class InputIterator>
+  rb_tree(sorted_unique_t, InputIterator first, InputIterator last,
+          const key_compare& comp = key_compare(),
+          const allocator_type& alloc = allocator_type())
+    : rb_tree(comp, alloc) { insert(sorted_unique, first, last); }
 
   // copy
-  rb_tree(const rb_tree& other) : rb_tree(other, other.alloc_) { }
+  rb_tree(const rb_tree& other)
+    : rb_tree(other,
+        alloc_traits::select_on_container_copy_construction(other.alloc_)) { }
 
   rb_tree(const rb_tree& other, const allocator_type& alloc)
     : comp_(other.comp_),
       alloc_(alloc),
       node_alloc_(node_allocator_type(alloc)) {
-    copy_tree(other);
+    end_ = &end_node_;
+    end_->set_parent_and_color(end_, black_);
+    end_->left = nil_;
+    end_->right = nil_;
+    begin_ = end_;
+    size_ = 0;
+    finger_ = nil_;
+
+    node_creator gen(*this);
+    reserve_nodes(other.size_ + other.dead_count());
+    copy_tree(other, gen);
   }
 
   // move
@@ -96,28 +712,29 @@ class rb_tree {
       alloc_(other.alloc_),
       node_alloc_(node_allocator_type(other.alloc_)) {
     end_ = &end_node_;
-    end_->parent = end_;
-    end_->color = black_;
+    end_->set_parent_and_color(end_, black_);
+    finger_ = nil_;
 
     move_tree(other);
   }
 
-  rb_tree(rb_tree&& other, const allocator_type& alloc) noexcept
+  rb_tree(rb_tree&& other, const allocator_type& alloc)
     : comp_(other.comp_),
       alloc_(alloc),
       node_alloc_(node_allocator_type(alloc)) {
     end_ = &end_node_;
-    end_->parent = end_;
-    end_->color = black_;
+    end_->set_parent_and_color(end_, black_);
+
+    end_->left = nil_;
+    end_->right = nil_;
+    begin_ = end_;
+    size_ = 0;
+    finger_ = nil_;
 
-    if (alloc == other.alloc) {
+    if (alloc_ == other.alloc_)
       move_tree(other);
-    } else {
-      end_->left = nil_;
-      end_->right = nil_;
-      begin_ = end_;
-      size_ = 0;
-    }
+    else
+      move_values(other);
   }
 
   /* destructor */
@@ -126,8 +743,20 @@ class rb_tree {
   /* assignments */
   rb_tree& operator=(const rb_tree& other) {
     if (this != &other) {
-      clear();
-      copy_tree(other);
+      if (alloc_traits::propagate_on_container_copy_assignment::value &&
+          alloc_ != other.alloc_) {
+        clear();
+        alloc_ = other.alloc_;
+        node_alloc_ = other.node_alloc_;
+      }
+      comp_ = other.comp_;
+
+      /* the nodes of this tree are reused for the values of other */
+      node_recycler gen(*this);
+      size_type n = other.size_ + other.dead_count();
+      if (n > gen.size())
+        reserve_nodes(n - gen.size());
+      copy_tree(other, gen);
     }
     return *this;
   }
@@ -135,7 +764,8 @@ class rb_tree {
   rb_tree& operator=(rb_tree&& other) {
     if (this != &other) {
       clear();
-      move_tree(other);
+      move_assign(other,
+          typename alloc_traits::propagate_on_container_move_assignment());
     }
     return *this;
   }
@@ -146,20 +776,132 @@ class rb_tree {
   std::pair <iterator, bool> insert(const value_type& val) {
     return insert_unique(val);
   }
+  std::pair <iterator, bool> insert(value_type&& val) {
+    return insert_unique(std::move(val));
+  }
   iterator insert(const_iterator pos, const value_type& val) {
     return insert_unique(pos.ptr_, val);
   }
+  iterator insert(const_iterator pos, value_type&& val) {
+    return insert_unique(pos.ptr_, std::move(val));
+  }
   template <class InputIterator>
   void insert(InputIterator first, InputIterator last) {
-    for (InputIterator it = first; it != last; ++it) {
-      insert_unique(*it);
-    }
+    insert_range(first, last,
+        typename std::iterator_traits<InputIterator>::iterator_category());
+  }
+  template <class InputIterator>
+  void insert(sorted_unique_t, InputIterator first, InputIterator last) {
+    insert_sorted_range(first, last,
+        typename std::iterator_traits<InputIterator>::iterator_category());
   }
+  /*
+   * Insert a sorted range, building the subtrees in parallel with ex; the
+   * elements that are already in the tree are merged in with set_union().
+   */
+  template <class RandomAccessIterator, class Executor>
+  void insert(sorted_unique_t, RandomAccessIterator first,
+              RandomAccessIterator last, const Executor& ex);
   void insert(std::initializer_list<value_type> il) {
-    for (const value_type *it = il.begin(); it != il.end(); ++it) {
-      insert_unique(*it);
+    insert(il.begin(), il.end());
+  }
+
+  template <class... Args>
+  std::pair <iterator, bool> emplace(Args&&... args) {
+    return emplace_unique(std::forward<Args>(args)...);
+  }
+  template <class... Args>
+  iterator emplace_hint(const_iterator pos, Args&&... args) {
+    return emplace_hint_unique(pos.ptr_, std::forward<Args>(args)...);
+  }
+
+  insert_return_type insert(node_type&& nh) {
+    return insert_node_unique(std::move(nh));
+  }
+  iterator insert(const_iterator pos, node_type&& nh) {
+    return insert_node_unique(pos.ptr_, std::move(nh));
+  }
+
+  /*
+   * Extracting and inserting nodes moves them between trees without any
+   * allocation or copy, provided that the allocators of the trees are equal.
+   */
+  node_type extract(const_iterator pos) {
+    unlink_node(pos.ptr_);
+    trim_tombstones();
+    return node_type(pos.ptr_, alloc_);
+  }
+  node_type extract(const key_type& val) {
+    return extract_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent,
+            class = typename std::enable_if<
+                !std::is_convertible<K, const_iterator>::value>::type>
+  node_type extract(const K& val) {
+    return extract_unique(val);
+  }
+
+  /* Move the nodes of source without an equivalent element in this tree */
+  void merge(rb_tree& source);
+  void merge(rb_tree&& source) { merge(source); }
+
+  /*
+   * Split and join in O(log n), without allocation. The trees must have
+   * equal allocators. Unless the tree keeps the subtree sizes, split() also
+   * counts the smaller part to set the sizes.
+   *
+   * split: move the elements not less than val into the returned tree
+   * join: append right, and pivot in between if given. The elements of this
+   *       tree must all be less than pivot, and pivot less than those of
+   *       right.
+   */
+  rb_tree split(const key_type& val) { return split_unique(val); }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  rb_tree split(const K& val) { return split_unique(val); }
+
+  void join(rb_tree&& right) {
+    if (right.size_ == 0)
+      return;
+
+    compact();
+    right.compact();
+    if (size_ == 0) {
+      move_tree(right);
+    } else {
+      node_ptr pivot = right.begin_;
+      right.unlink_node(pivot);
+      join_trees(pivot, right);
     }
   }
+  template <class V>
+  void join(V&& pivot, rb_tree&& right) {
+    compact();
+    right.compact();
+    join_trees(create_node(std::forward<V>(pivot)), right);
+  }
+
+  /*
+   * Set operations with the tree other, which is left empty. The trees must
+   * have equal allocators. The nodes are relinked rather than copied: this
+   * tree ends up with its elements and the nodes that other contributes,
+   * and the other nodes are destroyed.
+   * They divide and conquer (Blelloch et al., "Just Join for Parallel Ordered
+   * Sets"): split one tree at the root of the other, recurse on both sides
+   * with ex, then join the results. For trees of m <= n elements that costs
+   * O(m log(n / m + 1)), and O(log^2 n) with unlimited parallelism.
+   * The allocator must be thread safe if ex runs tasks in parallel, which
+   * pool_allocator is not.
+   *
+   * set_union: add the elements of other without an equivalent in this tree
+   * set_intersection: keep the elements with an equivalent in other
+   * set_difference: remove the elements with an equivalent in other
+   */
+  template <class Executor = sequential_executor>
+  void set_union(rb_tree&& other, const Executor& ex = Executor());
+  template <class Executor = sequential_executor>
+  void set_intersection(rb_tree&& other, const Executor& ex = Executor());
+  template <class Executor = sequential_executor>
+  void set_difference(rb_tree&& other, const Executor& ex = Executor());
 
   iterator erase(const_iterator pos) {
     return erase_iter(pos.ptr_);
@@ -167,10 +909,27 @@ class rb_tree {
   size_type erase(const key_type& val) {
     return erase_unique(val);
   }
+  template <class K, class C = key_compare, class = typename C::is_transparent,
+            class = typename std::enable_if<
+                !std::is_convertible<K, const_iterator>::value>::type>
+  size_type erase(const K& val) {
+    return erase_unique(val);
+  }
   iterator erase(const_iterator first, const_iterator last) {
     return erase_range(first.ptr_, last.ptr_);
   }
 
+  /*
+   * Apply the operations of [first, last), batch_op<value_type> or anything
+   * with the same members, as if one after the other. Unless they are sorted
+   * by key already, they are stably sorted first, which keeps the order of
+   * the operations on the same key. Each operation then starts its finger
+   * search from the element of the previous one, so m operations on n
+   * elements take O(m log(n / m + 1)) instead of O(m log n).
+   */
+  template <class ForwardIterator>
+  void apply_batch(ForwardIterator first, ForwardIterator last);
+
   iterator begin() { return iterator(begin_); }
   const_iterator begin() const { return const_iterator(begin_); }
   iterator end() { return iterator(end_); }
@@ -185,51 +944,255 @@ class rb_tree {
   const_reverse_iterator crbegin() const {return const_reverse_iterator(end_);}
   const_reverse_iterator crend() const {return const_reverse_iterator(begin_);}
 
-  iterator lower_bound(const value_type& val) {
+  iterator lower_bound(const key_type& val) {
+    return lower_bound_unique(val);
+  }
+  const_iterator lower_bound(const key_type& val) const {
+    return lower_bound_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  iterator lower_bound(const K& val) {
     return lower_bound_unique(val);
   }
-  const_iterator lower_bound(const value_type& val) const {
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  const_iterator lower_bound(const K& val) const {
     return lower_bound_unique(val);
   }
-  iterator upper_bound(const value_type& val) {
+
+  iterator upper_bound(const key_type& val) {
+    return upper_bound_unique(val);
+  }
+  const_iterator upper_bound(const key_type& val) const {
+    return upper_bound_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  iterator upper_bound(const K& val) {
     return upper_bound_unique(val);
   }
-  const_iterator upper_bound(const value_type& val) const {
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  const_iterator upper_bound(const K& val) const {
     return upper_bound_unique(val);
   }
 
-  iterator find(const value_type& val) {
+  iterator find(const key_type& val) {
+    return find_unique(val);
+  }
+  const_iterator find(const key_type& val) const {
+    return find_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  iterator find(const K& val) {
     return find_unique(val);
   }
-  const_iterator find(const value_type& val) const {
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  const_iterator find(const K& val) const {
     return find_unique(val);
   }
 
-  std::pair<iterator, iterator> equal_range(const value_type& val) {
-    return equal_range_unique(val);
+  /*
+   * Finger search: start from the element at finger instead of the root,
+   * climbing up to the smallest subtree holding val before descending.
+   * Nearby keys are found in O(log d), d being the distance to finger, as
+   * long as finger and val do not sit on both sides of a subtree much larger
+   * than d, and in O(log n) at worst. A nearly sorted sequence of inserts
+   * from the last inserted element takes amortized O(1) per insert.
+   */
+  iterator finger_lower_bound(const_iterator finger, const key_type& val) {
+    return finger_lower_bound_unique(finger.ptr_, val);
   }
-  std::pair<const_iterator,const_iterator>
-  equal_range(const value_type& val) const {
-    return equal_range_unique(val);
+  const_iterator finger_lower_bound(const_iterator finger,
+                                    const key_type& val) const {
+    return finger_lower_bound_unique(finger.ptr_, val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  iterator finger_lower_bound(const_iterator finger, const K& val) {
+    return finger_lower_bound_unique(finger.ptr_, val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  const_iterator finger_lower_bound(const_iterator finger,
+                                    const K& val) const {
+    return finger_lower_bound_unique(finger.ptr_, val);
   }
 
-  size_type size() const { return size_; }
-  bool empty() const { return size_ == 0; }
-  void clear() noexcept { erase(begin(), end()); }
+  iterator finger_find(const_iterator finger, const key_type& val) {
+    return finger_find_unique(finger.ptr_, val);
+  }
+  const_iterator finger_find(const_iterator finger,
+                             const key_type& val) const {
+    return finger_find_unique(finger.ptr_, val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  iterator finger_find(const_iterator finger, const K& val) {
+    return finger_find_unique(finger.ptr_, val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  const_iterator finger_find(const_iterator finger, const K& val) const {
+    return finger_find_unique(finger.ptr_, val);
+  }
 
- protected:
-  template <class Pointer, class Reference>
+  /*
+   * Insert from finger, or from the last inserted element if it is still in
+   * the tree. Return the same as insert(val).
+   */
+  std::pair <iterator, bool> finger_insert(const_iterator finger,
+                                           const value_type& val) {
+    return insert_finger_unique(finger.ptr_, val);
+  }
+  std::pair <iterator, bool> finger_insert(const_iterator finger,
+                                           value_type&& val) {
+    return insert_finger_unique(finger.ptr_, std::move(val));
+  }
+  std::pair <iterator, bool> finger_insert(const value_type& val) {
+    return insert_finger_unique(finger_ != nil_ ? finger_ : end_, val);
+  }
+  std::pair <iterator, bool> finger_insert(value_type&& val) {
+    return insert_finger_unique(finger_ != nil_ ? finger_ : end_,
+                                std::move(val));
+  }
+
+  /*
+   * Look up all the keys in [first, last), writing the iterators found to
+   * out in the same order: the same as calling lower_bound() or find() on
+   * each key. The descents for a group of keys advance together one level
+   * at a time, prefetching the next nodes, so their cache misses overlap.
+   * Sorted keys skip the part of the descents shared by the whole batch.
+   */
+  template <class ForwardIterator, class OutputIterator>
+  OutputIterator lower_bound_batch(ForwardIterator first, ForwardIterator last,
+                                   OutputIterator out) const {
+    return lookup_batch(first, last, out, false);
+  }
+  template <class ForwardIterator, class OutputIterator>
+  OutputIterator find_batch(ForwardIterator first, ForwardIterator last,
+                            OutputIterator out) const {
+    return lookup_batch(first, last, out, true);
+  }
+
+  size_type count(const key_type& val) const {
+    return find_unique(val).ptr_ != end_ ? 1 : 0;
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  size_type count(const K& val) const {
+    return find_unique(val).ptr_ != end_ ? 1 : 0;
+  }
+
+  std::pair<iterator, iterator> equal_range(const key_type& val) {
+    return equal_range_unique(val);
+  }
+  std::pair<const_iterator,const_iterator>
+  equal_range(const key_type& val) const {
+    return equal_range_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  std::pair<iterator, iterator> equal_range(const K& val) {
+    return equal_range_unique(val);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  std::pair<const_iterator,const_iterator> equal_range(const K& val) const {
+    return equal_range_unique(val);
+  }
+
+  /*
+   * Descents using the metadata of an augmented tree.
+   *
+   * visit_pruned: visit the elements in order, skipping every subtree for
+   *               which prune(metadata) is true, until visit(value) returns
+   *               false. If the metadata bounds the subtree, e.g. the maximum
+   *               end point of intervals, the k matching elements are found
+   *               in O(min(n, k log n)).
+   * visit_less: cover the elements less than val with O(log n) pieces,
+   *             calling subtree(metadata) for whole subtrees and value(value)
+   *             for single elements, e.g. to sum up a prefix.
+   */
+  template <class Prune, class Visit>
+  void visit_pruned(Prune prune, Visit visit) const {
+    visit_pruned_sub_tree(root(), prune, visit);
+  }
+  template <class K, class Subtree, class Value>
+  void visit_less(const K& val, Subtree subtree, Value value) const {
+    visit_less_unique(val, subtree, value);
+  }
+
+  /*
+   * Order statistics in logarithmic time, only with order_statistics_augment.
+   * rank: number of elements less than val
+   * select: the element at index k in order, or end() if k >= size()
+   * index_of: number of elements before pos, so that the distance between
+   *           two iterators is the difference of their indexes
+   * count_range: number of elements in [lo, hi)
+   */
+  size_type rank(const key_type& val) const { return rank_unique(val); }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  size_type rank(const K& val) const { return rank_unique(val); }
+
+  iterator select(size_type k) { return select_unique(k); }
+  const_iterator select(size_type k) const { return select_unique(k); }
+
+  size_type index_of(const_iterator pos) const {
+    return index_of_node(pos.ptr_);
+  }
+
+  size_type count_range(const key_type& lo, const key_type& hi) const {
+    return count_range_unique(lo, hi);
+  }
+  template <class K, class C = key_compare, class = typename C::is_transparent>
+  size_type count_range(const K& lo, const K& hi) const {
+    return count_range_unique(lo, hi);
+  }
+
+  allocator_type get_allocator() const { return alloc_; }
+  key_compare key_comp() const { return comp_.comp; }
+  value_compare value_comp() const { return comp_; }
+
+  size_type size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  /*
+   * The statistics of the policy, which are empty unless it keeps them.
+   * A new or copied tree starts with none.
+   */
+  typedef typename Policy::stats stats_type;
+  const stats_type& stats() const { return this->counters(); }
+  void reset_stats() { this->counters().reset(); }
+
+  void clear() noexcept {
+    if (!release_nodes(typename rb_tree_releasable_allocator<
+                         node_allocator_type>::type()))
+      destroy_sub_tree(root());
+    end_->left = nil_;
+    end_->right = nil_;
+    begin_ = end_;
+    size_ = 0;
+    this->set_dead_count(0);
+    finger_ = nil_;
+  }
+
+  /*
+   * Destroy the tombstones and rebalance the live nodes in one O(n) pass,
+   * without allocation. The iterators to the live elements stay valid.
+   * With tombstones, erase() compacts the tree by itself once the dead
+   * nodes outnumber the live ones, and so do the operations that move
+   * nodes between trees: split(), join(), merge() and the set operations.
+   * The first and the last nodes are never dead, so begin() and --end()
+   * are still immediate; erasing either of them unlinks it for real.
+   */
+  void compact() { compact(tombstone_tag()); }
+
+ protected:
+  template <class Pointer, class Reference>
   class iterator_base : public std::iterator<std::bidirectional_iterator_tag,
                                         value_type,
                                         difference_type,
                                         Pointer,
                                         Reference> {
    public:
-    Reference operator*() const { return ptr_->value; }
+    Reference operator*() const { return value_of(ptr_); }
     Pointer operator->() const { return &(operator*()); }
 
     iterator_base& operator++() {
-      ptr_ = next_node(ptr_);
+      do
+        ptr_ = next_of(ptr_);
+      while (is_dead(ptr_));
       return *this;
     }
 
@@ -240,7 +1203,9 @@ class rb_tree {
     }
 
     iterator_base& operator--() {
-      ptr_ = prev_node(ptr_);
+      do
+        ptr_ = prev_of(ptr_);
+      while (is_dead(ptr_));
       return *this;
     }
 
@@ -250,11 +1215,11 @@ class rb_tree {
       return tmp;
     }
 
-    inline bool operator==(const iterator_base& y) {
+    inline bool operator==(const iterator_base& y) const {
       return this->ptr_ == y.ptr_;
     }
 
-    inline bool operator!=(const iterator_base& y) {
+    inline bool operator!=(const iterator_base& y) const {
       return !(this->ptr_ == y.ptr_);
     }
 
@@ -274,63 +1239,141 @@ class rb_tree {
 
   enum rb_tree_color { red_, black_ };
 
-  struct rb_tree_node {
+  /*
+   * A node without its value, which is all the end node needs. The links
+   * and node_ptr point to the base, and only the nodes holding a value are
+   * cast to rb_tree_node. The metadata is in the base, so that augmentations
+   * read it from the children without a cast.
+   * The nodes are only ever allocated, and their values constructed in place.
+   */
+  struct rb_tree_node_base
+    : rb_tree_node_links<rb_tree_node_base, rb_tree_color,
+                         Policy::packed_color>,
+      rb_tree_node_threads<rb_tree_node_base, Policy::threaded>,
+      rb_tree_node_metadata<typename Policy::augment>,
+      rb_tree_node_tombstone<Policy::tombstones> { };
+
+  struct rb_tree_node : rb_tree_node_base {
     value_type value;
-    rb_tree_color color;
-    node_ptr parent;
-    node_ptr left;
-    node_ptr right;
-
-    rb_tree_node() { }
-    rb_tree_node(const value_type& val) : value(val) { }
   }; // rb_tree_node
 
+  /* The full node of x, which must not be the end node */
+  static rb_tree_node *full_node(node_ptr x) {
+    return static_cast<rb_tree_node *>(x);
+  }
+  static value_type& value_of(node_ptr x) { return full_node(x)->value; }
+
+  static_assert(!Policy::packed_color || alignof(rb_tree_node) > 1,
+                "the lowest bit of a node address must be free for the color");
+
   typedef std::allocator_traits<allocator_type> alloc_traits;
   typedef typename alloc_traits::template rebind_traits<struct rb_tree_node>
     node_alloc_traits;
   typedef typename node_alloc_traits::allocator_type node_allocator_type;
-  allocator_type alloc_;
-  node_allocator_type node_alloc_;
+  RB_TREE_NO_UNIQUE_ADDRESS allocator_type alloc_;
+  RB_TREE_NO_UNIQUE_ADDRESS node_allocator_type node_alloc_;
 
-  value_compare comp_;
+  RB_TREE_NO_UNIQUE_ADDRESS value_compare comp_;
 
   /*
    * Both children of the end_ node point to the root node, and the parent
    * of the root node should always point to the end_ node.
    * Consequently, incrementing the rightmost node and decrementing the leftmost
    * node ends up with the end_ node.
+   * The end node has no value, so end_ is never cast to rb_tree_node.
    */
-  rb_tree_node end_node_;
+  rb_tree_node_base end_node_;
   node_ptr begin_;
   node_ptr end_;
   node_ptr root() const { return end_->left; }
   void set_root(node_ptr ptr) {
     end_->left = ptr;
     end_->right = ptr;
-    ptr->parent = end_;
+    ptr->set_parent(end_);
   }
 
   size_type size_;
 
+  /* The last inserted node, where finger_insert() starts, or nil_ */
+  node_ptr finger_;
+
   /* Allocate space for an empty node */
-  node_ptr create_node() { return node_alloc_traits::allocate(node_alloc_, 1); }
+  node_ptr allocate_node() {
+    return node_alloc_traits::allocate(node_alloc_, 1);
+  }
 
-  /* Allocate space for a node and construct the value */
-  node_ptr create_node(const value_type& val) {
-    node_ptr z = create_node();
-    alloc_traits::construct(alloc_, &z->value, val);
+  /* Allocate space for a node and construct the value in place */
+  template <class... Args>
+  node_ptr create_node(Args&&... args) {
+    node_ptr z = allocate_node();
+    try {
+      alloc_traits::construct(alloc_, &value_of(z), std::forward<Args>(args)...);
+    } catch (...) {
+      destroy_node(z, false);
+      throw;
+    }
+    z->set_parent_and_color(nil_, red_);
     z->left = nil_;
     z->right = nil_;
+    set_dead(z, false);
     return z;
   }
 
   /* Recycle the node. If the node has a constructed value, destruct it. */
   void destroy_node(node_ptr x, bool has_value = true) {
     if (has_value)
-      alloc_traits::destroy(alloc_, &x->value);
-    node_alloc_traits::deallocate(node_alloc_, x, 1);
+      alloc_traits::destroy(alloc_, &value_of(x));
+    node_alloc_traits::deallocate(node_alloc_, full_node(x), 1);
   }
 
+  /*
+   * Maintenance of the augmentation. They do nothing unless the policy has
+   * an augmentation.
+   */
+  typedef typename Policy::augment augment_type;
+  typedef std::integral_constant<bool,
+      !std::is_same<augment_type, no_augment>::value> augmented_tag;
+
+  /* Recalculate the metadata of x from its children */
+  static void update_node(node_ptr x) {
+    update_node(x, augmented_tag());
+  }
+  static void update_node(node_ptr, std::false_type) { }
+  static void update_node(node_ptr x, std::true_type) {
+    augment_type::update(full_node(x));
+  }
+
+  /* Copy the metadata of a node with an identical subtree */
+  static void copy_metadata(node_ptr dst, node_ptr src) {
+    copy_metadata(dst, src, augmented_tag());
+  }
+  static void copy_metadata(node_ptr, node_ptr, std::false_type) { }
+  static void copy_metadata(node_ptr dst, node_ptr src, std::true_type) {
+    dst->metadata = src->metadata;
+  }
+
+  /* Recalculate the metadata of x and all its ancestors */
+  void update_path(node_ptr x) {
+    update_path(x, augmented_tag());
+  }
+  void update_path(node_ptr, std::false_type) { }
+  void update_path(node_ptr x, std::true_type) {
+    for (; x != end_; x = x->parent())
+      augment_type::update(full_node(x));
+  }
+
+  typedef std::integral_constant<bool,
+      std::is_base_of<order_statistics_augment, augment_type>::value>
+    order_statistics_tag;
+
+  static size_type subtree_count(node_ptr x) {
+    return x == nil_ ? 0 : x->metadata;
+  }
+
+  /* Between nodes and iterators, for the front ends built on the tree */
+  static node_ptr node_of(const_iterator pos) { return pos.ptr_; }
+  static iterator_type iterator_of(node_ptr x) { return iterator_type(x); }
+
   static node_ptr min_node(node_ptr x) {
     while (x->left != nil_)
       x = x->left;
@@ -350,10 +1393,10 @@ class rb_tree {
         x = x->left;
       }
     } else {
-      node_ptr tmp = x->parent;
+      node_ptr tmp = x->parent();
       while (tmp->left != x) {
         x = tmp;
-        tmp = x->parent;
+        tmp = x->parent();
       }
       x = tmp;
     }
@@ -367,622 +1410,3044 @@ class rb_tree {
         x = x->right;
       }
     } else {
-      node_ptr tmp = x->parent;
+      node_ptr tmp = x->parent();
       while (tmp->right != x) {
         x = tmp;
-        tmp = x->parent;
+        tmp = x->parent();
       }
       x = tmp;
     }
     return x;
   }
 
-  void copy_tree(const rb_tree& other);
-  void copy_sub_tree(node_ptr src, node_ptr dst);
-
-  void move_tree(rb_tree& other) noexcept;
-
-  std::pair <iterator_type, bool> insert_unique(const value_type& val);
-  iterator_type insert_unique(node_ptr pos, const value_type& val);
-  iterator_type erase_iter(node_ptr pos);
-  iterator_type erase_range(node_ptr first, node_ptr last);
-  size_type erase_unique(const value_type& val);
-
-  void left_rotate(node_ptr x);
-  void right_rotate(node_ptr x);
-  void transplant(node_ptr u, node_ptr v);
-  void erase_node(node_ptr z);
+  /*
+   * Maintenance of the threads. next_of() and prev_of() step through them
+   * when the policy keeps them, and through the tree otherwise; the other
+   * functions do nothing unless it does. The threads are only valid between
+   * the operations, and next_node() is the way to walk a tree while it is
+   * being rebuilt.
+   */
+  typedef std::integral_constant<bool, Policy::threaded> threaded_tag;
 
-  void insert_fixup(node_ptr z);
-  void erase_fixup(node_ptr x, node_ptr xparent);
+  static node_ptr next_of(node_ptr x) { return next_of(x, threaded_tag()); }
+  static node_ptr next_of(node_ptr x, std::false_type) { return next_node(x); }
+  static node_ptr next_of(node_ptr x, std::true_type) { return x->next; }
 
-  iterator_type lower_bound_unique(const key_type& val);
-  iterator_type upper_bound_unique(const key_type& val);
-  iterator_type find_unique(const key_type& val);
+  static node_ptr prev_of(node_ptr x) { return prev_of(x, threaded_tag()); }
+  static node_ptr prev_of(node_ptr x, std::false_type) { return prev_node(x); }
+  static node_ptr prev_of(node_ptr x, std::true_type) { return x->prev; }
 
-  std::pair<iterator_type, iterator_type>
-  equal_range_unique(const key_type& val);
+  /* Make b follow a, where either can be end_ */
+  static void thread_nodes(node_ptr a, node_ptr b) {
+    thread_nodes(a, b, threaded_tag());
+  }
+  static void thread_nodes(node_ptr, node_ptr, std::false_type) { }
+  static void thread_nodes(node_ptr a, node_ptr b, std::true_type) {
+    a->next = b;
+    b->prev = a;
+  }
 
-};
+  /* Thread all the nodes again, after the tree was rebuilt, in O(n) */
+  void thread_tree() { thread_tree(threaded_tag()); }
+  void thread_tree(std::false_type) { }
+  void thread_tree(std::true_type) {
+    node_ptr prev = end_;
+    for (node_ptr x = begin_; x != end_; x = next_node(x)) {
+      thread_nodes(prev, x);
+      prev = x;
+    }
+    thread_nodes(prev, end_);
+  }
 
-template <class T, class C, class A>
-void rb_tree<T, C, A>::copy_tree(const rb_tree& other) {
-  size_ = other.size_;
+  /* Thread the new leaf z, the left or right child of parent */
+  void thread_leaf(node_ptr z, node_ptr parent, bool left) {
+    thread_leaf(z, parent, left, threaded_tag());
+  }
+  void thread_leaf(node_ptr, node_ptr, bool, std::false_type) { }
+  void thread_leaf(node_ptr z, node_ptr parent, bool left, std::true_type) {
+    if (parent == end_) {
+      thread_nodes(end_, z);
+      thread_nodes(z, end_);
+    } else if (left) {
+      thread_nodes(parent->prev, z);
+      thread_nodes(z, parent);
+    } else {
+      thread_nodes(z, parent->next);
+      thread_nodes(parent, z);
+    }
+  }
 
-  end_ = &end_node_;
-  end_->parent = end_;
-  end_->color = black_;
+  /* Join the neighbours of the node z, or of the nodes [first, last) */
+  static void unthread(node_ptr z) { unthread(z, threaded_tag()); }
+  static void unthread(node_ptr, std::false_type) { }
+  static void unthread(node_ptr z, std::true_type) {
+    thread_nodes(z->prev, z->next);
+  }
+  static void unthread(node_ptr first, node_ptr last) {
+    unthread(first, last, threaded_tag());
+  }
+  static void unthread(node_ptr, node_ptr, std::false_type) { }
+  static void unthread(node_ptr first, node_ptr last, std::true_type) {
+    thread_nodes(first->prev, last);
+  }
 
-  /* root */
-  if (other.root() != nil_) {
-    set_root(create_node(other.root()->value));
-    root()->color = other.root()->color;
-    copy_sub_tree(other.root(), root());
-  } else {
-    end_->left = nil_;
-    end_->right = nil_;
+  /* Hand the threads of the nodes of other, about to move here, to end_ */
+  void thread_moved(rb_tree& other) { thread_moved(other, threaded_tag()); }
+  void thread_moved(rb_tree&, std::false_type) { }
+  void thread_moved(rb_tree& other, std::true_type) {
+    if (other.size_ != 0) {
+      thread_nodes(other.end_->prev, end_);
+      thread_nodes(end_, other.begin_);
+    }
   }
 
-  begin_ = min_node(root());
+  /* Thread pivot and the nodes of right after those of this tree */
+  void thread_join(node_ptr pivot, rb_tree& right) {
+    thread_join(pivot, right, threaded_tag());
+  }
+  void thread_join(node_ptr, rb_tree&, std::false_type) { }
+  void thread_join(node_ptr pivot, rb_tree& right, std::true_type) {
+    thread_nodes(size_ != 0 ? end_->prev : end_, pivot);
+    if (right.size_ != 0) {
+      thread_nodes(right.end_->prev, end_);
+      thread_nodes(pivot, right.begin_);
+    } else {
+      thread_nodes(pivot, end_);
+    }
+  }
 
-}
+  /* Thread the nodes from x, which split() moves to right, there */
+  void thread_split(node_ptr x, rb_tree& right) {
+    thread_split(x, right, threaded_tag());
+  }
+  void thread_split(node_ptr, rb_tree&, std::false_type) { }
+  void thread_split(node_ptr x, rb_tree& right, std::true_type) {
+    node_ptr last = end_->prev;
+    thread_nodes(x->prev, end_);
+    thread_nodes(right.end_, x);
+    thread_nodes(last, right.end_);
+  }
 
-template <class T, class C, class A>
-void rb_tree<T, C, A>::copy_sub_tree(node_ptr src, node_ptr dst) {
   /*
-   * assume src != nil_
-   * and dst has been constructed
+   * Maintenance of the tombstones, which do nothing unless the policy keeps
+   * them. A dead node keeps its value, since the descents still compare with
+   * it, until it is revived or destroyed. size_ only counts the live nodes.
    */
-  if (src->left != nil_) {
-    dst->left = create_node(src->left->value);
-    dst->left->color = src->left->color;
-    dst->left->parent = dst;
-    copy_sub_tree(src->left, dst->left);
-  } else {
-    dst->left = nil_;
-  }
-
-  if (src->right != nil_) {
-    dst->right = create_node(src->right->value);
-    dst->right->color = src->right->color;
-    dst->right->parent = dst;
-    copy_sub_tree(src->right, dst->right);
-  } else {
-    dst->right = nil_;
-  }
+  typedef std::integral_constant<bool, Policy::tombstones> tombstone_tag;
 
-}
+  static_assert(!Policy::tombstones || !augmented_tag::value,
+                "the metadata of an augmented tree would count tombstones");
 
-template <class T, class C, class A>
-void rb_tree<T, C, A>::move_tree(rb_tree& other) noexcept {
-  end_->left = other.root();
-  end_->right = other.root();
+  static bool is_dead(node_ptr x) { return is_dead(x, tombstone_tag()); }
+  static bool is_dead(node_ptr, std::false_type) { return false; }
+  static bool is_dead(node_ptr x, std::true_type) { return x->dead; }
 
-  if (root() != nil_)
-    root()->parent = end_;
+  static void set_dead(node_ptr x, bool dead) {
+    set_dead(x, dead, tombstone_tag());
+  }
+  static void set_dead(node_ptr, bool, std::false_type) { }
+  static void set_dead(node_ptr x, bool dead, std::true_type) {
+    x->dead = dead;
+  }
 
-  begin_ = other.begin_;
-  size_ = other.size_;
+  /* The first live node from x on, for the lookups */
+  static node_ptr skip_dead(node_ptr x) {
+    while (is_dead(x))
+      x = next_of(x);
+    return x;
+  }
 
-  other.end_->left = nil_;
-  other.end_->right = nil_;
-  other.begin_ = other.end_;
-  other.size_ = 0;
-}
+  /* Unlink and destroy the tombstone z */
+  void purge_node(node_ptr z, bool has_value = true) {
+    ++size_;
+    unlink_node(z);
+    destroy_node(z, has_value);
+    this->set_dead_count(this->dead_count() - 1);
+  }
 
-template <class T, class C, class A>
-std::pair <typename rb_tree<T, C, A>::iterator_type, bool>
-rb_tree<T, C, A>::insert_unique(const value_type& val) {
-  node_ptr x = root();
-  node_ptr y = end_;
+  void bury_node(node_ptr z);
+  void trim_tombstones() { trim_tombstones(tombstone_tag()); }
+  void trim_tombstones(std::false_type) { }
+  void trim_tombstones(std::true_type);
+  void compact(std::false_type) { }
+  void compact(std::true_type);
+  void flatten_live(node_ptr x, node_ptr*& tail) noexcept;
+  node_ptr relink_sub_tree(node_ptr& list, size_type n, node_ptr parent,
+                           size_type depth, size_type red_depth);
+
+  /* Node generators for copy_tree, making a node holding a copy of a value */
+  class node_creator {
+   public:
+    explicit node_creator(rb_tree& tree) : tree_(tree) { }
 
-  bool comp = true;
+    node_ptr operator()(const value_type& val) {
+      return tree_.create_node(val);
+    }
 
-  while (x != nil_) {
-    y = x;
-    comp = comp_(val, x->value);
-    x = comp ? x->left : x->right;
-  }
+   private:
+    rb_tree& tree_;
+  }; // node_creator
 
-  node_ptr j = y;
-  if (comp) {
-    /* left */
+  /*
+   * Take all the nodes away from a tree, and hand them out again one by one,
+   * leaves first, with their values replaced. Nodes are only allocated once
+   * all the old ones are used up, and the remaining ones are destroyed along
+   * with the recycler.
+   */
+  class node_recycler {
+   public:
+    explicit node_recycler(rb_tree& tree)
+      : tree_(tree), root_(tree.root()),
+        size_(tree.size_ + tree.dead_count()) {
+      if (root_ != nil_)
+        root_->set_parent(nil_);
+      next_ = leaf_below(root_);
+
+      tree_.end_->left = nil_;
+      tree_.end_->right = nil_;
+      tree_.begin_ = tree_.end_;
+      tree_.size_ = 0;
+      tree_.set_dead_count(0);
+      tree_.finger_ = nil_;
+    }
 
-    if (y == end_) {
-      /* root */
-      node_ptr z = create_node(val);
-      ++size_;
+    node_recycler(const node_recycler&) = delete;
+    node_recycler& operator=(const node_recycler&) = delete;
 
-      begin_ = z;
-      set_root(z);
+    ~node_recycler() { tree_.destroy_sub_tree(root_); }
 
-      insert_fixup(z);
-      return std::pair<iterator_type, bool>(z, true);
-    } else if (y == begin_) {
-      /* begin */
-      node_ptr z = create_node(val);
-      ++size_;
+    /* The number of nodes left */
+    size_type size() const { return size_; }
 
-      begin_ = z;
-      y->left = z;
-      z->parent = y;
+    node_ptr operator()(const value_type& val) {
+      node_ptr x = take();
+      if (x == nil_)
+        return tree_.create_node(val);
 
-      insert_fixup(z);
-      return std::pair<iterator_type, bool>(z, true);
-    } else {
-      /* decrement j */
-      node_ptr tmp = j->parent;
-      while (j != tmp->right) {
-        j = tmp;
-        tmp = j->parent;
+      alloc_traits::destroy(tree_.alloc_, &value_of(x));
+      try {
+        alloc_traits::construct(tree_.alloc_, &value_of(x), val);
+      } catch (...) {
+        tree_.destroy_node(x, false);
+        throw;
       }
-      j = tmp;
-
-      if (comp_(j->value, val)) {
-        node_ptr z = create_node(val);
-        ++size_;
+      x->left = nil_;
+      x->right = nil_;
+      return x;
+    }
 
-        y->left = z;
-        z->parent = y;
+   private:
+    rb_tree& tree_;
+    node_ptr root_;
+    node_ptr next_;
+    size_type size_;
+
+    static node_ptr leaf_below(node_ptr x) {
+      if (x == nil_)
+        return nil_;
+      while (x->left != nil_ || x->right != nil_)
+        x = x->left != nil_ ? x->left : x->right;
+      return x;
+    }
 
-        insert_fixup(z);
-        return std::pair<iterator_type, bool>(z, true);
+    /*
+     * Detach the next leaf. Every node is passed on the way down to a leaf
+     * only once, so handing out all the nodes takes O(n).
+     */
+    node_ptr take() {
+      node_ptr x = next_;
+      if (x == nil_)
+        return nil_;
+
+      node_ptr p = x->parent();
+      if (p == nil_) {
+        root_ = nil_;
+      } else if (p->left == x) {
+        p->left = nil_;
       } else {
-        /* duplicate */
-        return std::pair<iterator_type, bool>(j, false);
+        p->right = nil_;
       }
+      next_ = leaf_below(p);
+      --size_;
+      return x;
     }
-  } else {
-    /* right */
-
-    if (comp_(j->value, val)) {
-      node_ptr z = create_node(val);
-      ++size_;
+  }; // node_recycler
+
+  template <class NodeGen>
+  void copy_tree(const rb_tree& other, NodeGen& gen);
+  template <class NodeGen>
+  node_ptr copy_sub_tree(node_ptr src, node_ptr parent, NodeGen& gen);
+  template <class NodeGen>
+  node_ptr clone_node(node_ptr src, node_ptr parent, NodeGen& gen) {
+    node_ptr z = gen(value_of(src));
+    z->set_parent_and_color(parent, src->color());
+    copy_metadata(z, src);
+    set_dead(z, is_dead(src));
+    return z;
+  }
 
-      y->right = z;
-      z->parent = y;
+  void move_tree(rb_tree& other) noexcept;
+  void move_values(rb_tree& other);
+  void move_assign(rb_tree& other, std::true_type) noexcept;
+  void move_assign(rb_tree& other, std::false_type);
 
-      insert_fixup(z);
-      return std::pair<iterator_type, bool>(z, true);
-    } else {
-      /* duplicate */
-      return std::pair<iterator_type, bool>(j, false);
-    }
+  void reserve_nodes(size_type n) {
+    reserve_nodes(n, typename rb_tree_reservable_allocator<
+                       node_allocator_type>::type());
   }
+  void reserve_nodes(size_type n, std::true_type) { node_alloc_.reserve(n); }
+  void reserve_nodes(size_type, std::false_type) { }
 
-}
-
-/*
- * insert function with a hint iterator
- * If the hint is correct, the insertion can be done in constant time.
- * Otherwise, call the basic insert function.
- * According to C++11, the hint iterator follows the element being inserted.
- */
-template <class T, class C, class A>
-typename rb_tree<T, C, A>::iterator_type
-rb_tree<T, C, A>::insert_unique(node_ptr pos, const value_type& val) {
-  if (pos == end_) {
-    if (pos == begin_) {
-      /* root */
-      node_ptr z = create_node(val);
-      ++size_;
+  bool release_nodes(std::true_type) noexcept;
+  bool release_nodes(std::false_type) noexcept { return false; }
+  void destroy_values(node_ptr, std::true_type) noexcept { }
+  void destroy_values(node_ptr x, std::false_type) noexcept;
 
-      begin_ = z;
-      set_root(z);
+  template <class InputIterator>
+  void insert_range(InputIterator first, InputIterator last,
+                    std::input_iterator_tag);
+  template <class ForwardIterator>
+  void insert_range(ForwardIterator first, ForwardIterator last,
+                    std::forward_iterator_tag);
+  template <class InputIterator>
+  void insert_sorted_range(InputIterator first, InputIterator last,
+                           std::input_iterator_tag);
+  template <class ForwardIterator>
+  void insert_sorted_range(ForwardIterator first, ForwardIterator last,
+                           std::forward_iterator_tag);
+  template <class InputIterator>
+  void insert_hinted(InputIterator first, InputIterator last);
+
+  template <class ForwardIterator>
+  void build_tree(ForwardIterator first, size_type n);
+  template <class ForwardIterator>
+  node_ptr build_sub_tree(ForwardIterator& it, size_type n, node_ptr parent,
+                          size_type depth, size_type red_depth);
+  template <class RandomAccessIterator, class Executor>
+  node_ptr build_sub_tree(RandomAccessIterator first, size_type n,
+                          node_ptr parent, size_type depth,
+                          size_type red_depth, const Executor& ex);
+  static size_type red_depth(size_type n);
+
+  size_type destroy_sub_tree(node_ptr x) noexcept;
+
+  static size_type black_height(node_ptr x);
+  void reset_root(node_ptr x);
+  node_ptr join_sub_trees(node_ptr l, size_type lh, node_ptr k,
+                          node_ptr r, size_type rh, size_type& h);
+  void split_at(node_ptr x, node_ptr& l, size_type& lh,
+                node_ptr& r, size_type& rh);
+  void join_trees(node_ptr pivot, rb_tree& right);
+  template <class K>
+  rb_tree split_unique(const K& val);
+  void split_sizes(rb_tree& other, size_type n);
+  void split_sizes(rb_tree& other, size_type n, std::false_type);
+  void split_sizes(rb_tree& other, size_type n, std::true_type);
 
-      insert_fixup(z);
-      return iterator_type(z);
-    } else {
-      node_ptr prev = prev_node(pos);
+  /*
+   * The parallel algorithms fork below subtrees of at least this black
+   * height, i.e. of 2^parallel_height - 1 nodes or more, and the parallel
+   * build below ranges of parallel_size elements or more
+   */
+  static constexpr size_type parallel_height = 10;
+  static constexpr size_type parallel_size = size_type(1) << 12;
+
+  void drop_nodes() noexcept;
+  template <class Executor, class Left, class Right>
+  void fork_sub_trees(bool parallel, const Executor& ex,
+                      Left left, Right right);
+  void finish_set_operation(node_ptr t, size_type n) noexcept;
+  template <class K>
+  node_ptr split_sub_tree(node_ptr t, size_type th, const K& val,
+                          node_ptr& l, size_type& lh,
+                          node_ptr& r, size_type& rh);
+  node_ptr concat_sub_trees(node_ptr l, size_type lh, node_ptr r, size_type rh,
+                          size_type& h);
+  template <class Executor>
+  node_ptr union_sub_trees(node_ptr a, size_type ah, node_ptr b,
+                           size_type bh, const Executor& ex, size_type& h,
+                           size_type& dups);
+  template <class Executor>
+  node_ptr intersect_sub_trees(node_ptr a, size_type ah, node_ptr b,
+                               size_type bh, const Executor& ex,
+                               size_type& h, size_type& kept);
+  template <class Executor>
+  node_ptr subtract_sub_trees(node_ptr a, size_type ah, node_ptr b,
+                              size_type bh, const Executor& ex, size_type& h,
+                              size_type& removed);
 
-      if (comp_(prev->value, val)) {
-        /* prev < val, correct hint
-         * The rightmost node should not have a right child, so making the new
-         * node as the right child would be safe. */
-        node_ptr z = create_node(val);
-        ++size_;
+  /*
+   * Where to link a new node: as the left or the right child of node, or
+   * nowhere if node is a duplicate of the new value.
+   */
+  struct insert_pos {
+    node_ptr node;
+    bool left;
+    bool unique;
 
-        prev->right = z;
-        z->parent = prev;
+    insert_pos(node_ptr n, bool l, bool u) : node(n), left(l), unique(u) { }
+  };
 
-        insert_fixup(z);
-        return iterator_type(z);
-      } else {
-        /* incorrect hint */
-        return insert_unique(val).first;
-      }
-    }
-  } else if (pos == begin_) {
-    if (comp_(val, pos->value)) {
-      /* begin */
-      node_ptr z = create_node(val);
-      ++size_;
+  /*
+   * The positions are found from a value or from a key alone, e.g. for
+   * try_emplace() in rb_map
+   */
+  template <class K>
+  insert_pos get_insert_unique_pos(const K& val) {
+    return get_insert_unique_pos(root(), end_, true, val);
+  }
+  template <class K>
+  insert_pos get_insert_unique_pos(node_ptr x, node_ptr y, bool comp,
+                                   const K& val);
+  template <class K>
+  insert_pos get_insert_hint_unique_pos(node_ptr pos, const K& val);
+  template <class K>
+  insert_pos get_insert_finger_unique_pos(node_ptr finger, const K& val);
+  node_ptr link_node(node_ptr z, node_ptr parent, bool left);
 
-      begin_->left = z;
-      z->parent = begin_;
-      begin_ = z;
+  /*
+   * Whether pos is an element equivalent to the new one. Otherwise it is
+   * either the place of a new node or a tombstone to revive.
+   */
+  static bool is_duplicate(const insert_pos& pos) {
+    return !pos.unique && !is_dead(pos.node);
+  }
 
-      insert_fixup(z);
-      return iterator_type(z);
-    } else {
-      /* incorrect hint */
-      return insert_unique(val).first;
+  /*
+   * Make the element at pos with args: link a new node, or construct the
+   * value again in the tombstone. A tombstone whose value throws is gone.
+   */
+  template <class... Args>
+  node_ptr emplace_at(const insert_pos& pos, Args&&... args) {
+    if (pos.unique)
+      return link_node(create_node(std::forward<Args>(args)...), pos.node,
+                       pos.left);
+
+    node_ptr z = pos.node;
+    alloc_traits::destroy(alloc_, &value_of(z));
+    try {
+      alloc_traits::construct(alloc_, &value_of(z), std::forward<Args>(args)...);
+    } catch (...) {
+      purge_node(z, false);
+      throw;
     }
-  } else {
-    node_ptr prev = prev_node(pos);
+    set_dead(z, false);
+    this->set_dead_count(this->dead_count() - 1);
+    ++size_;
+    finger_ = z;
+    return z;
+  }
 
-    if (comp_(prev->value, val) && comp_(val, pos->value)) {
-      /* prev < val < pos, correct hint */
-      if (prev->right == nil_) {
-        /* prev has no right child */
-        node_ptr z = create_node(val);
-        ++size_;
+  template <class V>
+  std::pair <iterator_type, bool> insert_unique(V&& val);
+  template <class V>
+  iterator_type insert_unique(node_ptr hint, V&& val);
+  template <class V>
+  std::pair <iterator_type, bool> insert_finger_unique(node_ptr finger,
+                                                       V&& val);
+  template <class... Args>
+  std::pair <iterator_type, bool> emplace_unique(Args&&... args);
+  template <class... Args>
+  iterator_type emplace_hint_unique(node_ptr hint, Args&&... args);
 
-        prev->right = z;
-        z->parent = prev;
+  /*
+   * A value_type can be compared before the node is created, so emplacing it
+   * is the same as inserting it.
+   */
+  template <class V, class = typename std::enable_if<std::is_same<
+      typename std::decay<V>::type, value_type>::value>::type>
+  std::pair <iterator_type, bool> emplace_unique(V&& val) {
+    return insert_unique(std::forward<V>(val));
+  }
+  template <class V, class = typename std::enable_if<std::is_same<
+      typename std::decay<V>::type, value_type>::value>::type>
+  iterator_type emplace_hint_unique(node_ptr hint, V&& val) {
+    return insert_unique(hint, std::forward<V>(val));
+  }
+  iterator_type erase_iter(node_ptr pos);
+  iterator_type erase_range(node_ptr first, node_ptr last);
+  template <class Op>
+  node_ptr apply_op(node_ptr finger, const Op& op);
+  template <class K>
+  size_type erase_unique(const K& val);
 
-        insert_fixup(z);
-        return iterator_type(z);
-      } else {
-        /* prev has a right child, then the left child of pos is nil */
-        node_ptr z = create_node(val);
-        ++size_;
+  void left_rotate(node_ptr x);
+  void right_rotate(node_ptr x);
+  void transplant(node_ptr u, node_ptr v);
+  void unlink_node(node_ptr z);
+  void erase_node(node_ptr z);
 
-        pos->left = z;
-        z->parent = pos;
+  insert_return_type insert_node_unique(node_type&& nh);
+  iterator_type insert_node_unique(node_ptr hint, node_type&& nh);
 
-        insert_fixup(z);
-        return iterator_type(z);
-      }
-    } else {
-      /* incorrect hint */
-      return insert_unique(val).first;
-    }
+  /*
+   * The equal versions, for the trees with equivalent elements like
+   * rb_multiset. A new element goes after its equivalent ones.
+   */
+  template <class K>
+  insert_pos get_insert_equal_pos(const K& val);
+  template <class K>
+  insert_pos get_insert_equal_lower_pos(const K& val);
+  template <class K>
+  insert_pos get_insert_hint_equal_pos(node_ptr pos, const K& val);
+  template <class V>
+  iterator_type insert_equal(V&& val);
+  template <class V>
+  iterator_type insert_equal(node_ptr hint, V&& val);
+  template <class... Args>
+  iterator_type emplace_equal(Args&&... args);
+  template <class... Args>
+  iterator_type emplace_hint_equal(node_ptr hint, Args&&... args);
+  template <class InputIterator>
+  void insert_range_equal(InputIterator first, InputIterator last,
+                          std::input_iterator_tag);
+  template <class ForwardIterator>
+  void insert_range_equal(ForwardIterator first, ForwardIterator last,
+                          std::forward_iterator_tag);
+  template <class InputIterator>
+  void insert_hinted_equal(InputIterator first, InputIterator last);
+  iterator_type insert_node_equal(node_type&& nh);
+  iterator_type insert_node_equal(node_ptr hint, node_type&& nh);
+  void merge_equal(rb_tree& source);
+  template <class K>
+  std::pair<iterator_type, iterator_type>
+  equal_range_equal(const K& val) const;
+  template <class K>
+  size_type count_equal(const K& val) const;
+  size_type count_nodes(node_ptr first, node_ptr last, std::true_type) const {
+    return index_of_node(last) - index_of_node(first);
   }
-}
+  size_type count_nodes(node_ptr first, node_ptr last, std::false_type) const {
+    return static_cast<size_type>(
+        std::distance(iterator_type(first), iterator_type(last)));
+  }
+  template <class K>
+  size_type erase_equal(const K& val);
+  template <class K>
+  node_type extract_unique(const K& val);
 
-/*
- * Return the iterator that follows the erased one
- */
-template <class T, class C, class A>
-typename rb_tree<T, C, A>::iterator_type
-rb_tree<T, C, A>::erase_iter(node_ptr pos) {
-  if (pos == end_)
-    return iterator_type(end_);
+  bool insert_fixup(node_ptr z);
+  void erase_fixup(node_ptr x, node_ptr xparent);
 
-  iterator_type next(pos);
-  ++next;
+  /*
+   * The lookups take any type K comparable with the values through the
+   * comparator. Unless the comparator is transparent, K is key_type.
+   */
+  typedef rb_tree_branchless_search<key_type, key_compare> branchless_tag;
+  template <class K>
+  iterator_type lower_bound_unique(const K& val) const {
+    return lower_bound_unique(val, branchless_tag());
+  }
+  template <class K>
+  iterator_type lower_bound_unique(const K& val, std::false_type) const;
+  template <class K>
+  iterator_type lower_bound_unique(const K& val, std::true_type) const;
+  template <class K>
+  iterator_type upper_bound_unique(const K& val) const {
+    return upper_bound_unique(val, branchless_tag());
+  }
+  template <class K>
+  iterator_type upper_bound_unique(const K& val, std::false_type) const;
+  template <class K>
+  iterator_type upper_bound_unique(const K& val, std::true_type) const;
+  template <class K>
+  iterator_type find_unique(const K& val) const;
+  template <class K>
+  node_ptr finger_climb(node_ptr x, const K& val, bool& above) const;
+  template <class K>
+  iterator_type finger_lower_bound_unique(node_ptr finger,
+                                          const K& val) const;
+  template <class K>
+  iterator_type finger_find_unique(node_ptr finger, const K& val) const;
+
+  /* The number of descents advancing together in lookup_batch() */
+  static constexpr int batch_width = 16;
+
+  template <class ForwardIterator, class OutputIterator>
+  OutputIterator lookup_batch(ForwardIterator first, ForwardIterator last,
+                              OutputIterator out, bool find) const;
+
+  template <class K>
+  std::pair<iterator_type, iterator_type>
+  equal_range_unique(const K& val) const;
 
-  erase_node(pos);
+  template <class Prune, class Visit>
+  static bool visit_pruned_sub_tree(node_ptr x, Prune& prune, Visit& visit);
+  template <class K, class Subtree, class Value>
+  void visit_less_unique(const K& val, Subtree& subtree, Value& value) const;
 
-  return next;
-}
+  template <class K>
+  size_type rank_unique(const K& val) const;
+  iterator_type select_unique(size_type k) const;
+  size_type index_of_node(node_ptr x) const;
+  template <class K>
+  size_type count_range_unique(const K& lo, const K& hi) const;
+
+};
 
 /*
- * Erase the range [first, last)
+ * Copy the nodes of other into this empty tree, with the nodes made by gen,
+ * leaving this tree empty if a copy throws. The tombstones are copied too,
+ * to keep the shape of the tree.
+ */
+template <class T, class C, class A, class P>
+template <class NodeGen>
+void rb_tree<T, C, A, P>::copy_tree(const rb_tree& other, NodeGen& gen) {
+  if (other.root() == nil_)
+    return;
+
+  set_root(copy_sub_tree(other.root(), end_, gen));
+  size_ = other.size_;
+  this->set_dead_count(other.dead_count());
+  begin_ = min_node(root());
+  thread_tree();
+}
+
+/*
+ * Copy the subtree of src in pre-order, without recursion: the left spines
+ * are copied in a loop, and the nodes on them with a right subtree left to
+ * copy are kept on a stack, at most as deep as the tree.
+ * The nodes are made in the order they are visited, and their metadata are
+ * copied, since the subtrees are the same.
+ * Return the root of the copy, or destroy the partial copy and rethrow
+ */
+template <class T, class C, class A, class P>
+template <class NodeGen>
+typename rb_tree<T, C, A, P>::node_ptr
+rb_tree<T, C, A, P>::copy_sub_tree(node_ptr src, node_ptr parent,
+                                   NodeGen& gen) {
+  /* the height of a red-black tree is at most 2 * log2(n + 1) */
+  const int max_height = 2 * std::numeric_limits<size_type>::digits;
+  node_ptr src_stack[max_height];
+  node_ptr dst_stack[max_height];
+  int top = 0;
+
+  node_ptr root = clone_node(src, parent, gen);
+  node_ptr x = src;
+  node_ptr y = root;
+
+  try {
+    for (;;) {
+      for (;;) {
+        if (x->right != nil_) {
+          src_stack[top] = x;
+          dst_stack[top] = y;
+          ++top;
+        }
+        if (x->left == nil_)
+          break;
+        y->left = clone_node(x->left, y, gen);
+        x = x->left;
+        y = y->left;
+      }
+
+      if (top == 0)
+        return root;
+
+      --top;
+      x = src_stack[top];
+      y = dst_stack[top];
+      y->right = clone_node(x->right, y, gen);
+      x = x->right;
+      y = y->right;
+    }
+  } catch (...) {
+    destroy_sub_tree(root);
+    throw;
+  }
+}
+
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::move_tree(rb_tree& other) noexcept {
+  thread_moved(other);
+  end_->left = other.root();
+  end_->right = other.root();
+
+  if (root() != nil_) {
+    root()->set_parent(end_);
+    begin_ = other.begin_;
+  } else {
+    begin_ = end_;
+  }
+  size_ = other.size_;
+  this->set_dead_count(other.dead_count());
+  finger_ = other.finger_;
+
+  other.end_->left = nil_;
+  other.end_->right = nil_;
+  other.begin_ = other.end_;
+  other.size_ = 0;
+  other.set_dead_count(0);
+  other.finger_ = nil_;
+}
+
+/*
+ * A single pass input range cannot be checked for sortedness before it is
+ * consumed, so insert every element with the hint following the previously
+ * inserted one. That is constant time per element for sorted input.
+ */
+template <class T, class C, class A, class P>
+template <class InputIterator>
+void rb_tree<T, C, A, P>::insert_range(InputIterator first, InputIterator last,
+                                    std::input_iterator_tag) {
+  insert_hinted(first, last);
+}
+
+/*
+ * If the tree is empty and the range is strictly increasing, build the tree
+ * directly in linear time. Otherwise fall back to the hinted insertion.
+ */
+template <class T, class C, class A, class P>
+template <class ForwardIterator>
+void rb_tree<T, C, A, P>::insert_range(ForwardIterator first,
+                                    ForwardIterator last,
+                                    std::forward_iterator_tag) {
+  if (size_ != 0 || first == last) {
+    insert_hinted(first, last);
+    return;
+  }
+
+  size_type n = 1;
+  ForwardIterator prev = first;
+  ForwardIterator it = first;
+  for (++it; it != last; ++it, ++prev, ++n) {
+    if (!comp_(*prev, *it)) {
+      insert_hinted(first, last);
+      return;
+    }
+  }
+
+  build_tree(first, n);
+}
+
+template <class T, class C, class A, class P>
+template <class InputIterator>
+void rb_tree<T, C, A, P>::insert_sorted_range(InputIterator first,
+                                           InputIterator last,
+                                           std::input_iterator_tag) {
+  insert_hinted(first, last);
+}
+
+template <class T, class C, class A, class P>
+template <class ForwardIterator>
+void rb_tree<T, C, A, P>::insert_sorted_range(ForwardIterator first,
+                                           ForwardIterator last,
+                                           std::forward_iterator_tag) {
+  if (size_ != 0) {
+    insert_hinted(first, last);
+    return;
+  }
+
+  size_type n = static_cast<size_type>(std::distance(first, last));
+  if (n != 0)
+    build_tree(first, n);
+}
+
+template <class T, class C, class A, class P>
+template <class InputIterator>
+void rb_tree<T, C, A, P>::insert_hinted(InputIterator first,
+                                     InputIterator last) {
+  node_ptr hint = end_;
+  for (InputIterator it = first; it != last; ++it) {
+    hint = next_of(insert_unique(hint, *it).ptr_);
+  }
+}
+
+/*
+ * Build the tree from n sorted elements, assuming the tree is empty.
+ * Every subtree is split at the middle, so all the nil leaves are either at
+ * the depth floor(log2(n)) or one level deeper. Coloring the nodes at the
+ * deepest level red and the others black gives a valid red-black tree.
+ */
+template <class T, class C, class A, class P>
+template <class ForwardIterator>
+void rb_tree<T, C, A, P>::build_tree(ForwardIterator first, size_type n) {
+  ForwardIterator it = first;
+  set_root(build_sub_tree(it, n, end_, 0, red_depth(n)));
+  size_ = n;
+  begin_ = min_node(root());
+  thread_tree();
+}
+
+/*
+ * Build a subtree from the next n elements in order and return its root.
+ * If an element fails to copy, the nodes built so far are destroyed.
+ */
+template <class T, class C, class A, class P>
+template <class ForwardIterator>
+typename rb_tree<T, C, A, P>::node_ptr
+rb_tree<T, C, A, P>::build_sub_tree(ForwardIterator& it, size_type n,
+                                 node_ptr parent, size_type depth,
+                                 size_type red_depth) {
+  if (n == 0)
+    return nil_;
+
+  size_type left_size = (n - 1) / 2;
+  node_ptr left = build_sub_tree(it, left_size, nil_, depth + 1, red_depth);
+
+  node_ptr x;
+  try {
+    x = create_node(*it);
+  } catch (...) {
+    destroy_sub_tree(left);
+    throw;
+  }
+  x->set_color(depth == red_depth ? red_ : black_);
+  x->set_parent(parent);
+
+  x->left = left;
+  if (left != nil_)
+    left->set_parent(x);
+
+  try {
+    ++it;
+    x->right = build_sub_tree(it, n - 1 - left_size, x, depth + 1, red_depth);
+  } catch (...) {
+    destroy_sub_tree(x);
+    throw;
+  }
+  update_node(x);
+
+  return x;
+}
+
+/*
+ * Build the subtrees of large ranges in parallel, with the same shape and
+ * colors as the sequential build. If an element fails to copy, the nodes
+ * built so far are destroyed.
+ */
+template <class T, class C, class A, class P>
+template <class RandomAccessIterator, class Executor>
+typename rb_tree<T, C, A, P>::node_ptr
+rb_tree<T, C, A, P>::build_sub_tree(RandomAccessIterator first, size_type n,
+                                    node_ptr parent, size_type depth,
+                                    size_type red_depth, const Executor& ex) {
+  if (n < parallel_size) {
+    RandomAccessIterator it = first;
+    return build_sub_tree(it, n, parent, depth, red_depth);
+  }
+
+  size_type left_size = (n - 1) / 2;
+  node_ptr x = create_node(first[left_size]);
+  x->set_color(depth == red_depth ? red_ : black_);
+  x->set_parent(parent);
+
+  node_ptr left = nil_;
+  node_ptr right = nil_;
+  try {
+    ex([&] {
+         left = build_sub_tree(first, left_size, x, depth + 1, red_depth, ex);
+       },
+       [&] {
+         right = build_sub_tree(first + (left_size + 1), n - 1 - left_size, x,
+                                depth + 1, red_depth, ex);
+       });
+  } catch (...) {
+    /* The task that threw has freed its nodes, the other may have finished */
+    x->left = left;
+    x->right = right;
+    destroy_sub_tree(x);
+    throw;
+  }
+  x->left = left;
+  x->right = right;
+  update_node(x);
+
+  return x;
+}
+
+template <class T, class C, class A, class P>
+template <class RandomAccessIterator, class Executor>
+void rb_tree<T, C, A, P>::insert(sorted_unique_t, RandomAccessIterator first,
+                                 RandomAccessIterator last,
+                                 const Executor& ex) {
+  if (first == last)
+    return;
+
+  if (size_ != 0) {
+    rb_tree t(comp_.comp, alloc_);
+    t.insert(sorted_unique, first, last, ex);
+    set_union(std::move(t), ex);
+    return;
+  }
+
+  size_type n = static_cast<size_type>(last - first);
+  set_root(build_sub_tree(first, n, end_, 0, red_depth(n), ex));
+  size_ = n;
+  begin_ = min_node(root());
+  thread_tree();
+}
+
+/*
+ * Return the depth of the nodes to be colored red when n nodes are built
+ * into a balanced tree
+ */
+template <class T, class C, class A, class P>
+typename rb_tree<T, C, A, P>::size_type
+rb_tree<T, C, A, P>::red_depth(size_type n) {
+  size_type depth = 0;
+  for (size_type m = n; m > 1; m >>= 1)
+    ++depth;
+
+  /* a single root node is never red */
+  return depth == 0 ? 1 : depth;
+}
+
+/*
+ * Move the values of other one by one into this empty tree, for when the
+ * allocators differ and the nodes cannot be taken over
+ */
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::move_values(rb_tree& other) {
+  if (other.size_ != 0)
+    build_tree(std::make_move_iterator(iterator_type(other.begin_)),
+               other.size_);
+  other.clear();
+}
+
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::move_assign(rb_tree& other, std::true_type) noexcept {
+  alloc_ = other.alloc_;
+  node_alloc_ = other.node_alloc_;
+  move_tree(other);
+}
+
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::move_assign(rb_tree& other, std::false_type) {
+  if (alloc_ == other.alloc_)
+    move_tree(other);
+  else
+    move_values(other);
+}
+
+/*
+ * Drop all the nodes with a single release() of the allocator, which is only
+ * possible when they are the only blocks in use. The values are still
+ * destroyed one by one, unless they are trivially destructible.
+ * Return false when the nodes have to be deallocated one by one.
+ */
+template <class T, class C, class A, class P>
+bool rb_tree<T, C, A, P>::release_nodes(std::true_type) noexcept {
+  if (size_ == 0 || node_alloc_.allocated() != size_ + this->dead_count())
+    return false;
+
+  destroy_values(root(), std::is_trivially_destructible<value_type>());
+  node_alloc_.release();
+  return true;
+}
+
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::destroy_values(node_ptr x, std::false_type) noexcept {
+  while (x != nil_) {
+    destroy_values(x->right, std::false_type());
+    alloc_traits::destroy(alloc_, &value_of(x));
+    x = x->left;
+  }
+}
+
+/*
+ * Destroy all the nodes of the subtree in post-order, without rebalancing.
+ * Return the number of nodes destroyed
+ */
+template <class T, class C, class A, class P>
+typename rb_tree<T, C, A, P>::size_type
+rb_tree<T, C, A, P>::destroy_sub_tree(node_ptr x) noexcept {
+  size_type n = 0;
+  while (x != nil_) {
+    n += destroy_sub_tree(x->right);
+    node_ptr y = x->left;
+    destroy_node(x);
+    ++n;
+    x = y;
+  }
+  return n;
+}
+
+/*
+ * Return the number of black nodes on any path from x down to a leaf,
+ * including x
+ */
+template <class T, class C, class A, class P>
+typename rb_tree<T, C, A, P>::size_type
+rb_tree<T, C, A, P>::black_height(node_ptr x) {
+  size_type h = 0;
+  for (; x != nil_; x = x->left) {
+    if (x->color() == black_)
+      ++h;
+  }
+  return h;
+}
+
+/*
+ * Make the subtree x the whole tree, leaving begin_ and size_ to the caller
+ */
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::reset_root(node_ptr x) {
+  if (x == nil_) {
+    end_->left = nil_;
+    end_->right = nil_;
+  } else {
+    x->set_color(black_);
+    set_root(x);
+  }
+}
+
+/*
+ * Join the subtree l of black height lh, the node k and the subtree r of
+ * black height rh, where l < k < r, into a single subtree.
+ * If the black heights differ, k is linked as a red node in the taller
+ * subtree, next to the node on its spine with the black height of the other
+ * subtree, and insert_fixup repairs the colors. That costs O(|lh - rh| + 1).
+ * The result becomes the root of this tree, which is used as scratch, and
+ * its black height is returned in h.
+ */
+template <class T, class C, class A, class P>
+typename rb_tree<T, C, A, P>::node_ptr
+rb_tree<T, C, A, P>::join_sub_trees(node_ptr l, size_type lh, node_ptr k,
+                                    node_ptr r, size_type rh, size_type& h) {
+  if (l != nil_ && l->color() == red_) {
+    l->set_color(black_);
+    ++lh;
+  }
+  if (r != nil_ && r->color() == red_) {
+    r->set_color(black_);
+    ++rh;
+  }
+
+  if (lh == rh) {
+    k->set_color(black_);
+    k->left = l;
+    k->right = r;
+    if (l != nil_)
+      l->set_parent(k);
+    if (r != nil_)
+      r->set_parent(k);
+    set_root(k);
+    update_node(k);
+    h = lh + 1;
+    return k;
+  }
+
+  node_ptr p = end_;
+  node_ptr c;
+
+  if (lh > rh) {
+    /* descend the right spine of l */
+    set_root(l);
+    c = l;
+    for (size_type hc = lh; c != nil_ && !(c->color() == black_ && hc == rh);
+         c = c->right) {
+      if (c->color() == black_)
+        --hc;
+      p = c;
+    }
+
+    p->right = k;
+    k->left = c;
+    k->right = r;
+    h = lh;
+  } else {
+    /* descend the left spine of r */
+    set_root(r);
+    c = r;
+    for (size_type hc = rh; c != nil_ && !(c->color() == black_ && hc == lh);
+         c = c->left) {
+      if (c->color() == black_)
+        --hc;
+      p = c;
+    }
+
+    p->left = k;
+    k->left = l;
+    k->right = c;
+    h = rh;
+  }
+
+  k->set_parent(p);
+  if (k->left != nil_)
+    k->left->set_parent(k);
+  if (k->right != nil_)
+    k->right->set_parent(k);
+
+  update_path(k);
+  if (insert_fixup(k))
+    ++h;
+  return root();
+}
+
+/*
+ * Split the tree around the node x into the subtree l of the nodes before x
+ * and the subtree r of the nodes after x, with their black heights.
+ * x is left out of both.
+ * Climbing from x to the root, every ancestor is joined with its other
+ * subtree into l or r. The joins cost O(log n) in total, since the black
+ * heights of the pieces joined into each side only grow.
+ */
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::split_at(node_ptr x, node_ptr& l, size_type& lh,
+                                   node_ptr& r, size_type& rh) {
+  /* black height of the subtree c */
+  size_type hc = black_height(x);
+  node_ptr p = x->parent();
+  bool from_right = p != end_ && x == p->right;
+
+  l = x->left;
+  r = x->right;
+  lh = rh = hc - (x->color() == black_ ? 1 : 0);
+
+  while (p != end_) {
+    /* the links of p are overwritten by the join */
+    node_ptr gp = p->parent();
+    bool next_from_right = gp != end_ && p == gp->right;
+    size_type hp = hc + (p->color() == black_ ? 1 : 0);
+
+    if (from_right)
+      l = join_sub_trees(p->left, hc, p, l, lh, lh);
+    else
+      r = join_sub_trees(r, rh, p, p->right, hc, rh);
+
+    hc = hp;
+    p = gp;
+    from_right = next_from_right;
+  }
+}
+
+/*
+ * Append pivot and the tree right to this tree
+ */
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::join_trees(node_ptr pivot, rb_tree& right) {
+  size_type n = size_ + right.size_ + 1;
+  node_ptr b = size_ == 0 ? pivot : begin_;
+  node_ptr l = root();
+  node_ptr r = right.root();
+
+  thread_join(pivot, right);
+  right.drop_nodes();
+
+  size_type h;
+  join_sub_trees(l, black_height(l), pivot, r, black_height(r), h);
+
+  size_ = n;
+  begin_ = b;
+}
+
+/*
+ * Move the elements not less than val into the returned tree
+ */
+template <class T, class C, class A, class P>
+template <class K>
+rb_tree<T, C, A, P> rb_tree<T, C, A, P>::split_unique(const K& val) {
+  rb_tree right(comp_.comp, alloc_);
+  compact();
+  node_ptr x = lower_bound_unique(val).ptr_;
+
+  if (x == end_)
+    return right;
+
+  if (x == begin_) {
+    right.move_tree(*this);
+    return right;
+  }
+
+  size_type n = size_;
+  node_ptr l, r;
+  size_type lh, rh;
+  thread_split(x, right);
+  split_at(x, l, lh, r, rh);
+
+  /* x is the first node of the right tree */
+  r = join_sub_trees(nil_, 0, x, r, rh, rh);
+  right.reset_root(r);
+  right.begin_ = x;
+
+  reset_root(l);
+  finger_ = nil_;
+
+  split_sizes(right, n);
+  return right;
+}
+
+/*
+ * Set the sizes of this tree and other, which hold n elements together.
+ * The subtree sizes give them right away. Otherwise walk both trees at the
+ * same time until the smaller one is exhausted.
+ */
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::split_sizes(rb_tree& other, size_type n) {
+  split_sizes(other, n, order_statistics_tag());
+}
+
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::split_sizes(rb_tree& other, size_type n,
+                                      std::true_type) {
+  size_ = subtree_count(root());
+  other.size_ = n - size_;
+}
+
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::split_sizes(rb_tree& other, size_type n,
+                                      std::false_type) {
+  node_ptr a = begin_;
+  node_ptr b = other.begin_;
+  size_type k = 0;
+
+  while (a != end_ && b != other.end_) {
+    a = next_node(a);
+    b = next_node(b);
+    ++k;
+  }
+
+  if (a == end_) {
+    size_ = k;
+    other.size_ = n - k;
+  } else {
+    other.size_ = k;
+    size_ = n - k;
+  }
+}
+
+/*
+ * Empty the tree without destroying its nodes, which another tree took over
+ */
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::drop_nodes() noexcept {
+  end_->left = nil_;
+  end_->right = nil_;
+  begin_ = end_;
+  size_ = 0;
+  this->set_dead_count(0);
+  finger_ = nil_;
+}
+
+/*
+ * Make the subtree t of n nodes, the result of a set operation, the tree
+ */
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::finish_set_operation(node_ptr t,
+                                               size_type n) noexcept {
+  reset_root(t);
+  begin_ = t == nil_ ? end_ : min_node(t);
+  size_ = n;
+  finger_ = nil_;
+  thread_tree();
+}
+
+/*
+ * Split the subtree t of black height th into the subtree l of the nodes
+ * less than val and the subtree r of the nodes greater than val, with their
+ * black heights. The node equivalent to val, if any, is left out of both
+ * and returned. This tree is used as scratch.
+ */
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::node_ptr
+rb_tree<T, C, A, P>::split_sub_tree(node_ptr t, size_type th, const K& val,
+                                    node_ptr& l, size_type& lh,
+                                    node_ptr& r, size_type& rh) {
+  if (t == nil_) {
+    l = r = nil_;
+    lh = rh = 0;
+    return nil_;
+  }
+
+  set_root(t);
+  node_ptr x = lower_bound_unique(val).ptr_;
+  if (x == end_) {
+    l = t;
+    lh = th;
+    r = nil_;
+    rh = 0;
+    return nil_;
+  }
+
+  split_at(x, l, lh, r, rh);
+  if (!comp_(val, value_of(x)))
+    return x;
+
+  r = join_sub_trees(nil_, 0, x, r, rh, rh);
+  return nil_;
+}
+
+/*
+ * Join the subtrees l and r, where l < r, taking the first node of r as
+ * the pivot
+ */
+template <class T, class C, class A, class P>
+typename rb_tree<T, C, A, P>::node_ptr
+rb_tree<T, C, A, P>::concat_sub_trees(node_ptr l, size_type lh,
+                                      node_ptr r, size_type rh,
+                                      size_type& h) {
+  if (r == nil_) {
+    h = lh;
+    return l;
+  }
+  if (l == nil_) {
+    h = rh;
+    return r;
+  }
+
+  set_root(r);
+  node_ptr k = min_node(r);
+  node_ptr none;
+  size_type none_h;
+  split_at(k, none, none_h, r, rh);
+  return join_sub_trees(l, lh, k, r, rh, h);
+}
+
+/*
+ * Run left(*this) and right(tree), in parallel with ex if parallel is true,
+ * in which case the right task gets a scratch tree of its own
+ */
+template <class T, class C, class A, class P>
+template <class Executor, class Left, class Right>
+void rb_tree<T, C, A, P>::fork_sub_trees(bool parallel, const Executor& ex,
+                                         Left left, Right right) {
+  if (!parallel) {
+    left(*this);
+    right(*this);
+    return;
+  }
+
+  rb_tree scratch(comp_.comp, alloc_);
+  ex([&] { left(*this); }, [&] { right(scratch); });
+  scratch.reset_root(nil_);
+}
+
+/*
+ * The union of the subtree a of this tree and the subtree b of another one.
+ * b is exposed at its root k, and a is split around k. A node of a
+ * equivalent to k takes its place, and k is destroyed.
+ */
+template <class T, class C, class A, class P>
+template <class Executor>
+typename rb_tree<T, C, A, P>::node_ptr
+rb_tree<T, C, A, P>::union_sub_trees(node_ptr a, size_type ah, node_ptr b,
+                                     size_type bh, const Executor& ex,
+                                     size_type& h, size_type& dups) {
+  if (b == nil_) {
+    h = ah;
+    return a;
+  }
+  if (a == nil_) {
+    h = bh;
+    return b;
+  }
+
+  node_ptr k = b;
+  node_ptr bl = k->left;
+  node_ptr br = k->right;
+  size_type kh = bh - (k->color() == black_ ? 1 : 0);
+
+  node_ptr al, ar;
+  size_type alh, arh;
+  node_ptr d = split_sub_tree(a, ah, value_of(k), al, alh, ar, arh);
+  if (d != nil_) {
+    destroy_node(k);
+    k = d;
+    ++dups;
+  }
+
+  node_ptr l, r;
+  size_type lh, rh;
+  size_type ldups = 0, rdups = 0;
+  fork_sub_trees(ah >= parallel_height && bh >= parallel_height, ex,
+      [&](rb_tree& t) {
+        l = t.union_sub_trees(al, alh, bl, kh, ex, lh, ldups);
+      },
+      [&](rb_tree& t) {
+        r = t.union_sub_trees(ar, arh, br, kh, ex, rh, rdups);
+      });
+  dups += ldups + rdups;
+  return join_sub_trees(l, lh, k, r, rh, h);
+}
+
+/*
+ * The intersection of the subtree a of this tree and the subtree b of
+ * another one, keeping the nodes of a
+ */
+template <class T, class C, class A, class P>
+template <class Executor>
+typename rb_tree<T, C, A, P>::node_ptr
+rb_tree<T, C, A, P>::intersect_sub_trees(node_ptr a, size_type ah,
+                                         node_ptr b, size_type bh,
+                                         const Executor& ex, size_type& h,
+                                         size_type& kept) {
+  if (a == nil_ || b == nil_) {
+    destroy_sub_tree(a);
+    destroy_sub_tree(b);
+    h = 0;
+    return nil_;
+  }
+
+  node_ptr bl = b->left;
+  node_ptr br = b->right;
+  size_type kh = bh - (b->color() == black_ ? 1 : 0);
+
+  node_ptr al, ar;
+  size_type alh, arh;
+  node_ptr d = split_sub_tree(a, ah, value_of(b), al, alh, ar, arh);
+  destroy_node(b);
+
+  node_ptr l, r;
+  size_type lh, rh;
+  size_type lkept = 0, rkept = 0;
+  fork_sub_trees(ah >= parallel_height && bh >= parallel_height, ex,
+      [&](rb_tree& t) {
+        l = t.intersect_sub_trees(al, alh, bl, kh, ex, lh, lkept);
+      },
+      [&](rb_tree& t) {
+        r = t.intersect_sub_trees(ar, arh, br, kh, ex, rh, rkept);
+      });
+  kept += lkept + rkept;
+
+  if (d == nil_)
+    return concat_sub_trees(l, lh, r, rh, h);
+  ++kept;
+  return join_sub_trees(l, lh, d, r, rh, h);
+}
+
+/*
+ * The subtree a of this tree without the elements of the subtree b of
+ * another one
+ */
+template <class T, class C, class A, class P>
+template <class Executor>
+typename rb_tree<T, C, A, P>::node_ptr
+rb_tree<T, C, A, P>::subtract_sub_trees(node_ptr a, size_type ah,
+                                        node_ptr b, size_type bh,
+                                        const Executor& ex, size_type& h,
+                                        size_type& removed) {
+  if (a == nil_) {
+    destroy_sub_tree(b);
+    h = 0;
+    return nil_;
+  }
+  if (b == nil_) {
+    h = ah;
+    return a;
+  }
+
+  node_ptr bl = b->left;
+  node_ptr br = b->right;
+  size_type kh = bh - (b->color() == black_ ? 1 : 0);
+
+  node_ptr al, ar;
+  size_type alh, arh;
+  node_ptr d = split_sub_tree(a, ah, value_of(b), al, alh, ar, arh);
+  destroy_node(b);
+  if (d != nil_) {
+    destroy_node(d);
+    ++removed;
+  }
+
+  node_ptr l, r;
+  size_type lh, rh;
+  size_type lremoved = 0, rremoved = 0;
+  fork_sub_trees(ah >= parallel_height && bh >= parallel_height, ex,
+      [&](rb_tree& t) {
+        l = t.subtract_sub_trees(al, alh, bl, kh, ex, lh, lremoved);
+      },
+      [&](rb_tree& t) {
+        r = t.subtract_sub_trees(ar, arh, br, kh, ex, rh, rremoved);
+      });
+  removed += lremoved + rremoved;
+  return concat_sub_trees(l, lh, r, rh, h);
+}
+
+template <class T, class C, class A, class P>
+template <class Executor>
+void rb_tree<T, C, A, P>::set_union(rb_tree&& other, const Executor& ex) {
+  if (&other == this)
+    return;
+
+  compact();
+  other.compact();
+  node_ptr a = root();
+  node_ptr b = other.root();
+  size_type n = size_ + other.size_;
+  other.drop_nodes();
+
+  size_type h, dups = 0;
+  node_ptr t = union_sub_trees(a, black_height(a), b, black_height(b), ex,
+                               h, dups);
+  finish_set_operation(t, n - dups);
+}
+
+template <class T, class C, class A, class P>
+template <class Executor>
+void rb_tree<T, C, A, P>::set_intersection(rb_tree&& other,
+                                           const Executor& ex) {
+  if (&other == this)
+    return;
+
+  compact();
+  other.compact();
+  node_ptr a = root();
+  node_ptr b = other.root();
+  other.drop_nodes();
+
+  size_type h, kept = 0;
+  node_ptr t = intersect_sub_trees(a, black_height(a), b, black_height(b),
+                                   ex, h, kept);
+  finish_set_operation(t, kept);
+}
+
+template <class T, class C, class A, class P>
+template <class Executor>
+void rb_tree<T, C, A, P>::set_difference(rb_tree&& other,
+                                         const Executor& ex) {
+  if (&other == this) {
+    clear();
+    return;
+  }
+
+  compact();
+  other.compact();
+  node_ptr a = root();
+  node_ptr b = other.root();
+  size_type n = size_;
+  other.drop_nodes();
+
+  size_type h, removed = 0;
+  node_ptr t = subtract_sub_trees(a, black_height(a), b, black_height(b),
+                                  ex, h, removed);
+  finish_set_operation(t, n - removed);
+}
+
+/*
+ * Find the position to link a new node with the value val, descending from x
+ * whose parent is y, and which is the left child of y if comp is true.
+ * If an element equivalent to val is already in the tree, return it as a
+ * duplicate instead.
+ */
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::insert_pos
+rb_tree<T, C, A, P>::get_insert_unique_pos(node_ptr x, node_ptr y, bool comp,
+                                           const K& val) {
+  std::size_t depth = 0;
+  for (; x != nil_; ++depth) {
+    y = x;
+    comp = comp_(val, value_of(x));
+    x = comp ? x->left : x->right;
+  }
+
+  node_ptr j = y;
+  if (comp) {
+    /* left */
+
+    if (y == end_ || y == begin_) {
+      /* root or begin */
+      this->counters().lookup(depth, depth);
+      return insert_pos(y, true, true);
+    } else {
+      /* decrement j */
+      node_ptr tmp = j->parent();
+      while (j != tmp->right) {
+        j = tmp;
+        tmp = j->parent();
+      }
+      j = tmp;
+    }
+  }
+
+  /* and one more comparison with the predecessor, for a duplicate */
+  this->counters().lookup(depth, depth + 1);
+  if (comp_(value_of(j), val)) {
+    return insert_pos(y, comp, true);
+  } else {
+    /* duplicate */
+    return insert_pos(j, false, false);
+  }
+}
+
+/*
+ * Find the position to link a new node with a hint iterator.
+ * If the hint is correct, the position is found in constant time.
+ * Otherwise, do the basic search.
+ * According to C++11, the hint iterator follows the element being inserted.
+ */
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::insert_pos
+rb_tree<T, C, A, P>::get_insert_hint_unique_pos(node_ptr pos,
+                                                const K& val) {
+  if (pos == end_) {
+    if (pos == begin_) {
+      /* root */
+      this->counters().hint(true);
+      return insert_pos(end_, true, true);
+    } else {
+      node_ptr prev = prev_of(pos);
+
+      if (comp_(value_of(prev), val)) {
+        /* prev < val, correct hint
+         * The rightmost node should not have a right child, so making the new
+         * node as the right child would be safe. */
+        this->counters().hint(true);
+        return insert_pos(prev, false, true);
+      }
+    }
+  } else if (pos == begin_) {
+    if (comp_(val, value_of(pos))) {
+      /* begin */
+      this->counters().hint(true);
+      return insert_pos(pos, true, true);
+    }
+  } else {
+    node_ptr prev = prev_of(pos);
+
+    if (comp_(value_of(prev), val) && comp_(val, value_of(pos))) {
+      /* prev < val < pos, correct hint */
+      if (prev->right == nil_) {
+        /* prev has no right child */
+        this->counters().hint(true);
+        return insert_pos(prev, false, true);
+      } else {
+        /* prev has a right child, then the left child of pos is nil */
+        this->counters().hint(true);
+        return insert_pos(pos, true, true);
+      }
+    }
+  }
+
+  /* incorrect hint */
+  this->counters().hint(false);
+  return get_insert_unique_pos(val);
+}
+
+/*
+ * Find the position to link a new node, searching from the node finger.
+ * finger_climb() gives the subtree to descend into, and the element just
+ * outside it that could be a duplicate.
+ */
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::insert_pos
+rb_tree<T, C, A, P>::get_insert_finger_unique_pos(node_ptr finger,
+                                                  const K& val) {
+  if (finger == end_)
+    return get_insert_hint_unique_pos(finger, val);
+
+  bool above;
+  node_ptr x = finger_climb(finger, val, above);
+
+  if (above) {
+    /* x < val < x->parent() */
+    node_ptr p = x->parent();
+    if (p != end_ && !comp_(val, value_of(p)))
+      return insert_pos(p, false, false);
+    return get_insert_unique_pos(x->right, x, false, val);
+  } else {
+    /* val <= x */
+    if (!comp_(val, value_of(x)))
+      return insert_pos(x, false, false);
+    return get_insert_unique_pos(x->left, x, true, val);
+  }
+}
+
+/*
+ * Link the node z as a leaf under parent, or as the root if parent is end_
+ * Return z
+ */
+template <class T, class C, class A, class P>
+typename rb_tree<T, C, A, P>::node_ptr
+rb_tree<T, C, A, P>::link_node(node_ptr z, node_ptr parent, bool left) {
+  ++size_;
+  finger_ = z;
+  z->left = nil_;
+  z->right = nil_;
+
+  if (parent == end_) {
+    /* root */
+    begin_ = z;
+    set_root(z);
+  } else if (left) {
+    parent->left = z;
+    z->set_parent(parent);
+    if (parent == begin_)
+      begin_ = z;
+  } else {
+    parent->right = z;
+    z->set_parent(parent);
+  }
+  thread_leaf(z, parent, left);
+
+  update_path(z);
+  insert_fixup(z);
+  return z;
+}
+
+/*
+ * The node is only created after the value is known to be unique, or not
+ * at all when it revives a tombstone
+ */
+template <class T, class C, class A, class P>
+template <class V>
+std::pair <typename rb_tree<T, C, A, P>::iterator_type, bool>
+rb_tree<T, C, A, P>::insert_unique(V&& val) {
+  insert_pos pos = get_insert_unique_pos(val);
+
+  if (is_duplicate(pos))
+    return std::pair<iterator_type, bool>(pos.node, false);
+
+  return std::pair<iterator_type, bool>(
+      emplace_at(pos, std::forward<V>(val)), true);
+}
+
+template <class T, class C, class A, class P>
+template <class V>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::insert_unique(node_ptr hint, V&& val) {
+  insert_pos pos = get_insert_hint_unique_pos(hint, val);
+
+  if (is_duplicate(pos))
+    return iterator_type(pos.node);
+
+  return iterator_type(emplace_at(pos, std::forward<V>(val)));
+}
+
+template <class T, class C, class A, class P>
+template <class V>
+std::pair <typename rb_tree<T, C, A, P>::iterator_type, bool>
+rb_tree<T, C, A, P>::insert_finger_unique(node_ptr finger, V&& val) {
+  insert_pos pos = get_insert_finger_unique_pos(finger, val);
+
+  if (is_duplicate(pos))
+    return std::pair<iterator_type, bool>(pos.node, false);
+
+  return std::pair<iterator_type, bool>(
+      emplace_at(pos, std::forward<V>(val)), true);
+}
+
+/*
+ * The value has to be constructed in the node before it can be compared, so
+ * the node is destroyed again if the value turns out to be a duplicate. The
+ * new node takes the place of a tombstone.
+ */
+template <class T, class C, class A, class P>
+template <class... Args>
+std::pair <typename rb_tree<T, C, A, P>::iterator_type, bool>
+rb_tree<T, C, A, P>::emplace_unique(Args&&... args) {
+  node_ptr z = create_node(std::forward<Args>(args)...);
+  insert_pos pos = get_insert_unique_pos(value_of(z));
+
+  if (is_duplicate(pos)) {
+    destroy_node(z);
+    return std::pair<iterator_type, bool>(pos.node, false);
+  }
+  if (!pos.unique) {
+    purge_node(pos.node);
+    pos = get_insert_unique_pos(value_of(z));
+  }
+
+  return std::pair<iterator_type, bool>(link_node(z, pos.node, pos.left), true);
+}
+
+template <class T, class C, class A, class P>
+template <class... Args>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::emplace_hint_unique(node_ptr hint, Args&&... args) {
+  node_ptr z = create_node(std::forward<Args>(args)...);
+  insert_pos pos = get_insert_hint_unique_pos(hint, value_of(z));
+
+  if (is_duplicate(pos)) {
+    destroy_node(z);
+    return iterator_type(pos.node);
+  }
+  if (!pos.unique) {
+    purge_node(pos.node);
+    pos = get_insert_unique_pos(value_of(z));
+  }
+
+  return iterator_type(link_node(z, pos.node, pos.left));
+}
+
+/*
+ * Return the iterator that follows the erased one
+ */
+template <class T, class C, class A, class P>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::erase_iter(node_ptr pos) {
+  if (pos == end_)
+    return iterator_type(end_);
+
+  iterator_type next(pos);
+  ++next;
+
+  bury_node(pos);
+
+  return next;
+}
+
+/*
+ * Erase the range [first, last)
  * Return the iterator that follows the last erased one
  */
-template <class T, class C, class A>
-typename rb_tree<T, C, A>::iterator_type
-rb_tree<T, C, A>::erase_range(node_ptr first, node_ptr last) {
-  if (first == end_)
+template <class T, class C, class A, class P>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::erase_range(node_ptr first, node_ptr last) {
+  if (first == end_)
+    return iterator_type(end_);
+
+  if (first == begin_ && last == end_) {
+    clear();
+    return iterator_type(end_);
+  }
+
+  /*
+   * A range longer than the height of the tree is cut out by splitting the
+   * tree around first and last, and the rest is joined back with last as
+   * the pivot. The erased nodes are destroyed without any rebalancing.
+   */
+  size_type limit = 2 * black_height(root());
+  size_type k = 0;
+  node_ptr now = first;
+  for (; now != last && k < limit; now = next_of(now))
+    ++k;
+
+  if (now != last) {
+    /* the cut counts the nodes it destroys as elements */
+    compact();
+
+    node_ptr a, b, c;
+    size_type ah, bh, ch;
+
+    if (first == begin_)
+      begin_ = last;
+    finger_ = nil_;
+    unthread(first, last);
+
+    split_at(first, a, ah, b, bh);
+    destroy_node(first);
+    k = 1;
+
+    if (last == end_) {
+      k += destroy_sub_tree(b);
+      reset_root(a);
+    } else {
+      reset_root(b);
+      split_at(last, b, bh, c, ch);
+      k += destroy_sub_tree(b);
+      join_sub_trees(a, ah, last, c, ch, ch);
+    }
+
+    size_ -= k;
+    return last;
+  }
+
+  for (node_ptr now = first, next; now != last; now = next) {
+    next = skip_dead(next_of(now));
+    bury_node(now);
+  }
+
+  return last;
+}
+
+template <class T, class C, class A, class P>
+template <class ForwardIterator>
+void rb_tree<T, C, A, P>::apply_batch(ForwardIterator first,
+                                      ForwardIterator last) {
+  typedef typename std::iterator_traits<ForwardIterator>::value_type op_type;
+  const value_compare& comp = comp_;
+
+  node_ptr finger = end_;
+  if (std::is_sorted(first, last, [&comp](const op_type& a, const op_type& b) {
+        return comp(a.value, b.value);
+      })) {
+    for (; first != last; ++first)
+      finger = apply_op(finger, *first);
+    return;
+  }
+
+  std::vector<ForwardIterator> order;
+  for (; first != last; ++first)
+    order.push_back(first);
+  std::stable_sort(order.begin(), order.end(),
+                   [&comp](ForwardIterator a, ForwardIterator b) {
+                     return comp(a->value, b->value);
+                   });
+
+  for (ForwardIterator it : order)
+    finger = apply_op(finger, *it);
+}
+
+/*
+ * Apply op from finger, and return the element where the next one starts:
+ * the new element, or finger again after an erase, unless finger itself is
+ * erased
+ */
+template <class T, class C, class A, class P>
+template <class Op>
+typename rb_tree<T, C, A, P>::node_ptr
+rb_tree<T, C, A, P>::apply_op(node_ptr finger, const Op& op) {
+  if (op.erase) {
+    node_ptr x = finger_lower_bound_unique(finger, op.value).ptr_;
+    if (x == end_ || comp_(op.value, value_of(x)))
+      return x;
+
+    if (x == finger)
+      finger = skip_dead(next_of(x));
+    bury_node(x);
+    return finger;
+  }
+
+  insert_pos pos = get_insert_finger_unique_pos(finger, op.value);
+  if (is_duplicate(pos))
+    return pos.node;
+  return emplace_at(pos, op.value);
+}
+
+/*
+ * Return the number of elements erased
+ * Since the elements are all unique, the return value is either 0 or 1
+ */
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::size_type
+rb_tree<T, C, A, P>::erase_unique(const K& val) {
+  iterator_type j = lower_bound_unique(val);
+
+  if (j.ptr_ == end_ || comp_(val, *j)) {
+    return 0;
+  } else {
+    bury_node(j.ptr_);
+    return 1;
+  }
+}
+
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::left_rotate(node_ptr x) {
+  this->counters().rotation();
+  node_ptr y = x->right;
+
+  x->right = y->left;
+  if (y->left != nil_)
+    y->left->set_parent(x);
+
+  y->set_parent(x->parent());
+
+  if (x->parent() == end_) {
+    set_root(y);
+  } else if (x == x->parent()->left) {
+    x->parent()->left = y;
+  } else {
+    x->parent()->right = y;
+  }
+
+  y->left = x;
+  x->set_parent(y);
+
+  update_node(x);
+  update_node(y);
+}
+
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::right_rotate(node_ptr x) {
+  this->counters().rotation();
+  node_ptr y = x->left;
+
+  x->left = y->right;
+  if (y->right != nil_)
+    y->right->set_parent(x);
+
+  y->set_parent(x->parent());
+
+  if (x->parent() == end_) {
+    set_root(y);
+  } else if (x == x->parent()->right) {
+    x->parent()->right = y;
+  } else {
+    x->parent()->left = y;
+  }
+
+  y->right = x;
+  x->set_parent(y);
+
+  update_node(x);
+  update_node(y);
+}
+
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::transplant(node_ptr u, node_ptr v) {
+  if (u->parent() == end_) {
+    /* set root */
+    end_->left = v;
+    end_->right = v;
+  } else if (u == u->parent()->left) {
+    u->parent()->left = v;
+  } else {
+    u->parent()->right = v;
+  }
+  
+  if (v != nil_)
+    v->set_parent(u->parent());
+}
+
+/*
+ * Return true if the black height of the tree has grown, which happens when
+ * the root is turned red and back to black
+ */
+template <class T, class C, class A, class P>
+bool rb_tree<T, C, A, P>::insert_fixup(node_ptr z) {
+  node_ptr y;
+  std::size_t iterations = 0, recolorings = 0;
+
+  z->set_color(red_);
+
+  for (; z->parent()->color() == red_; ++iterations) {
+    if (z->parent() == z->parent()->parent()->left) {
+      y = z->parent()->parent()->right;
+
+      if (y != nil_ && y->color() == red_) {
+        z->parent()->set_color(black_);
+        y->set_color(black_);
+        z->parent()->parent()->set_color(red_);
+        z = z->parent()->parent();
+        recolorings += 3;
+      } else {
+        if (z == z->parent()->right) {
+          z = z->parent();
+          left_rotate(z);
+        }
+        z->parent()->set_color(black_);
+        z->parent()->parent()->set_color(red_);
+        recolorings += 2;
+
+        right_rotate(z->parent()->parent());
+      }
+    } else {
+      y = z->parent()->parent()->left;
+
+      if (y != nil_ && y->color() == red_) {
+        z->parent()->set_color(black_);
+        y->set_color(black_);
+        z->parent()->parent()->set_color(red_);
+        z = z->parent()->parent();
+        recolorings += 3;
+      } else {
+        if (z == z->parent()->left) {
+          z = z->parent();
+          right_rotate(z);
+        }
+        z->parent()->set_color(black_);
+        z->parent()->parent()->set_color(red_);
+        recolorings += 2;
+
+        left_rotate(z->parent()->parent());
+      }
+    }
+  }
+
+  bool grown = root()->color() == red_;
+  root()->set_color(black_);
+  this->counters().insert_fixup(iterations, recolorings + (grown ? 1 : 0));
+  return grown;
+}
+
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::erase_fixup(node_ptr x, node_ptr xparent) {
+  std::size_t iterations = 0, recolorings = 0;
+
+  for (; x != root() && (x == nil_ || x->color() == black_); ++iterations) {
+    if (x == xparent->left) {
+      node_ptr w = xparent->right;
+      if (w->color() == red_) {
+        w->set_color(black_);
+        xparent->set_color(red_);
+        left_rotate(xparent);
+        w = xparent->right;
+        recolorings += 2;
+      }
+      if ((w->left == nil_ || w->left->color() == black_) && 
+          (w->right == nil_ || w->right->color() == black_)) {
+        w->set_color(red_);
+        x = xparent;
+        xparent = xparent->parent();
+        recolorings += 1;
+      } else {
+        if (w->right == nil_ || w->right->color() == black_) {
+          if (w->left != nil_)
+            w->left->set_color(black_);
+          w->set_color(red_);
+          right_rotate(w);
+          w = xparent->right;
+          recolorings += 2;
+        }
+        w->set_color(xparent->color());
+        xparent->set_color(black_);
+        if (w->right != nil_)
+          w->right->set_color(black_);
+        left_rotate(xparent);
+        x = root();
+        recolorings += 3;
+      }
+    } else {
+      node_ptr w = xparent->left;
+      if (w->color() == red_) {
+        w->set_color(black_);
+        xparent->set_color(red_);
+        right_rotate(xparent);
+        w = xparent->left;
+        recolorings += 2;
+      }
+      if ((w->left == nil_ || w->left->color() == black_) && 
+          (w->right == nil_ || w->right->color() == black_)) {
+        w->set_color(red_);
+        x = xparent;
+        xparent = xparent->parent();
+        recolorings += 1;
+      } else {
+        if (w->left == nil_ || w->left->color() == black_) {
+          if (w->right != nil_)
+            w->right->set_color(black_);
+          w->set_color(red_);
+          left_rotate(w);
+          w = xparent->left;
+          recolorings += 2;
+        }
+        w->set_color(xparent->color());
+        xparent->set_color(black_);
+        if (w->left != nil_)
+          w->left->set_color(black_);
+        right_rotate(xparent);
+        x = root();
+        recolorings += 3;
+      }
+    }
+  }
+  if (x != nil_)
+    x->set_color(black_);
+  this->counters().erase_fixup(iterations, recolorings + (x != nil_ ? 1 : 0));
+}
+
+/*
+ * Remove the node z from the tree without destroying it
+ */
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::unlink_node(node_ptr z) {
+  node_ptr x;
+  node_ptr xparent;
+  node_ptr y = z;
+  int ycolor = y->color();
+
+  --size_;
+  if (z == finger_)
+    finger_ = nil_;
+  unthread(z);
+
+  if (z->left == nil_) {
+    x = z->right;
+    if (z == begin_)
+      begin_ = next_node(z);
+    transplant(z, z->right);
+    xparent = y->parent();
+  } else if (z->right == nil_) {
+    x = z->left;
+    transplant(z, z->left);
+    xparent = y->parent();
+  } else {
+    y = min_node(z->right);
+    ycolor = y->color();
+    x = y->right;
+    if (y->parent() != z) {
+      transplant(y, y->right);
+      y->right = z->right;
+      y->right->set_parent(y);
+      xparent = y->parent();
+    } else {
+      xparent = y;
+    }
+    transplant(z, y);
+    y->left = z->left;
+    y->left->set_parent(y);
+    y->set_color(z->color());
+  }
+
+  /* xparent is the lowest node whose subtree has changed */
+  update_path(xparent);
+
+  if (ycolor == black_)
+    erase_fixup(x, xparent);
+}
+
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::erase_node(node_ptr z) {
+  unlink_node(z);
+  destroy_node(z);
+}
+
+/*
+ * Erase the element of z. With tombstones, z is only marked dead, unless it
+ * is the first or the last node: then it is unlinked, along with the
+ * tombstones that it leaves at that end. Once the dead nodes outnumber the
+ * live ones the tree is compacted, so the tombstones cost amortized O(1)
+ * per erase and at most double the space.
+ */
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::bury_node(node_ptr z) {
+  if (!tombstone_tag::value || z == begin_ ||
+      (z->right == nil_ && next_of(z) == end_)) {
+    erase_node(z);
+    trim_tombstones();
+    return;
+  }
+
+  set_dead(z, true);
+  --size_;
+  this->set_dead_count(this->dead_count() + 1);
+  if (z == finger_)
+    finger_ = nil_;
+
+  if (this->dead_count() > size_)
+    compact();
+}
+
+/* Unlink the tombstones at both ends of the tree */
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::trim_tombstones(std::true_type) {
+  while (this->dead_count() != 0 && is_dead(begin_))
+    purge_node(begin_);
+
+  while (this->dead_count() != 0) {
+    node_ptr x = prev_of(end_);
+    if (!is_dead(x))
+      break;
+    purge_node(x);
+  }
+}
+
+/*
+ * Put the live nodes in a list linked through their right children, in
+ * order, and destroy the tombstones on the way. Then rebuild the tree from
+ * the list with the same shape and colors as build_tree().
+ */
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::compact(std::true_type) {
+  if (this->dead_count() == 0)
+    return;
+
+  node_ptr list;
+  node_ptr *tail = &list;
+  flatten_live(root(), tail);
+  *tail = nil_;
+
+  set_root(relink_sub_tree(list, size_, end_, 0, red_depth(size_)));
+  begin_ = min_node(root());
+  this->set_dead_count(0);
+  thread_tree();
+}
+
+/*
+ * Append the live nodes of the subtree x to the list ending at tail. The
+ * right child of a node is only overwritten once its subtree is done.
+ */
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::flatten_live(node_ptr x, node_ptr*& tail) noexcept {
+  while (x != nil_) {
+    flatten_live(x->left, tail);
+    node_ptr right = x->right;
+    if (is_dead(x)) {
+      destroy_node(x);
+    } else {
+      *tail = x;
+      tail = &x->right;
+    }
+    x = right;
+  }
+}
+
+/*
+ * Build a subtree from the next n nodes of list, like build_sub_tree()
+ */
+template <class T, class C, class A, class P>
+typename rb_tree<T, C, A, P>::node_ptr
+rb_tree<T, C, A, P>::relink_sub_tree(node_ptr& list, size_type n,
+                                     node_ptr parent, size_type depth,
+                                     size_type red_depth) {
+  if (n == 0)
+    return nil_;
+
+  size_type left_size = (n - 1) / 2;
+  node_ptr left = relink_sub_tree(list, left_size, nil_, depth + 1,
+                                  red_depth);
+
+  node_ptr x = list;
+  list = x->right;
+  x->set_parent_and_color(parent, depth == red_depth ? red_ : black_);
+
+  x->left = left;
+  if (left != nil_)
+    left->set_parent(x);
+
+  x->right = relink_sub_tree(list, n - 1 - left_size, x, depth + 1,
+                             red_depth);
+  update_node(x);
+
+  return x;
+}
+
+/*
+ * Link the node owned by nh if its value is unique, in place of a tombstone
+ * of the same key if there is one.
+ * Otherwise the node stays in the returned handle.
+ */
+template <class T, class C, class A, class P>
+typename rb_tree<T, C, A, P>::insert_return_type
+rb_tree<T, C, A, P>::insert_node_unique(node_type&& nh) {
+  insert_return_type ret;
+
+  if (nh.empty()) {
+    ret.position = iterator_type(end_);
+    ret.inserted = false;
+    return ret;
+  }
+
+  insert_pos pos = get_insert_unique_pos(nh.value());
+  if (!pos.unique && is_dead(pos.node)) {
+    purge_node(pos.node);
+    pos = get_insert_unique_pos(nh.value());
+  }
+
+  if (!pos.unique) {
+    ret.position = iterator_type(pos.node);
+    ret.inserted = false;
+    ret.node = std::move(nh);
+  } else {
+    ret.position = iterator_type(link_node(nh.release(), pos.node, pos.left));
+    ret.inserted = true;
+  }
+  return ret;
+}
+
+template <class T, class C, class A, class P>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::insert_node_unique(node_ptr hint, node_type&& nh) {
+  if (nh.empty())
+    return iterator_type(end_);
+
+  insert_pos pos = get_insert_hint_unique_pos(hint, nh.value());
+  if (!pos.unique && is_dead(pos.node)) {
+    purge_node(pos.node);
+    pos = get_insert_unique_pos(nh.value());
+  }
+
+  if (!pos.unique)
+    return iterator_type(pos.node);
+
+  return iterator_type(link_node(nh.release(), pos.node, pos.left));
+}
+
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::node_type
+rb_tree<T, C, A, P>::extract_unique(const K& val) {
+  iterator_type j = find_unique(val);
+
+  if (j.ptr_ == end_)
+    return node_type();
+
+  unlink_node(j.ptr_);
+  trim_tombstones();
+  return node_type(j.ptr_, alloc_);
+}
+
+/*
+ * Relink every node of source that has no equivalent element in this tree.
+ * Unlinking a node leaves the other nodes of source in place, so the
+ * successor can be taken before the node is moved.
+ */
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::merge(rb_tree& source) {
+  if (&source == this)
+    return;
+
+  source.compact();
+  for (node_ptr x = source.begin_, next; x != source.end_; x = next) {
+    next = next_of(x);
+
+    insert_pos pos = get_insert_unique_pos(value_of(x));
+    if (!pos.unique && is_dead(pos.node)) {
+      purge_node(pos.node);
+      pos = get_insert_unique_pos(value_of(x));
+    }
+    if (pos.unique) {
+      source.unlink_node(x);
+      link_node(x, pos.node, pos.left);
+    }
+  }
+}
+
+/*
+ * Return the iterator of the first element no less than val
+ */
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::lower_bound_unique(const K& val,
+                                        std::false_type) const {
+  node_ptr y = end_;
+  std::size_t depth = 0;
+
+  for (node_ptr x = root(); x != nil_; ++depth) {
+    if (comp_(value_of(x), val)) {
+      // x < val
+      x = x->right;
+    } else {
+      // val <= x
+      y = x;
+      x = x->left;
+    }
+  }
+  this->counters().lookup(depth, depth);
+  return iterator_type(skip_dead(y));
+}
+
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::lower_bound_unique(const K& val,
+                                        std::true_type) const {
+  node_ptr y = end_;
+  std::size_t depth = 0;
+
+  for (node_ptr x = root(); x != nil_; ++depth) {
+    bool right = comp_(value_of(x), val);
+    y = right ? y : x;
+    x = x->child(right);
+  }
+  this->counters().lookup(depth, depth);
+  return iterator_type(skip_dead(y));
+}
+
+/*
+ * Return the iterator of the first element strictly greater than val
+ */
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::upper_bound_unique(const K& val,
+                                        std::false_type) const {
+  node_ptr y = end_;
+  std::size_t depth = 0;
+
+  for (node_ptr x = root(); x != nil_; ++depth) {
+    if (comp_(val, value_of(x))) {
+      // val < x
+      y = x;
+      x = x->left;
+    } else {
+      // x <= val
+      x = x->right;
+    }
+  }
+  this->counters().lookup(depth, depth);
+  return iterator_type(skip_dead(y));
+}
+
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::upper_bound_unique(const K& val,
+                                        std::true_type) const {
+  node_ptr y = end_;
+  std::size_t depth = 0;
+
+  for (node_ptr x = root(); x != nil_; ++depth) {
+    bool right = !comp_(val, value_of(x));
+    y = right ? y : x;
+    x = x->child(right);
+  }
+  this->counters().lookup(depth, depth);
+  return iterator_type(skip_dead(y));
+}
+
+/*
+ * If the element is found, return the iterator to the element.
+ * Otherwise return end()
+ */
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::find_unique(const K& val) const {
+  iterator_type j = lower_bound_unique(val);
+
+  if (j.ptr_ == end_ || comp_(val, *j))
     return iterator_type(end_);
+  else
+    return j;
+}
 
-  for (node_ptr now = first, next; now != last; now = next) {
-    next = next_node(now);
-    erase_node(now);
+/*
+ * Find the position to link a new node with the value val, after all the
+ * elements equivalent to val
+ */
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::insert_pos
+rb_tree<T, C, A, P>::get_insert_equal_pos(const K& val) {
+  node_ptr x = root();
+  node_ptr y = end_;
+  bool comp = true;
+  std::size_t depth = 0;
+
+  for (; x != nil_; ++depth) {
+    y = x;
+    comp = comp_(val, value_of(x));
+    x = comp ? x->left : x->right;
   }
+  this->counters().lookup(depth, depth);
+  return insert_pos(y, comp, true);
+}
 
-  return last;
+/* Same as get_insert_equal_pos(), but before the equivalent elements */
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::insert_pos
+rb_tree<T, C, A, P>::get_insert_equal_lower_pos(const K& val) {
+  node_ptr x = root();
+  node_ptr y = end_;
+  bool comp = true;
+  std::size_t depth = 0;
+
+  for (; x != nil_; ++depth) {
+    y = x;
+    comp = !comp_(value_of(x), val);
+    x = comp ? x->left : x->right;
+  }
+  this->counters().lookup(depth, depth);
+  return insert_pos(y, comp, true);
 }
 
 /*
- * Return the number of elements erased
- * Since the elements are all unique, the return value is either 0 or 1
+ * Link the new node as close as possible before the hint, like
+ * std::multiset: right away if prev <= val <= pos or pos < val <= next.
+ * Otherwise the new node goes next to the equivalent elements on the side
+ * of the hint.
  */
-template <class T, class C, class A>
-typename rb_tree<T, C, A>::size_type
-rb_tree<T, C, A>::erase_unique(const value_type& val) {
-  iterator_type j = lower_bound_unique(val);
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::insert_pos
+rb_tree<T, C, A, P>::get_insert_hint_equal_pos(node_ptr pos,
+                                               const K& val) {
+  if (pos == end_ || !comp_(value_of(pos), val)) {
+    /* val <= pos */
+    if (pos == begin_) {
+      /* root or begin */
+      return insert_pos(pos, true, true);
+    }
 
-  if (j.ptr_ == end_ || comp_(val, *j)) {
-    return 0;
+    node_ptr prev = prev_of(pos);
+    if (!comp_(val, value_of(prev))) {
+      /* prev <= val <= pos */
+      if (prev->right == nil_)
+        return insert_pos(prev, false, true);
+      else
+        return insert_pos(pos, true, true);
+    }
+    return get_insert_equal_pos(val);
   } else {
-    erase_node(j.ptr_);
-    return 1;
+    /* pos < val */
+    node_ptr next = next_of(pos);
+    if (next == end_ || !comp_(value_of(next), val)) {
+      /* pos < val <= next */
+      if (pos->right == nil_)
+        return insert_pos(pos, false, true);
+      else
+        return insert_pos(next, true, true);
+    }
+    return get_insert_equal_lower_pos(val);
   }
 }
 
-template <class T, class C, class A>
-void rb_tree<T, C, A>::left_rotate(node_ptr x) {
-  node_ptr y = x->right;
+template <class T, class C, class A, class P>
+template <class V>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::insert_equal(V&& val) {
+  insert_pos pos = get_insert_equal_pos(val);
+  node_ptr z = create_node(std::forward<V>(val));
+  return iterator_type(link_node(z, pos.node, pos.left));
+}
 
-  x->right = y->left;
-  if (y->left != nil_)
-    y->left->parent = x;
+template <class T, class C, class A, class P>
+template <class V>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::insert_equal(node_ptr hint, V&& val) {
+  insert_pos pos = get_insert_hint_equal_pos(hint, val);
+  node_ptr z = create_node(std::forward<V>(val));
+  return iterator_type(link_node(z, pos.node, pos.left));
+}
 
-  y->parent = x->parent;
+template <class T, class C, class A, class P>
+template <class... Args>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::emplace_equal(Args&&... args) {
+  node_ptr z = create_node(std::forward<Args>(args)...);
+  insert_pos pos = get_insert_equal_pos(value_of(z));
+  return iterator_type(link_node(z, pos.node, pos.left));
+}
 
-  if (x->parent == end_) {
-    set_root(y);
-  } else if (x == x->parent->left) {
-    x->parent->left = y;
-  } else {
-    x->parent->right = y;
-  }
+template <class T, class C, class A, class P>
+template <class... Args>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::emplace_hint_equal(node_ptr hint, Args&&... args) {
+  node_ptr z = create_node(std::forward<Args>(args)...);
+  insert_pos pos = get_insert_hint_equal_pos(hint, value_of(z));
+  return iterator_type(link_node(z, pos.node, pos.left));
+}
 
-  y->left = x;
-  x->parent = y;
+template <class T, class C, class A, class P>
+template <class InputIterator>
+void rb_tree<T, C, A, P>::insert_range_equal(InputIterator first,
+                                             InputIterator last,
+                                             std::input_iterator_tag) {
+  insert_hinted_equal(first, last);
 }
 
-template <class T, class C, class A>
-void rb_tree<T, C, A>::right_rotate(node_ptr x) {
-  node_ptr y = x->left;
+/*
+ * If the tree is empty and the range is sorted, build the tree directly in
+ * linear time. Otherwise fall back to the hinted insertion.
+ */
+template <class T, class C, class A, class P>
+template <class ForwardIterator>
+void rb_tree<T, C, A, P>::insert_range_equal(ForwardIterator first,
+                                             ForwardIterator last,
+                                             std::forward_iterator_tag) {
+  if (size_ != 0 || first == last) {
+    insert_hinted_equal(first, last);
+    return;
+  }
 
-  x->left = y->right;
-  if (y->right != nil_)
-    y->right->parent = x;
+  size_type n = 1;
+  ForwardIterator prev = first;
+  ForwardIterator it = first;
+  for (++it; it != last; ++it, ++prev, ++n) {
+    if (comp_(*it, *prev)) {
+      insert_hinted_equal(first, last);
+      return;
+    }
+  }
 
-  y->parent = x->parent;
+  build_tree(first, n);
+}
 
-  if (x->parent == end_) {
-    set_root(y);
-  } else if (x == x->parent->right) {
-    x->parent->right = y;
-  } else {
-    x->parent->left = y;
+template <class T, class C, class A, class P>
+template <class InputIterator>
+void rb_tree<T, C, A, P>::insert_hinted_equal(InputIterator first,
+                                              InputIterator last) {
+  node_ptr hint = end_;
+  for (InputIterator it = first; it != last; ++it) {
+    hint = next_of(insert_equal(hint, *it).ptr_);
   }
+}
 
-  y->right = x;
-  x->parent = y;
+template <class T, class C, class A, class P>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::insert_node_equal(node_type&& nh) {
+  if (nh.empty())
+    return iterator_type(end_);
+
+  insert_pos pos = get_insert_equal_pos(nh.value());
+  return iterator_type(link_node(nh.release(), pos.node, pos.left));
 }
 
-template <class T, class C, class A>
-void rb_tree<T, C, A>::transplant(node_ptr u, node_ptr v) {
-  if (u->parent == end_) {
-    /* set root */
-    end_->left = v;
-    end_->right = v;
-  } else if (u == u->parent->left) {
-    u->parent->left = v;
-  } else {
-    u->parent->right = v;
-  }
-  
-  if (v != nil_)
-    v->parent = u->parent;
+template <class T, class C, class A, class P>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::insert_node_equal(node_ptr hint, node_type&& nh) {
+  if (nh.empty())
+    return iterator_type(end_);
+
+  insert_pos pos = get_insert_hint_equal_pos(hint, nh.value());
+  return iterator_type(link_node(nh.release(), pos.node, pos.left));
 }
 
-template <class T, class C, class A>
-void rb_tree<T, C, A>::insert_fixup(node_ptr z) {
-  node_ptr y;
+/* Move all the nodes of source */
+template <class T, class C, class A, class P>
+void rb_tree<T, C, A, P>::merge_equal(rb_tree& source) {
+  if (&source == this)
+    return;
 
-  z->color = red_;
+  for (node_ptr x = source.begin_, next; x != source.end_; x = next) {
+    next = next_of(x);
 
-  while (z->parent->color == red_) {
-    if (z->parent == z->parent->parent->left) {
-      y = z->parent->parent->right;
+    insert_pos pos = get_insert_equal_pos(value_of(x));
+    source.unlink_node(x);
+    link_node(x, pos.node, pos.left);
+  }
+}
 
-      if (y != nil_ && y->color == red_) {
-        z->parent->color = black_;
-        y->color = black_;
-        z->parent->parent->color = red_;
-        z = z->parent->parent;
-      } else {
-        if (z == z->parent->right) {
-          z = z->parent;
-          left_rotate(z);
-        }
-        z->parent->color = black_;
-        z->parent->parent->color = red_;
+/*
+ * Both bounds are found with a single descent: it goes down together until
+ * the first element equivalent to val, then the lower bound is in its left
+ * subtree and the upper bound in its right subtree.
+ */
+template <class T, class C, class A, class P>
+template <class K>
+std::pair<typename rb_tree<T, C, A, P>::iterator_type,
+          typename rb_tree<T, C, A, P>::iterator_type>
+rb_tree<T, C, A, P>::equal_range_equal(const K& val) const {
+  node_ptr x = root();
+  node_ptr y = end_;
 
-        right_rotate(z->parent->parent);
-      }
+  while (x != nil_) {
+    if (comp_(value_of(x), val)) {
+      x = x->right;
+    } else if (comp_(val, value_of(x))) {
+      y = x;
+      x = x->left;
     } else {
-      y = z->parent->parent->left;
+      node_ptr xu = x->right;
+      node_ptr yu = y;
 
-      if (y != nil_ && y->color == red_) {
-        z->parent->color = black_;
-        y->color = black_;
-        z->parent->parent->color = red_;
-        z = z->parent->parent;
-      } else {
-        if (z == z->parent->left) {
-          z = z->parent;
-          right_rotate(z);
+      /* lower bound */
+      y = x;
+      x = x->left;
+      while (x != nil_) {
+        if (comp_(value_of(x), val)) {
+          x = x->right;
+        } else {
+          y = x;
+          x = x->left;
         }
-        z->parent->color = black_;
-        z->parent->parent->color = red_;
+      }
 
-        left_rotate(z->parent->parent);
+      /* upper bound */
+      while (xu != nil_) {
+        if (comp_(val, value_of(xu))) {
+          yu = xu;
+          xu = xu->left;
+        } else {
+          xu = xu->right;
+        }
       }
+      return std::pair<iterator_type, iterator_type>(y, yu);
     }
   }
+  return std::pair<iterator_type, iterator_type>(y, y);
+}
+
+/*
+ * With the subtree sizes, the run of equivalent elements is counted in
+ * O(log n) from the ranks of its bounds, otherwise by walking it
+ */
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::size_type
+rb_tree<T, C, A, P>::count_equal(const K& val) const {
+  std::pair<iterator_type, iterator_type> r = equal_range_equal(val);
+  if (r.first == r.second)
+    return 0;
+  return count_nodes(r.first.ptr_, r.second.ptr_, order_statistics_tag());
+}
+
+/*
+ * The run of equivalent elements is found with one descent, and erased as a
+ * range, which splits and joins the tree around long runs
+ */
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::size_type
+rb_tree<T, C, A, P>::erase_equal(const K& val) {
+  std::pair<iterator_type, iterator_type> r = equal_range_equal(val);
+  if (r.first == r.second)
+    return 0;
 
-  root()->color = black_;
+  size_type n = size_;
+  erase_range(r.first.ptr_, r.second.ptr_);
+  return n - size_;
 }
 
-template <class T, class C, class A>
-void rb_tree<T, C, A>::erase_fixup(node_ptr x, node_ptr xparent) {
-  while (x != root() && (x == nil_ || x->color == black_)) {
-    if (x == xparent->left) {
-      node_ptr w = xparent->right;
-      if (w->color == red_) {
-        w->color = black_;
-        xparent->color = red_;
-        left_rotate(xparent);
-        w = xparent->right;
-      }
-      if ((w->left == nil_ || w->left->color == black_) && 
-          (w->right == nil_ || w->right->color == black_)) {
-        w->color = red_;
-        x = xparent;
-        xparent = xparent->parent;
-      } else {
-        if (w->right == nil_ || w->right->color == black_) {
-          if (w->left != nil_)
-            w->left->color = black_;
-          w->color = red_;
-          right_rotate(w);
-          w = xparent->right;
-        }
-        w->color = xparent->color;
-        xparent->color = black_;
-        if (w->right != nil_)
-          w->right->color = black_;
-        left_rotate(xparent);
-        x = root();
-      }
+/*
+ * Climb from the node x to the root of the smallest subtree on the way that
+ * surely holds the lower bound of val, or the position to insert it.
+ * If above is set, x < val and the position is in the right subtree of x,
+ * before x->parent(). Otherwise val <= x, and the position is x itself or in
+ * its left subtree, after x->parent().
+ * Only the ancestors on the side of val are compared, so the climb stops
+ * after O(log d) steps when the subtrees around the path are balanced, d
+ * being the distance between x and val.
+ */
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::node_ptr
+rb_tree<T, C, A, P>::finger_climb(node_ptr x, const K& val,
+                                  bool& above) const {
+  above = comp_(value_of(x), val);
+
+  for (;;) {
+    node_ptr p = x->parent();
+    if (p == end_)
+      return x;
+
+    if (above) {
+      /* p < x when x is a right child */
+      if (x == p->left && !comp_(value_of(p), val))
+        return x;
     } else {
-      node_ptr w = xparent->left;
-      if (w->color == red_) {
-        w->color = black_;
-        xparent->color = red_;
-        right_rotate(xparent);
-        w = xparent->left;
-      }
-      if ((w->left == nil_ || w->left->color == black_) && 
-          (w->right == nil_ || w->right->color == black_)) {
-        w->color = red_;
-        x = xparent;
-        xparent = xparent->parent;
-      } else {
-        if (w->left == nil_ || w->left->color == black_) {
-          if (w->right != nil_)
-            w->right->color = black_;
-          w->color = red_;
-          left_rotate(w);
-          w = xparent->left;
-        }
-        w->color = xparent->color;
-        xparent->color = black_;
-        if (w->left != nil_)
-          w->left->color = black_;
-        right_rotate(xparent);
-        x = root();
-      }
+      /* x < p when x is a left child */
+      if (x == p->right && comp_(value_of(p), val))
+        return x;
     }
+    x = p;
   }
-  if (x != nil_)
-    x->color = black_;
 }
 
-template <class T, class C, class A>
-void rb_tree<T, C, A>::erase_node(node_ptr z) {
-  node_ptr x;
-  node_ptr xparent;
-  node_ptr y = z;
-  int ycolor = y->color;
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::finger_lower_bound_unique(node_ptr finger,
+                                               const K& val) const {
+  if (finger == end_)
+    return lower_bound_unique(val);
 
-  --size_;
+  bool above;
+  node_ptr x = finger_climb(finger, val, above);
+  node_ptr y;
 
-  if (z->left == nil_) {
-    x = z->right;
-    if (z == begin_)
-      begin_ = next_node(z);
-    transplant(z, z->right);
-    xparent = y->parent;
-  } else if (z->right == nil_) {
-    x = z->left;
-    transplant(z, z->left);
-    xparent = y->parent;
+  if (above) {
+    y = x->parent();
+    x = x->right;
   } else {
-    y = min_node(z->right);
-    ycolor = y->color;
-    x = y->right;
-    if (y->parent != z) {
-      transplant(y, y->right);
-      y->right = z->right;
-      y->right->parent = y;
-      xparent = y->parent;
+    y = x;
+    x = x->left;
+  }
+
+  while (x != nil_) {
+    if (comp_(value_of(x), val)) {
+      x = x->right;
     } else {
-      xparent = y;
+      y = x;
+      x = x->left;
     }
-    transplant(z, y);
-    y->left = z->left;
-    y->left->parent = y;
-    y->color = z->color;
   }
+  return iterator_type(skip_dead(y));
+}
 
-  if (ycolor == black_)
-    erase_fixup(x, xparent);
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::finger_find_unique(node_ptr finger, const K& val) const {
+  iterator_type j = finger_lower_bound_unique(finger, val);
 
-  destroy_node(z);
+  if (j.ptr_ == end_ || comp_(val, *j))
+    return iterator_type(end_);
+  else
+    return j;
+}
+
+template <class T, class C, class A, class P>
+template <class ForwardIterator, class OutputIterator>
+OutputIterator
+rb_tree<T, C, A, P>::lookup_batch(ForwardIterator first, ForwardIterator last,
+                                  OutputIterator out, bool find) const {
+  node_ptr start = root();
+  node_ptr start_y = end_;
+
+  if (first != last && std::is_sorted(first, last, comp_)) {
+    /*
+     * The descents of all the keys between the smallest and the largest one
+     * go the same way down to where those two part, so they start there
+     */
+    ForwardIterator hi = first;
+    for (ForwardIterator it = first; ++it != last;)
+      hi = it;
+
+    while (start != nil_) {
+      bool lo_right = comp_(value_of(start), *first);
+      if (lo_right != comp_(value_of(start), *hi))
+        break;
+
+      if (lo_right) {
+        start = start->right;
+      } else {
+        start_y = start;
+        start = start->left;
+      }
+    }
+  }
+
+  ForwardIterator keys[batch_width];
+  node_ptr x[batch_width];
+  node_ptr y[batch_width];
+
+  while (first != last) {
+    int n = 0;
+    for (; first != last && n < batch_width; ++first, ++n) {
+      keys[n] = first;
+      x[n] = start;
+      y[n] = start_y;
+    }
+
+    /* one level of every descent per round */
+    for (bool active = true; active;) {
+      active = false;
+      for (int i = 0; i < n; ++i) {
+        node_ptr z = x[i];
+        if (z == nil_)
+          continue;
+
+        active = true;
+        if (comp_(value_of(z), *keys[i])) {
+          z = z->right;
+        } else {
+          y[i] = z;
+          z = z->left;
+        }
+        RB_TREE_PREFETCH(z);
+        x[i] = z;
+      }
+    }
+
+    for (int i = 0; i < n; ++i) {
+      node_ptr j = skip_dead(y[i]);
+      if (find && j != end_ && comp_(*keys[i], value_of(j)))
+        j = end_;
+      *out = const_iterator(j);
+      ++out;
+    }
+  }
+  return out;
 }
 
 /*
- * Return the iterator of the first element no less than val
+ * Return the pair (lower_bound, upper_bound)
+ * However we can skip calculating the upper_bound since the elements in the
+ * tree are all unique.
  */
-template <class T, class C, class A>
-typename rb_tree<T, C, A>::iterator_type
-rb_tree<T, C, A>::lower_bound_unique(const key_type& val) {
-  node_ptr y = end_;
+template <class T, class C, class A, class P>
+template <class K>
+std::pair<typename rb_tree<T, C, A, P>::iterator_type,
+          typename rb_tree<T, C, A, P>::iterator_type>
+rb_tree<T, C, A, P>::equal_range_unique(const K& val) const {
+  iterator_type j = lower_bound_unique(val);
+
+  if (j.ptr_ == end_ || comp_(val, *j))
+    return std::pair<iterator_type,iterator_type>(j, j);
+  else
+    return std::pair<iterator_type,iterator_type>(j, std::next(j));
+}
+
+/*
+ * Return false if the visit has been stopped
+ */
+template <class T, class C, class A, class P>
+template <class Prune, class Visit>
+bool rb_tree<T, C, A, P>::visit_pruned_sub_tree(node_ptr x, Prune& prune,
+                                                Visit& visit) {
+  static_assert(augmented_tag::value, "visit_pruned() requires metadata");
+
+  while (x != nil_ && !prune(x->metadata)) {
+    if (!visit_pruned_sub_tree(x->left, prune, visit))
+      return false;
+    if (!visit(value_of(x)))
+      return false;
+    x = x->right;
+  }
+  return true;
+}
+
+template <class T, class C, class A, class P>
+template <class K, class Subtree, class Value>
+void rb_tree<T, C, A, P>::visit_less_unique(const K& val, Subtree& subtree,
+                                            Value& value) const {
+  static_assert(augmented_tag::value, "visit_less() requires metadata");
 
   for (node_ptr x = root(); x != nil_;) {
-    if (comp_(x->value, val)) {
+    if (comp_(value_of(x), val)) {
       // x < val
+      if (x->left != nil_)
+        subtree(x->left->metadata);
+      value(value_of(x));
       x = x->right;
     } else {
       // val <= x
-      y = x;
       x = x->left;
     }
   }
-  return iterator_type(y);
 }
 
-/*
- * Return the iterator of the first element strictly greater than val
- */
-template <class T, class C, class A>
-typename rb_tree<T, C, A>::iterator_type
-rb_tree<T, C, A>::upper_bound_unique(const key_type& val) {
-  node_ptr y = end_;
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::size_type
+rb_tree<T, C, A, P>::rank_unique(const K& val) const {
+  static_assert(order_statistics_tag::value,
+                "rank() requires order statistics");
+
+  size_type r = 0;
 
   for (node_ptr x = root(); x != nil_;) {
-    if (comp_(val, x->value)) {
-      // val < x
-      y = x;
+    if (comp_(value_of(x), val)) {
+      // x < val
+      r += subtree_count(x->left) + 1;
+      x = x->right;
+    } else {
+      // val <= x
+      x = x->left;
+    }
+  }
+  return r;
+}
+
+template <class T, class C, class A, class P>
+typename rb_tree<T, C, A, P>::iterator_type
+rb_tree<T, C, A, P>::select_unique(size_type k) const {
+  static_assert(order_statistics_tag::value,
+                "select() requires order statistics");
+
+  for (node_ptr x = root(); x != nil_;) {
+    size_type l = subtree_count(x->left);
+
+    if (k < l) {
       x = x->left;
+    } else if (k == l) {
+      return iterator_type(x);
     } else {
-      // x <= val
+      k -= l + 1;
       x = x->right;
     }
   }
-  return iterator_type(y);
+  return iterator_type(end_);
 }
 
 /*
- * If the element is found, return the iterator to the element.
- * Otherwise return end()
+ * Count the nodes before x by climbing to the root, adding the left subtree
+ * and the parent whenever x is a right child
  */
-template <class T, class C, class A>
-typename rb_tree<T, C, A>::iterator_type
-rb_tree<T, C, A>::find_unique(const key_type& val) {
-  iterator_type j = lower_bound_unique(val);
+template <class T, class C, class A, class P>
+typename rb_tree<T, C, A, P>::size_type
+rb_tree<T, C, A, P>::index_of_node(node_ptr x) const {
+  static_assert(order_statistics_tag::value,
+                "index_of() requires order statistics");
 
-  if (j.ptr_ == end_ || comp_(val, *j))
-    return iterator_type(end_);
-  else
-    return j;
+  if (x == end_)
+    return size_;
+
+  size_type r = subtree_count(x->left);
+
+  for (node_ptr p = x->parent(); p != end_; x = p, p = p->parent()) {
+    if (x == p->right)
+      r += subtree_count(p->left) + 1;
+  }
+  return r;
 }
 
-/*
- * Return the pair (lower_bound, upper_bound)
- * However we can skip calculating the upper_bound since the elements in the
- * tree are all unique.
- */
-template <class T, class C, class A>
-std::pair<typename rb_tree<T, C, A>::iterator_type,
-          typename rb_tree<T, C, A>::iterator_type>
-rb_tree<T, C, A>::equal_range_unique(const key_type& val) {
-  iterator_type j = lower_bound_unique(val);
+template <class T, class C, class A, class P>
+template <class K>
+typename rb_tree<T, C, A, P>::size_type
+rb_tree<T, C, A, P>::count_range_unique(const K& lo, const K& hi) const {
+  size_type l = rank_unique(lo);
+  size_type h = rank_unique(hi);
 
-  if (j.ptr_ == end_ || comp_(val, *j))
-    return std::pair<iterator_type,iterator_type>(j, j);
-  else
-    return std::pair<iterator_type,iterator_type>(j, std::next(j));
+  return h > l ? h - l : 0;
 }
+/* A tree with order statistics */
+template <class T,
+          class Compare = std::less<T>,
+          class Alloc = std::allocator<T> >
+using order_statistics_tree =
+  rb_tree<T, Compare, Alloc, order_statistics_policy>;
+
 } // namespace rbtree
 
 #endif // RB_TREE_H
@@ -0,0 +1,462 @@
+#ifndef RB_TREE_IMAGE_H
+#define RB_TREE_IMAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "rb_btree.h"
+#include "rb_frozen_tree.h"
+#include "rb_tree.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define RB_TREE_IMAGE_MMAP
+#endif
+
+namespace rb_tree {
+
+/*
+ * Binary images of the trees, to save them and get them back without
+ * parsing or comparing the elements:
+ *   rb_tree<std::uint64_t> t;
+ *   ...
+ *   save(t, "ids.img");
+ *   rb_tree<std::uint64_t> u;
+ *   load(u, "ids.img");
+ * An image is a header followed by the raw elements, either in order, which
+ * rebuilds any tree in O(n) with the same build as the sorted range insert,
+ * or in the Eytzinger order of a frozen_rb_tree, which
+ * mapped_frozen_rb_tree serves straight from the mapped file. The colors
+ * are not stored: the build colors its tree from the size alone.
+ * Only the elements whose bytes are their value can be saved, and the
+ * images are only read back on machines of the same endianness and with
+ * the same layout of the elements. The order of an image is trusted, not
+ * checked.
+ */
+template <class T>
+struct rb_tree_trivial_image : std::is_trivially_copyable<T> { };
+
+/* The pairs of a map do not have trivial assignments, but their bytes are */
+template <class A, class B>
+struct rb_tree_trivial_image<std::pair<A, B> >
+  : std::integral_constant<bool,
+        rb_tree_trivial_image<typename std::remove_const<A>::type>::value &&
+        rb_tree_trivial_image<B>::value> { };
+
+enum class tree_image_layout : std::uint32_t { in_order = 0, eytzinger = 1 };
+
+/*
+ * The first 64 bytes of an image. The elements start right after it, so
+ * that they are aligned in a mapped file. An Eytzinger image has an unused
+ * element first, for the index 0.
+ */
+struct tree_image_header {
+  char magic[8];
+  std::uint32_t endian;
+  tree_image_layout layout;
+  std::uint64_t element_size;
+  std::uint64_t element_align;
+  std::uint64_t count;
+  unsigned char reserved[24];
+
+  static constexpr std::uint32_t endian_mark = 0x01020304;
+
+  static tree_image_header make(tree_image_layout layout,
+                                std::size_t size, std::size_t align,
+                                std::uint64_t count) {
+    tree_image_header h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, "RBTREE1", 8);
+    h.endian = endian_mark;
+    h.layout = layout;
+    h.element_size = size;
+    h.element_align = align;
+    h.count = count;
+    return h;
+  }
+
+  /* Throw unless this is an image of the layout and the elements */
+  void check(tree_image_layout expected, std::size_t size,
+             std::size_t align) const {
+    if (std::memcmp(magic, "RBTREE1", 8) != 0)
+      throw std::runtime_error("rb_tree image: not an image");
+    if (endian != endian_mark)
+      throw std::runtime_error("rb_tree image: other endianness");
+    if (layout != expected)
+      throw std::runtime_error("rb_tree image: other layout");
+    if (element_size != size || element_align != align)
+      throw std::runtime_error("rb_tree image: other element type");
+  }
+
+  /*
+   * Whether the elements fit in the given bytes after the header, without
+   * overflowing on a corrupt count. check() has made element_size nonzero.
+   */
+  bool fits(std::uint64_t bytes) const {
+    std::uint64_t extra = layout == tree_image_layout::eytzinger ? 1 : 0;
+    std::uint64_t max = bytes / element_size;
+    return max >= extra && count <= max - extra;
+  }
+
+  /* The bytes of the elements after the header, once fits() holds */
+  std::uint64_t body_size() const {
+    return (count + (layout == tree_image_layout::eytzinger ? 1 : 0)) *
+           element_size;
+  }
+};
+
+static_assert(sizeof(tree_image_header) == 64,
+              "the elements of an image start on a cache line");
+
+namespace image_detail {
+
+/* Write the header and the n elements from first, buffered */
+template <class InputIterator>
+void write_image(std::ostream& out, tree_image_layout layout,
+                 InputIterator first, std::uint64_t n) {
+  typedef typename std::iterator_traits<InputIterator>::value_type value_type;
+  static_assert(rb_tree_trivial_image<value_type>::value,
+                "only the elements whose bytes are their value have images");
+
+  tree_image_header h = tree_image_header::make(layout, sizeof(value_type),
+                                                alignof(value_type), n);
+  out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+
+  char buf[16384];
+  static_assert(sizeof(value_type) <= sizeof(buf),
+                "the elements of an image are at most 16 KiB");
+  std::size_t used = 0;
+  if (layout == tree_image_layout::eytzinger) {
+    std::memset(buf, 0, sizeof(value_type));
+    used = sizeof(value_type);
+  }
+  for (std::uint64_t i = 0; i < n; ++i, ++first) {
+    if (used + sizeof(value_type) > sizeof(buf)) {
+      out.write(buf, static_cast<std::streamsize>(used));
+      used = 0;
+    }
+    std::memcpy(buf + used, &*first, sizeof(value_type));
+    used += sizeof(value_type);
+  }
+  out.write(buf, static_cast<std::streamsize>(used));
+  if (!out)
+    throw std::runtime_error("rb_tree image: write failed");
+}
+
+template <class Tree>
+void save_image(const Tree& tree, const std::string& path) {
+  std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+  if (!out)
+    throw std::runtime_error("rb_tree image: cannot open " + path);
+  serialize(tree, out);
+  out.close();
+  if (!out)
+    throw std::runtime_error("rb_tree image: cannot write " + path);
+}
+
+/*
+ * Read an in-order image into a buffer, then replace the elements of tree
+ * with it. The buffer is raw bytes, the elements need no constructor.
+ * A bad image throws before tree changes.
+ */
+template <class Tree>
+void read_image(Tree& tree, std::istream& in) {
+  typedef typename Tree::value_type value_type;
+  static_assert(rb_tree_trivial_image<value_type>::value,
+                "only the elements whose bytes are their value have images");
+
+  tree_image_header h;
+  if (!in.read(reinterpret_cast<char *>(&h), sizeof(h)))
+    throw std::runtime_error("rb_tree image: truncated");
+  h.check(tree_image_layout::in_order, sizeof(value_type),
+          alignof(value_type));
+
+  if (!h.fits(static_cast<std::uint64_t>(
+          std::numeric_limits<std::streamsize>::max())))
+    throw std::runtime_error("rb_tree image: truncated");
+
+  if (h.count == 0) {
+    tree.clear();
+    return;
+  }
+  std::allocator<value_type> alloc;
+  value_type *buf = alloc.allocate(static_cast<std::size_t>(h.count));
+  try {
+    if (!in.read(reinterpret_cast<char *>(buf),
+                 static_cast<std::streamsize>(h.body_size())))
+      throw std::runtime_error("rb_tree image: truncated");
+    tree.clear();
+    tree.insert(sorted_unique, buf, buf + h.count);
+  } catch (...) {
+    alloc.deallocate(buf, static_cast<std::size_t>(h.count));
+    throw;
+  }
+  alloc.deallocate(buf, static_cast<std::size_t>(h.count));
+}
+
+} // namespace image_detail
+
+/*
+ * A whole file, read only: mapped where there is mmap, and read into
+ * memory otherwise
+ */
+class mapped_image_file {
+ public:
+  explicit mapped_image_file(const std::string& path) : data_(nullptr) {
+#ifdef RB_TREE_IMAGE_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("rb_tree image: cannot open " + path);
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw std::runtime_error("rb_tree image: cannot stat " + path);
+    }
+    size_ = static_cast<std::size_t>(st.st_size);
+    if (size_ != 0) {
+      void *p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (p == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("rb_tree image: cannot map " + path);
+      }
+      data_ = static_cast<const unsigned char *>(p);
+    }
+    ::close(fd);
+#else
+    std::ifstream in(path.c_str(), std::ios::binary | std::ios::ate);
+    if (!in)
+      throw std::runtime_error("rb_tree image: cannot open " + path);
+    size_ = static_cast<std::size_t>(in.tellg());
+    unsigned char *p = new unsigned char[size_ != 0 ? size_ : 1];
+    in.seekg(0);
+    if (!in.read(reinterpret_cast<char *>(p),
+                 static_cast<std::streamsize>(size_))) {
+      delete[] p;
+      throw std::runtime_error("rb_tree image: cannot read " + path);
+    }
+    data_ = p;
+#endif
+  }
+
+  mapped_image_file(mapped_image_file&& other) noexcept
+    : data_(other.data_), size_(other.size_) {
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+
+  mapped_image_file& operator=(mapped_image_file&& other) noexcept {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    return *this;
+  }
+
+  mapped_image_file(const mapped_image_file&) = delete;
+  mapped_image_file& operator=(const mapped_image_file&) = delete;
+
+  ~mapped_image_file() {
+    if (data_ == nullptr)
+      return;
+#ifdef RB_TREE_IMAGE_MMAP
+    ::munmap(const_cast<unsigned char *>(data_), size_);
+#else
+    delete[] data_;
+#endif
+  }
+
+  /* The header, checked against the layout and the elements */
+  const tree_image_header& header(tree_image_layout layout,
+                                  std::size_t element_size,
+                                  std::size_t element_align) const {
+    if (size_ < sizeof(tree_image_header))
+      throw std::runtime_error("rb_tree image: truncated");
+    const tree_image_header& h =
+      *reinterpret_cast<const tree_image_header *>(data_);
+    h.check(layout, element_size, element_align);
+    if (!h.fits(size_ - sizeof(tree_image_header)))
+      throw std::runtime_error("rb_tree image: truncated");
+    return h;
+  }
+
+  const unsigned char *body() const {
+    return data_ + sizeof(tree_image_header);
+  }
+
+ private:
+  const unsigned char *data_;
+  std::size_t size_;
+}; // mapped_image_file
+
+/* Write the elements of tree in order */
+template <class T, class C, class A, class P>
+void serialize(const rb_tree<T, C, A, P>& tree, std::ostream& out) {
+  image_detail::write_image(out, tree_image_layout::in_order, tree.begin(),
+                            tree.size());
+}
+
+template <class T, class C, class A, class P>
+void serialize(const rb_btree<T, C, A, P>& tree, std::ostream& out) {
+  image_detail::write_image(out, tree_image_layout::in_order, tree.begin(),
+                            tree.size());
+}
+
+/* Write the array of a frozen tree as it is, for mapped_frozen_rb_tree */
+template <class T, class C, class A, class P>
+void serialize(const frozen_rb_tree<T, C, A, P>& tree, std::ostream& out) {
+  const T *first = tree.size() != 0 ? tree.data() + 1 : nullptr;
+  image_detail::write_image(out, tree_image_layout::eytzinger, first,
+                            tree.size());
+}
+
+template <class T, class C, class A, class P>
+void save(const rb_tree<T, C, A, P>& tree, const std::string& path) {
+  image_detail::save_image(tree, path);
+}
+
+template <class T, class C, class A, class P>
+void save(const rb_btree<T, C, A, P>& tree, const std::string& path) {
+  image_detail::save_image(tree, path);
+}
+
+template <class T, class C, class A, class P>
+void save(const frozen_rb_tree<T, C, A, P>& tree, const std::string& path) {
+  image_detail::save_image(tree, path);
+}
+
+/* Replace the elements of tree with those of an in-order image */
+template <class T, class C, class A, class P>
+void deserialize(rb_tree<T, C, A, P>& tree, std::istream& in) {
+  image_detail::read_image(tree, in);
+}
+
+template <class T, class C, class A, class P>
+void deserialize(rb_btree<T, C, A, P>& tree, std::istream& in) {
+  image_detail::read_image(tree, in);
+}
+
+/*
+ * Replace the elements of tree with those of an in-order image file,
+ * building the tree from the mapped file without another copy
+ */
+template <class T, class C, class A, class P>
+void load(rb_tree<T, C, A, P>& tree, const std::string& path) {
+  static_assert(rb_tree_trivial_image<T>::value,
+                "only the elements whose bytes are their value have images");
+  mapped_image_file file(path);
+  const tree_image_header& h =
+    file.header(tree_image_layout::in_order, sizeof(T), alignof(T));
+  const T *first = reinterpret_cast<const T *>(file.body());
+  tree.clear();
+  tree.insert(sorted_unique, first, first + h.count);
+}
+
+template <class T, class C, class A, class P>
+void load(rb_btree<T, C, A, P>& tree, const std::string& path) {
+  static_assert(rb_tree_trivial_image<T>::value,
+                "only the elements whose bytes are their value have images");
+  mapped_image_file file(path);
+  const tree_image_header& h =
+    file.header(tree_image_layout::in_order, sizeof(T), alignof(T));
+  const T *first = reinterpret_cast<const T *>(file.body());
+  tree.clear();
+  tree.insert(sorted_unique, first, first + h.count);
+}
+
+/*
+ * A frozen_rb_tree over the Eytzinger image of a file saved from one,
+ * with the lookups and iterators of frozen_rb_tree and nothing to build:
+ *   save(freeze(t), "ids.img");
+ *   ...
+ *   mapped_frozen_rb_tree<std::uint64_t> ids("ids.img");
+ *   bool known = ids.contains(42);
+ * The pages of the file are only read as the lookups reach them.
+ */
+template <class T,
+          class Compare = std::less<T>,
+          class Policy = default_policy>
+class mapped_frozen_rb_tree
+  : protected frozen_rb_tree<T, Compare, std::allocator<T>, Policy> {
+  typedef frozen_rb_tree<T, Compare, std::allocator<T>, Policy> base;
+
+  static_assert(rb_tree_trivial_image<T>::value,
+                "only the elements whose bytes are their value have images");
+
+ public:
+  typedef typename base::key_type key_type;
+  typedef typename base::value_type value_type;
+  typedef typename base::key_compare key_compare;
+  typedef typename base::size_type size_type;
+  typedef typename base::const_iterator const_iterator;
+  typedef typename base::iterator iterator;
+  typedef typename base::const_reverse_iterator const_reverse_iterator;
+  typedef typename base::reverse_iterator reverse_iterator;
+
+  explicit mapped_frozen_rb_tree(const std::string& path,
+                                 const key_compare& comp = key_compare())
+    : file_(path) {
+    const tree_image_header& h =
+      file_.header(tree_image_layout::eytzinger, sizeof(T), alignof(T));
+    this->comp_ = comp;
+    this->data_ = const_cast<T *>(reinterpret_cast<const T *>(file_.body()));
+    this->size_ = static_cast<size_type>(h.count);
+  }
+
+  mapped_frozen_rb_tree(mapped_frozen_rb_tree&& other) noexcept
+    : base(), file_(std::move(other.file_)) {
+    this->comp_ = other.comp_;
+    std::swap(this->data_, other.data_);
+    std::swap(this->size_, other.size_);
+  }
+
+  mapped_frozen_rb_tree& operator=(mapped_frozen_rb_tree&& other) noexcept {
+    std::swap(this->comp_, other.comp_);
+    std::swap(this->data_, other.data_);
+    std::swap(this->size_, other.size_);
+    std::swap(file_, other.file_);
+    return *this;
+  }
+
+  /* The elements belong to the file, not to the frozen tree */
+  ~mapped_frozen_rb_tree() {
+    this->data_ = nullptr;
+    this->size_ = 0;
+  }
+
+  using base::begin;
+  using base::end;
+  using base::cbegin;
+  using base::cend;
+  using base::rbegin;
+  using base::rend;
+  using base::crbegin;
+  using base::crend;
+  using base::lower_bound;
+  using base::upper_bound;
+  using base::find;
+  using base::count;
+  using base::contains;
+  using base::equal_range;
+  using base::key_comp;
+  using base::size;
+  using base::empty;
+  using base::data;
+
+ private:
+  mapped_image_file file_;
+}; // mapped_frozen_rb_tree
+
+} // namespace rb_tree
+
+#endif // RB_TREE_IMAGE_H
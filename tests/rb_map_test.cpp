@@ -0,0 +1,58 @@
+/*
+ * The map front end, whose mapped values are reached through the nodes of
+ * the tree. It breaks first when the node layout changes.
+ */
+#include <cassert>
+#include <string>
+
+#include "rb_map.h"
+
+using rb_tree::rb_map;
+using rb_tree::rb_multimap;
+
+static void test_insert_or_assign() {
+  rb_map<int, std::string> m;
+
+  auto r = m.insert_or_assign(1, "a");
+  assert(r.second && r.first->second == "a");
+  r = m.insert_or_assign(1, "b");
+  assert(!r.second && r.first->second == "b");
+  assert(m.size() == 1 && m.at(1) == "b");
+
+  auto it = m.insert_or_assign(m.end(), 2, "c");
+  assert(it->first == 2 && it->second == "c");
+  it = m.insert_or_assign(m.end(), 2, "d");
+  assert(it->second == "d" && m.size() == 2);
+}
+
+static void test_try_emplace() {
+  rb_map<int, std::string> m;
+
+  auto r = m.try_emplace(1, 3, 'x');
+  assert(r.second && r.first->second == "xxx");
+  r = m.try_emplace(1, "y");
+  assert(!r.second && r.first->second == "xxx");
+
+  m[2] = "z";
+  m[2] += "z";
+  assert(m.size() == 2 && m.at(2) == "zz");
+}
+
+static void test_multimap() {
+  rb_multimap<int, int> m;
+  for (int i = 0; i < 10; ++i)
+    m.insert(std::make_pair(i % 3, i));
+
+  assert(m.size() == 10 && m.count(0) == 4);
+  auto range = m.equal_range(1);
+  int expected = 1;
+  for (auto it = range.first; it != range.second; ++it, expected += 3)
+    assert(it->second == expected);
+}
+
+int main() {
+  test_insert_or_assign();
+  test_try_emplace();
+  test_multimap();
+  return 0;
+}